@@ -0,0 +1,587 @@
+/* Control-plane benchmark of wifi_drv: drives scan, connect/disconnect and virtual interface add/change/del
+ * cycles through nl80211 at the given concurrency and prints throughput and latency percentiles of every stage
+ * as JSON or CSV.
+ *
+ * Build: make bench (needs libnl-genl-3 development files)
+ * Usage: wifi_drv_bench -o scan|connect|iface -i <ifname> [-i <ifname> ...] [-t threads] [-n cycles]
+ *                       [-s ssid] [-T timeout_ms] [-f json|csv]
+ *
+ * Thread N works on interface N % <number of interfaces>. Operations of one radio are serialized by the driver,
+ * so concurrent scans or connects on one interface are expected to fail with EBUSY/EALREADY; give several
+ * interfaces(eg. radios=4) to measure parallel radios. Interfaces of scan and connect should be up. */
+
+#include <errno.h>
+#include <getopt.h>
+#include <math.h>
+#include <net/if.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <linux/nl80211.h>
+#include <netlink/genl/ctrl.h>
+#include <netlink/genl/genl.h>
+#include <netlink/netlink.h>
+
+#define BENCH_MAX_IFACES 16
+#define BENCH_MAX_STAGES 3
+
+struct bench_op {
+    const char *name;
+    const char *stages[BENCH_MAX_STAGES];
+    unsigned int n_stages;
+    const char *mcast_group; /* events that complete the stages */
+};
+
+enum bench_op_id {
+    BENCH_OP_SCAN,
+    BENCH_OP_CONNECT,
+    BENCH_OP_IFACE,
+};
+
+static const struct bench_op bench_ops[] = {
+        [BENCH_OP_SCAN] = {"scan", {"scan"}, 1, "scan"},
+        [BENCH_OP_CONNECT] = {"connect", {"connect", "disconnect"}, 2, "mlme"},
+        [BENCH_OP_IFACE] = {"iface", {"iface_add", "iface_change", "iface_del"}, 3, NULL},
+};
+
+struct bench_iface {
+    char name[IF_NAMESIZE];
+    unsigned int ifindex;
+    unsigned int wiphy;
+};
+
+struct bench_config {
+    enum bench_op_id op;
+    struct bench_iface ifaces[BENCH_MAX_IFACES];
+    unsigned int n_ifaces;
+    unsigned int threads;
+    unsigned int cycles;
+    const char *ssid;
+    int timeout_ms;
+    bool csv;
+};
+
+/* Latencies of every stage of every cycle of one thread, in ns, 0 for failed stages. */
+struct bench_thread {
+    pthread_t tid;
+    unsigned int id;
+    const struct bench_config *cfg;
+    const struct bench_iface *iface;
+    struct nl_sock *cmd_sk;
+    struct nl_sock *evt_sk;
+    int family;
+    unsigned int new_ifindex; /* interface created by the iface_add stage */
+    uint64_t *lat[BENCH_MAX_STAGES];
+    unsigned int errors[BENCH_MAX_STAGES];
+    unsigned int ok_cycles;
+    int last_err;
+};
+
+/* Event the thread waits for: one of two nl80211 commands on its interface. */
+struct bench_wait {
+    unsigned int ifindex;
+    uint8_t cmd;
+    uint8_t fail_cmd;
+    bool done;
+    bool failed;
+};
+
+static pthread_barrier_t bench_start;
+
+static uint64_t bench_now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static int bench_read_wiphy(struct bench_iface *iface) {
+    char path[64 + IF_NAMESIZE];
+    FILE *f;
+    int ret;
+
+    snprintf(path, sizeof(path), "/sys/class/net/%s/phy80211/index", iface->name);
+    f = fopen(path, "r");
+    if (f == NULL) {
+        return -errno;
+    }
+    ret = fscanf(f, "%u", &iface->wiphy) == 1 ? 0 : -EINVAL;
+    fclose(f);
+    return ret;
+}
+
+static int bench_sock_open(struct bench_thread *t) {
+    const char *group = bench_ops[t->cfg->op].mcast_group;
+    int grp;
+
+    t->cmd_sk = nl_socket_alloc();
+    if (t->cmd_sk == NULL || genl_connect(t->cmd_sk)) {
+        return -ENOLINK;
+    }
+    t->family = genl_ctrl_resolve(t->cmd_sk, "nl80211");
+    if (t->family < 0) {
+        return -ENOENT;
+    }
+    if (group == NULL) {
+        return 0;
+    }
+
+    /* events are received on their own socket, so they don't mix with acks of the commands */
+    t->evt_sk = nl_socket_alloc();
+    if (t->evt_sk == NULL || genl_connect(t->evt_sk)) {
+        return -ENOLINK;
+    }
+    grp = genl_ctrl_resolve_grp(t->evt_sk, "nl80211", group);
+    if (grp < 0 || nl_socket_add_membership(t->evt_sk, grp)) {
+        return -ENOENT;
+    }
+    nl_socket_disable_seq_check(t->evt_sk);
+    nl_socket_set_nonblocking(t->evt_sk);
+    return 0;
+}
+
+static void bench_sock_close(struct bench_thread *t) {
+    nl_socket_free(t->evt_sk);
+    nl_socket_free(t->cmd_sk);
+}
+
+static int bench_ack(struct nl_msg *msg, void *arg) {
+    *(int *)arg = 0;
+    return NL_STOP;
+}
+
+static int bench_nlerr(struct sockaddr_nl *nla, struct nlmsgerr *nlerr, void *arg) {
+    *(int *)arg = nlerr->error;
+    return NL_STOP;
+}
+
+/* Sends nl80211 command "msg" and waits for its ack, returns 0 or negative errno of the kernel.
+ * libnl maps errno to its own codes, so the error is taken from the ack message itself. */
+static int bench_cmd(struct bench_thread *t, struct nl_msg *msg) {
+    struct nl_cb *cb = nl_cb_alloc(NL_CB_DEFAULT);
+    int err = -ENOMEM;
+
+    if (cb == NULL) {
+        goto l_error_cb;
+    }
+    err = -EIO;
+    if (nl_send_auto(t->cmd_sk, msg) < 0) {
+        goto l_error_send;
+    }
+    err = 1;
+    nl_cb_set(cb, NL_CB_ACK, NL_CB_CUSTOM, bench_ack, &err);
+    nl_cb_err(cb, NL_CB_CUSTOM, bench_nlerr, &err);
+    while (err > 0) {
+        if (nl_recvmsgs(t->cmd_sk, cb) < 0 && err > 0) {
+            err = -EIO;
+        }
+    }
+
+    l_error_send:
+    nl_cb_put(cb);
+    l_error_cb:
+    nlmsg_free(msg);
+    return err;
+}
+
+static struct nl_msg *bench_msg(struct bench_thread *t, uint8_t cmd, unsigned int ifindex) {
+    struct nl_msg *msg = nlmsg_alloc();
+
+    if (msg == NULL) {
+        return NULL;
+    }
+    genlmsg_put(msg, NL_AUTO_PORT, NL_AUTO_SEQ, t->family, 0, 0, cmd, 0);
+    if (ifindex) {
+        nla_put_u32(msg, NL80211_ATTR_IFINDEX, ifindex);
+    }
+    return msg;
+}
+
+static int bench_event(struct nl_msg *msg, void *arg) {
+    struct genlmsghdr *gnlh = nlmsg_data(nlmsg_hdr(msg));
+    struct nlattr *tb[NL80211_ATTR_MAX + 1];
+    struct bench_wait *wait = arg;
+
+    nla_parse(tb, NL80211_ATTR_MAX, genlmsg_attrdata(gnlh, 0), genlmsg_attrlen(gnlh, 0), NULL);
+    if (tb[NL80211_ATTR_IFINDEX] == NULL || nla_get_u32(tb[NL80211_ATTR_IFINDEX]) != wait->ifindex) {
+        return NL_SKIP;
+    }
+    if (gnlh->cmd == wait->cmd) {
+        wait->done = true;
+        /* connect result carries the status, timeout is reported as a connect event as well */
+        wait->failed = tb[NL80211_ATTR_TIMED_OUT] != NULL ||
+                       (tb[NL80211_ATTR_STATUS_CODE] != NULL && nla_get_u16(tb[NL80211_ATTR_STATUS_CODE]) != 0);
+    } else if (wait->fail_cmd && gnlh->cmd == wait->fail_cmd) {
+        wait->done = true;
+        wait->failed = true;
+    }
+    return NL_SKIP;
+}
+
+/* Waits for the event described by "wait" on the event socket, returns 0, -EIO if the operation failed
+ * or -ETIMEDOUT. */
+static int bench_wait_event(struct bench_thread *t, struct bench_wait *wait) {
+    struct pollfd pfd = {.fd = nl_socket_get_fd(t->evt_sk), .events = POLLIN};
+    uint64_t deadline = bench_now_ns() + (uint64_t)t->cfg->timeout_ms * 1000000ull;
+    uint64_t now;
+
+    nl_socket_modify_cb(t->evt_sk, NL_CB_VALID, NL_CB_CUSTOM, bench_event, wait);
+    while (!wait->done) {
+        now = bench_now_ns();
+        if (now >= deadline || poll(&pfd, 1, (deadline - now + 999999) / 1000000) <= 0) {
+            return -ETIMEDOUT;
+        }
+        nl_recvmsgs_default(t->evt_sk);
+    }
+    return wait->failed ? -EIO : 0;
+}
+
+/* Drops events left from earlier cycles, eg. a late scan result after a timeout. */
+static void bench_drain_events(struct bench_thread *t) {
+    struct bench_wait wait = {};
+
+    nl_socket_modify_cb(t->evt_sk, NL_CB_VALID, NL_CB_CUSTOM, bench_event, &wait);
+    while (nl_recvmsgs_default(t->evt_sk) >= 0) {
+    }
+}
+
+/* Runs one command that completes asynchronously: sends it and waits for "done_cmd" or "fail_cmd" event. */
+static int bench_async(struct bench_thread *t, struct nl_msg *msg, uint8_t done_cmd, uint8_t fail_cmd) {
+    struct bench_wait wait = {
+            .ifindex = t->iface->ifindex,
+            .cmd = done_cmd,
+            .fail_cmd = fail_cmd,
+    };
+    int err;
+
+    if (msg == NULL) {
+        return -ENOMEM;
+    }
+    bench_drain_events(t);
+    err = bench_cmd(t, msg);
+    if (err) {
+        return err;
+    }
+    return bench_wait_event(t, &wait);
+}
+
+static int bench_scan(struct bench_thread *t, unsigned int stage) {
+    struct nl_msg *msg = bench_msg(t, NL80211_CMD_TRIGGER_SCAN, t->iface->ifindex);
+
+    return bench_async(t, msg, NL80211_CMD_NEW_SCAN_RESULTS, NL80211_CMD_SCAN_ABORTED);
+}
+
+static int bench_connect(struct bench_thread *t, unsigned int stage) {
+    struct nl_msg *msg;
+
+    if (stage == 0) {
+        msg = bench_msg(t, NL80211_CMD_CONNECT, t->iface->ifindex);
+        if (msg != NULL) {
+            nla_put(msg, NL80211_ATTR_SSID, strlen(t->cfg->ssid), t->cfg->ssid);
+        }
+        return bench_async(t, msg, NL80211_CMD_CONNECT, 0);
+    }
+
+    msg = bench_msg(t, NL80211_CMD_DISCONNECT, t->iface->ifindex);
+    if (msg != NULL) {
+        nla_put_u16(msg, NL80211_ATTR_REASON_CODE, 3 /* WLAN_REASON_DEAUTH_LEAVING */);
+    }
+    return bench_async(t, msg, NL80211_CMD_DISCONNECT, 0);
+}
+
+/* Adds a station interface to the radio of the thread's interface, turns it into AP and deletes it.
+ * Commands of these stages complete synchronously in the driver, the ack is the end of the stage. */
+static int bench_iface(struct bench_thread *t, unsigned int stage) {
+    char name[IF_NAMESIZE];
+    struct nl_msg *msg;
+    int err;
+
+    snprintf(name, sizeof(name), "wdb%u", t->id);
+    switch (stage) {
+    case 0:
+        msg = bench_msg(t, NL80211_CMD_NEW_INTERFACE, 0);
+        if (msg == NULL) {
+            return -ENOMEM;
+        }
+        nla_put_u32(msg, NL80211_ATTR_WIPHY, t->iface->wiphy);
+        nla_put_string(msg, NL80211_ATTR_IFNAME, name);
+        nla_put_u32(msg, NL80211_ATTR_IFTYPE, NL80211_IFTYPE_STATION);
+        t->new_ifindex = 0;
+        err = bench_cmd(t, msg);
+        if (err) {
+            return err;
+        }
+        t->new_ifindex = if_nametoindex(name);
+        return t->new_ifindex ? 0 : -ENODEV;
+    case 1:
+        if (t->new_ifindex == 0) {
+            return -ENODEV;
+        }
+        msg = bench_msg(t, NL80211_CMD_SET_INTERFACE, t->new_ifindex);
+        if (msg == NULL) {
+            return -ENOMEM;
+        }
+        nla_put_u32(msg, NL80211_ATTR_IFTYPE, NL80211_IFTYPE_AP);
+        return bench_cmd(t, msg);
+    default:
+        if (t->new_ifindex == 0) {
+            return -ENODEV;
+        }
+        msg = bench_msg(t, NL80211_CMD_DEL_INTERFACE, t->new_ifindex);
+        return msg != NULL ? bench_cmd(t, msg) : -ENOMEM;
+    }
+}
+
+static int (*const bench_stage_fn[])(struct bench_thread *, unsigned int) = {
+        [BENCH_OP_SCAN] = bench_scan,
+        [BENCH_OP_CONNECT] = bench_connect,
+        [BENCH_OP_IFACE] = bench_iface,
+};
+
+static void *bench_thread_fn(void *arg) {
+    struct bench_thread *t = arg;
+    const struct bench_op *op = &bench_ops[t->cfg->op];
+    unsigned int i, s;
+    uint64_t start;
+    bool ok;
+    int err;
+
+    pthread_barrier_wait(&bench_start);
+    for (i = 0; i < t->cfg->cycles; i++) {
+        ok = true;
+        for (s = 0; s < op->n_stages; s++) {
+            start = bench_now_ns();
+            err = bench_stage_fn[t->cfg->op](t, s);
+            if (err) {
+                t->errors[s]++;
+                t->last_err = err;
+                t->lat[s][i] = 0;
+                ok = false;
+                continue;
+            }
+            t->lat[s][i] = bench_now_ns() - start;
+        }
+        t->ok_cycles += ok;
+    }
+    return NULL;
+}
+
+static int bench_cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/* Nearest-rank percentile of sorted "lat", in us. */
+static double bench_pct(const uint64_t *lat, size_t n, double p) {
+    size_t rank;
+
+    if (n == 0) {
+        return 0;
+    }
+    rank = (size_t)ceil(p * n);
+    return lat[rank ? rank - 1 : 0] / 1000.0;
+}
+
+static void bench_report(const struct bench_config *cfg, struct bench_thread *threads, double elapsed_s) {
+    const struct bench_op *op = &bench_ops[cfg->op];
+    size_t total = (size_t)cfg->threads * cfg->cycles;
+    uint64_t *lat = calloc(total ? total : 1, sizeof(*lat));
+    unsigned int s, t, i, errors;
+    size_t n, ok_cycles = 0;
+    double sum;
+
+    if (lat == NULL) {
+        return;
+    }
+    for (t = 0; t < cfg->threads; t++) {
+        ok_cycles += threads[t].ok_cycles;
+    }
+    if (cfg->csv) {
+        printf("op,stage,threads,ifaces,cycles,ok,errors,elapsed_s,throughput_per_s,mean_us,p50_us,p99_us,p999_us,"
+               "max_us\n");
+    } else {
+        printf("{\"op\":\"%s\",\"threads\":%u,\"ifaces\":%u,\"cycles\":%zu,\"ok_cycles\":%zu,"
+               "\"elapsed_s\":%.6f,\"throughput_per_s\":%.3f,\"stages\":[",
+               op->name, cfg->threads, cfg->n_ifaces, total, ok_cycles, elapsed_s,
+               elapsed_s > 0 ? ok_cycles / elapsed_s : 0);
+    }
+
+    for (s = 0; s < op->n_stages; s++) {
+        n = 0;
+        errors = 0;
+        sum = 0;
+        for (t = 0; t < cfg->threads; t++) {
+            errors += threads[t].errors[s];
+            for (i = 0; i < cfg->cycles; i++) {
+                if (threads[t].lat[s][i]) {
+                    lat[n++] = threads[t].lat[s][i];
+                    sum += threads[t].lat[s][i];
+                }
+            }
+        }
+        qsort(lat, n, sizeof(*lat), bench_cmp_u64);
+
+        if (cfg->csv) {
+            printf("%s,%s,%u,%u,%zu,%zu,%u,%.6f,%.3f,%.3f,%.3f,%.3f,%.3f,%.3f\n", op->name, op->stages[s],
+                   cfg->threads, cfg->n_ifaces, total, n, errors, elapsed_s, elapsed_s > 0 ? n / elapsed_s : 0,
+                   n ? sum / n / 1000.0 : 0, bench_pct(lat, n, 0.50), bench_pct(lat, n, 0.99),
+                   bench_pct(lat, n, 0.999), n ? lat[n - 1] / 1000.0 : 0);
+        } else {
+            printf("%s{\"name\":\"%s\",\"ok\":%zu,\"errors\":%u,\"throughput_per_s\":%.3f,\"mean_us\":%.3f,"
+                   "\"p50_us\":%.3f,\"p99_us\":%.3f,\"p999_us\":%.3f,\"max_us\":%.3f}",
+                   s ? "," : "", op->stages[s], n, errors, elapsed_s > 0 ? n / elapsed_s : 0,
+                   n ? sum / n / 1000.0 : 0, bench_pct(lat, n, 0.50), bench_pct(lat, n, 0.99),
+                   bench_pct(lat, n, 0.999), n ? lat[n - 1] / 1000.0 : 0);
+        }
+    }
+    if (!cfg->csv) {
+        printf("]}\n");
+    }
+    free(lat);
+}
+
+static void bench_usage(const char *prog) {
+    fprintf(stderr,
+            "usage: %s -o scan|connect|iface -i <ifname> [-i <ifname> ...] [-t threads] [-n cycles]\n"
+            "          [-s ssid] [-T timeout_ms] [-f json|csv]\n",
+            prog);
+}
+
+static int bench_parse(struct bench_config *cfg, int argc, char **argv) {
+    struct bench_iface *iface;
+    int opt;
+
+    cfg->op = BENCH_OP_SCAN;
+    cfg->threads = 1;
+    cfg->cycles = 100;
+    cfg->ssid = "WiFi";
+    cfg->timeout_ms = 5000;
+
+    while ((opt = getopt(argc, argv, "o:i:t:n:s:T:f:h")) != -1) {
+        switch (opt) {
+        case 'o':
+            if (strcmp(optarg, "scan") == 0) {
+                cfg->op = BENCH_OP_SCAN;
+            } else if (strcmp(optarg, "connect") == 0) {
+                cfg->op = BENCH_OP_CONNECT;
+            } else if (strcmp(optarg, "iface") == 0) {
+                cfg->op = BENCH_OP_IFACE;
+            } else {
+                return -EINVAL;
+            }
+            break;
+        case 'i':
+            if (cfg->n_ifaces == BENCH_MAX_IFACES || strlen(optarg) >= IF_NAMESIZE) {
+                return -EINVAL;
+            }
+            iface = &cfg->ifaces[cfg->n_ifaces++];
+            strcpy(iface->name, optarg);
+            iface->ifindex = if_nametoindex(iface->name);
+            if (iface->ifindex == 0 || bench_read_wiphy(iface)) {
+                fprintf(stderr, "%s is not a wireless interface\n", iface->name);
+                return -ENODEV;
+            }
+            break;
+        case 't':
+            cfg->threads = strtoul(optarg, NULL, 0);
+            break;
+        case 'n':
+            cfg->cycles = strtoul(optarg, NULL, 0);
+            break;
+        case 's':
+            if (strlen(optarg) > 32) {
+                return -EINVAL;
+            }
+            cfg->ssid = optarg;
+            break;
+        case 'T':
+            cfg->timeout_ms = atoi(optarg);
+            break;
+        case 'f':
+            cfg->csv = strcmp(optarg, "csv") == 0;
+            break;
+        default:
+            return -EINVAL;
+        }
+    }
+    if (cfg->n_ifaces == 0 || cfg->threads == 0 || cfg->cycles == 0 || cfg->timeout_ms <= 0) {
+        return -EINVAL;
+    }
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    struct bench_config cfg = {};
+    struct bench_thread *threads;
+    unsigned int t, s;
+    uint64_t start;
+    double elapsed_s;
+    int ret = EXIT_FAILURE;
+
+    if (bench_parse(&cfg, argc, argv)) {
+        bench_usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    threads = calloc(cfg.threads, sizeof(*threads));
+    if (threads == NULL) {
+        return EXIT_FAILURE;
+    }
+    for (t = 0; t < cfg.threads; t++) {
+        threads[t].id = t;
+        threads[t].cfg = &cfg;
+        threads[t].iface = &cfg.ifaces[t % cfg.n_ifaces];
+        for (s = 0; s < bench_ops[cfg.op].n_stages; s++) {
+            threads[t].lat[s] = calloc(cfg.cycles, sizeof(uint64_t));
+            if (threads[t].lat[s] == NULL) {
+                goto l_error_threads;
+            }
+        }
+        /* sockets are opened and subscribed before the start, setup is not measured */
+        if (bench_sock_open(&threads[t])) {
+            fprintf(stderr, "nl80211 is not available\n");
+            goto l_error_threads;
+        }
+    }
+
+    pthread_barrier_init(&bench_start, NULL, cfg.threads + 1);
+    for (t = 0; t < cfg.threads; t++) {
+        if (pthread_create(&threads[t].tid, NULL, bench_thread_fn, &threads[t])) {
+            /* threads that are already started wait on the barrier forever */
+            fprintf(stderr, "failed to start thread %u\n", t);
+            exit(EXIT_FAILURE);
+        }
+    }
+    pthread_barrier_wait(&bench_start);
+    start = bench_now_ns();
+    for (t = 0; t < cfg.threads; t++) {
+        pthread_join(threads[t].tid, NULL);
+    }
+    elapsed_s = (bench_now_ns() - start) / 1e9;
+    pthread_barrier_destroy(&bench_start);
+
+    bench_report(&cfg, threads, elapsed_s);
+    ret = EXIT_SUCCESS;
+    for (t = 0; t < cfg.threads; t++) {
+        if (threads[t].last_err) {
+            fprintf(stderr, "thread %u: last error: %s\n", t, strerror(-threads[t].last_err));
+        }
+    }
+
+    l_error_threads:
+    for (t = 0; t < cfg.threads; t++) {
+        for (s = 0; s < BENCH_MAX_STAGES; s++) {
+            free(threads[t].lat[s]);
+        }
+        bench_sock_close(&threads[t]);
+    }
+    free(threads);
+    return ret;
+}
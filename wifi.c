@@ -2,36 +2,716 @@
 
 #include <net/cfg80211.h> /* wifi and probably everything that would required for FullMAC driver */
 #include <linux/skbuff.h>
+#include <linux/netdevice.h>
+#include <linux/ethtool.h>
+#include <linux/etherdevice.h>
+#include <linux/if_vlan.h>
+#include <linux/cpumask.h>
+#include <linux/u64_stats_sync.h>
+#include <linux/random.h>
+#include <linux/mm.h> /* kvcalloc */
+#include <asm/unaligned.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/ktime.h>
+#include <net/netdev_rx_queue.h>
+#include <linux/rhashtable.h>
+#include <linux/jhash.h>
+#include <linux/hrtimer.h>
+#include <linux/rculist.h>
+#include <net/page_pool/helpers.h>
+#include <linux/bpf.h>
+#include <linux/bpf_trace.h>
+#include <linux/filter.h>
+#include <net/xdp.h>
+#include <linux/eventfd.h>
+#include <linux/miscdevice.h>
+#include <linux/fs.h>
+#include <linux/vmalloc.h>
+#include <net/inet_ecn.h>
+#include <net/codel.h>
+#include <net/codel_impl.h>
 
 #include <linux/workqueue.h> /* work_struct */
-#include <linux/semaphore.h>
+#include <linux/spinlock.h>
+#include <linux/mutex.h>
+
+#include "wifi_drv_fw.h"
+
+#define CREATE_TRACE_POINTS
+#include "wifi_trace.h"
 
 #define WIFI_NAME "wifi_drv"
 #define NDEV_NAME "wifi_drv%d"
 #define SSID_DUMMY "WiFi"
 #define SSID_DUMMY_SIZE (sizeof("WiFi") - 1)
 
+/* Number of slots in every TX/RX ring, must be a power of 2. */
+#define WIFI_DRV_TX_RING_SIZE 256
+#define WIFI_DRV_RX_RING_SIZE 256
+/* Limits of ring sizes set with ethtool -G */
+#define WIFI_DRV_RING_MIN 16
+#define WIFI_DRV_RING_MAX 4096
+/* Receive buffer is one page from the page_pool of the queue, frame is placed after XDP headroom
+ * and skb_shared_info lives at the end of the page. Longer and GSO frames are passed to the stack as they came. */
+#define WIFI_DRV_RX_HEADROOM XDP_PACKET_HEADROOM
+#define WIFI_DRV_RX_BUF_MAX (PAGE_SIZE - WIFI_DRV_RX_HEADROOM - SKB_DATA_ALIGN(sizeof(struct skb_shared_info)))
+#define WIFI_DRV_MAX_QUEUES 64
+/* Interfaces of one radio: stations created through add_virtual_intf() and one AP, see wifi_drv_iface_combinations */
+#define WIFI_DRV_MAX_IFACES 512
+
+/* Offloads of the net_device. Frames never leave the host, so checksum is never computed and GSO frames are
+ * delivered to the receiver as they are, like veth does. Fragmented skbs go through the rings without linearizing. */
+#define WIFI_DRV_FEATURES (NETIF_F_SG | NETIF_F_FRAGLIST | NETIF_F_HW_CSUM | NETIF_F_RXCSUM | NETIF_F_HIGHDMA | \
+                           NETIF_F_GSO_SOFTWARE | NETIF_F_GSO_ENCAP_ALL)
+
+static unsigned int queues;
+module_param(queues, uint, 0444);
+MODULE_PARM_DESC(queues, "Number of TX/RX queue pairs per network device, 0 - one per online CPU (max 64)");
+
+/* TX aggregation, see wifi_drv_agg_add() */
+#define WIFI_DRV_AGG_SLOTS 8 /* aggregates open at once per queue */
+#define WIFI_DRV_AGG_MAX_FRAMES 64 /* BlockAck window of HT */
+#define WIFI_DRV_AGG_MAX_BYTES ((1 << (13 + IEEE80211_HT_MAX_AMPDU_64K)) - 1)
+#define WIFI_DRV_AGG_HIST_BUCKETS 7 /* 1, 2-3, 4-7 ... 64 frames */
+
+static unsigned int ampdu_frames = 32;
+module_param(ampdu_frames, uint, 0644);
+MODULE_PARM_DESC(ampdu_frames, "Frames per simulated A-MPDU on the transmit path, 0 or 1 - no aggregation (max 64)");
+
+static unsigned int ampdu_timeout_us = 200;
+module_param(ampdu_timeout_us, uint, 0644);
+MODULE_PARM_DESC(ampdu_timeout_us, "Time partial A-MPDU waits for more frames of its destination, us");
+
+#define WIFI_DRV_MAX_RADIOS 1024
+
+static unsigned int radios = 1;
+module_param(radios, uint, 0444);
+MODULE_PARM_DESC(radios, "Number of independent wifi devices to create (max 1024)");
+
+#define WIFI_DRV_MAX_STATIONS 65536
+
+/* AP transmit path: every station has a queue per TID(802.1d priority), stations are served by deficit round robin
+ * in airtime, see wifi_drv_airtime_run(). */
+#define WIFI_DRV_NUM_TIDS 8
+#define WIFI_DRV_TID_LIMIT 1024 /* frames */
+#define WIFI_DRV_AIRTIME_QUANTUM_US 300
+/* air is "reserved" this far ahead, so frames are sent in bursts instead of one timer per frame */
+#define WIFI_DRV_AIRTIME_BURST_NS (1000 * NSEC_PER_USEC)
+
+static unsigned int ap_stations;
+module_param(ap_stations, uint, 0444);
+MODULE_PARM_DESC(ap_stations, "Number of synthetic stations associated with AP interface when it starts (max 65536)");
+
+/* Simulated air medium, see wifi_drv_medium_tx() */
+#define WIFI_DRV_WHEEL_SLOTS 1024
+#define WIFI_DRV_MEDIUM_MAX_CHAN 256
+
+static bool medium;
+module_param(medium, bool, 0444);
+MODULE_PARM_DESC(medium, "Deliver frames through the simulated air medium shared by all radios instead of STA<->AP loopback");
+
+static unsigned int medium_latency_us = 1000;
+module_param(medium_latency_us, uint, 0644);
+MODULE_PARM_DESC(medium_latency_us, "Propagation delay of the medium, us");
+
+static unsigned int medium_loss_ppm;
+module_param(medium_loss_ppm, uint, 0644);
+MODULE_PARM_DESC(medium_loss_ppm, "Frame loss rate of the medium, parts per million");
+
+static unsigned int medium_bandwidth_kbps;
+module_param(medium_bandwidth_kbps, uint, 0644);
+MODULE_PARM_DESC(medium_bandwidth_kbps, "Bandwidth of every channel, kbit/s, 0 - unlimited");
+
+static unsigned int medium_tick_us = 100;
+module_param(medium_tick_us, uint, 0444);
+MODULE_PARM_DESC(medium_tick_us, "Resolution of the medium timer wheel, us. Frames delayed more than 1024 ticks are dropped");
+
+#define WIFI_DRV_MAX_BSS 65536
+/* BSSes reported to cfg80211 between two cond_resched() */
+#define WIFI_DRV_BSS_BATCH 64
+
+static unsigned int bss_count = 1;
+module_param(bss_count, uint, 0444);
+MODULE_PARM_DESC(bss_count, "Number of BSSes every scan reports, the first one is always the \"" SSID_DUMMY "\" network (max 65536)");
+
+static char *bss_ssid_prefix = "WiFi-";
+module_param(bss_ssid_prefix, charp, 0444);
+MODULE_PARM_DESC(bss_ssid_prefix, "SSID of the synthetic BSS number N is <prefix>N");
+
+static int bss_signal_min = -9000;
+module_param(bss_signal_min, int, 0444);
+MODULE_PARM_DESC(bss_signal_min, "Lowest signal of synthetic BSSes, mBm");
+
+static int bss_signal_max = -3000;
+module_param(bss_signal_max, int, 0444);
+MODULE_PARM_DESC(bss_signal_max, "Highest signal of synthetic BSSes, mBm");
+
+static unsigned int scan_dwell_ms = 30;
+module_param(scan_dwell_ms, uint, 0644);
+MODULE_PARM_DESC(scan_dwell_ms, "Time scan spends on every channel, ms");
+
+static unsigned int scan_passive_dwell_ms = 110;
+module_param(scan_passive_dwell_ms, uint, 0644);
+MODULE_PARM_DESC(scan_passive_dwell_ms, "Time scan spends on passive(no-IR and DFS) channels, ms");
+
+static bool scan_parallel_bands = true;
+module_param(scan_parallel_bands, bool, 0644);
+MODULE_PARM_DESC(scan_parallel_bands, "Scan bands concurrently unless the scan asks for low power, otherwise one after another");
+
+/* Scheduled scan limits advertised to cfg80211, see nvf_sched_scan_start() */
+#define WIFI_DRV_SCHED_SCAN_SSIDS 16
+#define WIFI_DRV_SCHED_SCAN_MATCH_SETS 16
+#define WIFI_DRV_SCHED_SCAN_PLANS 4
+#define WIFI_DRV_SCHED_SCAN_MAX_INTERVAL 3600 /* s */
+#define WIFI_DRV_SCHED_SCAN_MAX_ITERATIONS 1000
+
+/* Management exchanges of emulated connect: authentication, 802.1X, (re)association and 4-way handshake.
+ * Cached PMKSA lets the station skip 802.1X, FT roam skips 802.1X and 4-way handshake, see wifi_drv_associate(). */
+#define WIFI_DRV_AUTH_FRAMES 2
+#define WIFI_DRV_8021X_FRAMES 8
+#define WIFI_DRV_ASSOC_FRAMES 2
+#define WIFI_DRV_4WAY_FRAMES 4
+#define WIFI_DRV_MAX_PMKIDS 32
+/* BSSes remembered by the index of one wifi */
+#define WIFI_DRV_MAX_BSS_INDEX (2 * WIFI_DRV_MAX_BSS)
+
+static unsigned int assoc_frame_us = 100;
+module_param(assoc_frame_us, uint, 0644);
+MODULE_PARM_DESC(assoc_frame_us, "Time of every management frame exchange of emulated connect and roam, us");
+
+/* SSID as hash key, unused bytes are zero */
+struct wifi_drv_ssid_key {
+    u8 len;
+    u8 ssid[IEEE80211_MAX_SSID_LEN];
+};
+
+/* Synthetic BSS. Everything cfg80211_inform_bss_data() needs is prepared once at module load,
+ * so scan only walks the table. */
+struct wifi_drv_bss {
+    u8 bssid[ETH_ALEN];
+    s32 signal;
+    struct ieee80211_channel *chan;
+    u8 ie_len;
+    /* SSID element only, +1 for terminating zero of scnprintf() */
+    u8 ie[2 + IEEE80211_MAX_SSID_LEN + 1];
+};
+
+/* Entry of the PMKSA cache, see nvf_set_pmksa() */
+struct wifi_drv_pmksa {
+    u8 bssid[ETH_ALEN];
+    u8 pmkid[WLAN_PMKID_LEN];
+};
+
+/* Microbenchmarks of "bench" file in debugfs, see wifi_drv_bench_write() */
+#define WIFI_DRV_BENCH_DEFAULT_OPS 10000
+#define WIFI_DRV_BENCH_MAX_OPS 100000000
+/* ops timed at once, the benchmark may reschedule between batches. Benchmarks on the workqueue run one batch per
+ * work item, so work of the wifi queued meanwhile is not held up for the whole run. */
+#define WIFI_DRV_BENCH_BATCH 64
+
+enum wifi_drv_bench_id {
+    WIFI_DRV_BENCH_XMIT,
+    WIFI_DRV_BENCH_INFORM_BSS,
+    WIFI_DRV_BENCH_SCAN,
+    WIFI_DRV_BENCH_MAX,
+};
+
+struct wifi_drv_bench_result {
+    u64 ops;
+    u64 failed;
+    u64 ns; /* spent in the measured callback */
+};
+
+/* Channel walk of one band of the scan request, see wifi_drv_scan_band_routine() */
+struct wifi_drv_scan_band {
+    struct delayed_work work;
+    struct wifi_drv_context *wifi_drv;
+    enum nl80211_band band; /* NUM_NL80211_BANDS walks channels of all bands: serial scan */
+    unsigned int idx; /* channel of scan_request that is "dwelled" now */
+};
+
 struct wifi_drv_context {
     struct wifi *wifi;
     struct net_device *ndev;
+    /* AP interface created through add_virtual_intf(), peer of ndev in the loopback datapath. */
+    struct net_device __rcu *ap_ndev;
+    /* registry of all network devices of the radio, see wifi_drv_iface_add(). Changed under RTNL,
+     * lookups and list walks are lock-free under RCU. */
+    struct rhashtable ifaces_by_ifindex;
+    struct rhashtable ifaces_by_wdev;
+    struct list_head ifaces;
+    unsigned int n_ifaces;
+    /* counters, written under RTNL, read lock-free by debugfs */
+    u64 iface_adds;
+    u64 iface_dels;
+    /* channel(hw_value) the wifi operates on, only interfaces on the same channel hear each other in the medium */
+    u16 oper_chan;
 
     /* DEMO */
-    struct semaphore sem;
+    /* Ordered workqueue of this wifi: its work items run one by one in order they were queued,
+     * while work of different wifi_drv contexts runs concurrently. Ordering is per radio rather than per interface:
+     * scan, connection, association and firmware state belong to the radio, and the routines rely on running one
+     * at a time instead of locking it(BSS index, band walks, firmware sequence numbers). */
+    struct workqueue_struct *wq;
+
+    /* connect/disconnect state, conn_lock protects only the parameters passed to the routines. */
+    spinlock_t conn_lock;
     struct work_struct ws_connect;
-    char connecting_ssid[sizeof(SSID_DUMMY)];
+    struct wifi_drv_ssid_key connecting_ssid;
+    u8 connecting_bssid[ETH_ALEN]; /* zero - the best BSS of the ESS */
+    bool connecting_bssid_fixed; /* connecting_bssid is required(sme->bssid), not a hint */
+    bool connecting_reassoc; /* roam of the current connection(connect with prev_bssid) */
+    enum nl80211_auth_type auth_type; /* of the current connection, changed by update_connect_params() */
     struct work_struct ws_disconnect;
     u16 disconnect_reason_code;
-    struct work_struct ws_scan;
+    struct work_struct ws_roam; /* roam started by the driver */
+    u8 roam_bssid[ETH_ALEN];
+    /* association in progress, ws_assoc finishes it after the management exchanges, see wifi_drv_associate().
+     * Written on the workqueue only. */
+    struct delayed_work ws_assoc;
+    bool assoc_pending;
+    bool assoc_roam; /* reassociation of the current connection, otherwise connect */
+    bool assoc_cached; /* PMKSA of the BSS was cached, 802.1X is skipped */
+    struct wifi_drv_bss assoc_bss; /* copy, the index entry may be replaced meanwhile */
+
+    /* current connection, written on the workqueue only */
+    bool connected;
+    struct wifi_drv_ssid_key conn_ssid;
+    u8 conn_bssid[ETH_ALEN];
+
+    /* BSSes reported by scans keyed by BSSID and SSID, connect and roam resolve their target here.
+     * Filled and used on the workqueue only. An entry replaced by a newer scan result is freed after an RCU grace
+     * period, so a looked up entry is valid only till the current work item returns; keep a copy(see assoc_bss). */
+    struct rhashtable bss_by_bssid;
+    struct rhltable bss_by_ssid;
+    /* PMKSA cache filled by userspace(set_pmksa) and by full connects of the driver */
+    spinlock_t pmksa_lock;
+    struct wifi_drv_pmksa pmksa[WIFI_DRV_MAX_PMKIDS];
+    unsigned int n_pmksa;
+    /* counters, written on the workqueue only */
+    u64 conn_full;
+    u64 conn_fast; /* 802.1X was skipped thanks to PMKSA */
+    u64 roams;
+    u64 roams_fast;
+    u64 roams_failed;
+    u64 bss_index_miss;
+
+    /* scan state. scan_request is owned through cmpxchg()/xchg(): not NULL while scan is in progress. */
+    struct delayed_work ws_scan; /* finishes aborted scan */
     struct cfg80211_scan_request *scan_request;
+    bool scan_aborted; /* set by abort_scan() */
+    /* scan state machines: channel walks of the bands, scan_bands_active of them are running(workqueue only) */
+    struct wifi_drv_scan_band scan_bands[NUM_NL80211_BANDS];
+    unsigned int scan_bands_active;
+
+    /* scheduled scan runs in the driver: sched_scan_request is set and cleared by cfg80211 calls(under RTNL),
+     * cycles run on the workqueue. Request is freed by the kernel only after sched_scan_stop(), which waits for the cycle. */
+    struct delayed_work ws_sched_scan;
+    struct cfg80211_sched_scan_request *sched_scan_request;
+    unsigned int sched_scan_plan; /* index of the current scan plan */
+    unsigned int sched_scan_iter; /* cycles done in the current plan */
+    /* counters, written on the workqueue only */
+    u64 sched_scan_cycles;
+    u64 sched_scan_notified; /* cfg80211_sched_scan_results() calls */
+    u64 sched_scan_matched; /* BSSes reported */
+    u64 sched_scan_filtered; /* BSSes that did not match any match set */
+
+    /* KUnit suite that owns the radio and records its reports, NULL for radios of the module */
+    struct wifi_drv_test *test;
+
+    /* AP state */
+    struct mutex ap_lock;
+    bool ap_mode_enabled;
+
+    /* time(ns) the kernel asked for the operation, see wifi_drv_op_end() */
+    u64 op_start_ns[WIFI_DRV_OP_MAX];
+
+    /* userspace firmware, see wifi_drv_fw_cmd(). Attached and detached under g_fw_lock. */
+    struct wifi_drv_fw __rcu *fw;
+    atomic_t fw_seq;
+    /* seq of the scan command the firmware runs, 0 if the scan is emulated by the driver */
+    u32 fw_scan_seq;
+    /* operations the firmware owns now, written on the workqueue only */
+    bool fw_connect_pending;
+    bool fw_disconnect_pending;
+    struct work_struct ws_fw_detached;
+
+    /* results of the last run of every microbenchmark, bench_lock serializes runs */
+    struct mutex bench_lock;
+    struct wifi_drv_bench_result bench[WIFI_DRV_BENCH_MAX];
 };
 
 struct wifi_drv_wifi_priv_context {
     struct wifi_drv_context *wifi_drv;
 };
 
+/* Userspace firmware behind an open file of /dev/wifi_drv_fw, see wifi_drv_fw.h. */
+struct wifi_drv_fw {
+    struct wifi_drv_context *wifi_drv; /* NULL until WIFI_DRV_FW_IOC_ATTACH */
+    struct wifi_drv_fw_shm *shm;
+    struct eventfd_ctx *cmd_efd;
+    /* commands are posted from cfg80211 callbacks and from the workqueue */
+    spinlock_t cmd_lock;
+    u32 cmd_head; /* driver's copy, firmware can't move it */
+    /* events are consumed on the workqueue of the wifi */
+    struct work_struct ws_events;
+    u32 evt_tail;
+    /* counters, cmd_* under cmd_lock, others on the workqueue */
+    u64 cmds;
+    u64 cmd_full;
+    u64 cmd_doorbells;
+    u64 evts;
+    u64 evt_invalid;
+    u64 evt_runs;
+    u64 rtt_count;
+    u64 rtt_sum_ns;
+    u64 rtt_max_ns;
+};
+
+/* Single producer/single consumer ring of skbs.
+ * Producer and consumer indexes live on separate cache lines, so both sides never share a dirty line
+ * except when the ring is (almost) full or empty. */
+struct wifi_drv_ring {
+    unsigned int head ____cacheline_aligned_in_smp; /* written by producer only */
+    unsigned int tail ____cacheline_aligned_in_smp; /* written by consumer only */
+    unsigned int mask;
+    struct sk_buff **slots;
+};
+
+/* Per-queue counters, every counter has the only writer - napi of its queue. */
+struct wifi_drv_queue_stats {
+    u64_stats_t packets;
+    u64_stats_t bytes;
+    u64_stats_t drops;
+    struct u64_stats_sync syncp;
+};
+
+/* Per-CPU counters of the net_device for events that are not owned by any queue,
+ * eg. frames dropped on the RX side are counted by whoever is delivering them: napi of the peer or timer wheel of the medium. */
+struct wifi_drv_pcpu_stats {
+    u64_stats_t rx_dropped;
+    u64_stats_t rx_fifo_errors; /* RX ring was full */
+    u64_stats_t tx_dropped; /* dropped by the airtime scheduler */
+    struct u64_stats_sync syncp;
+};
+
+/* XDP counters of the queue. RX verdicts are written by napi of the queue, xmit counters under the txq lock. */
+struct wifi_drv_xdp_stats {
+    u64 pass;
+    u64 drop;
+    u64 tx;
+    u64 tx_err;
+    u64 redirect;
+    u64 redirect_err;
+    u64 xmit; /* frames redirected to this device, see nvf_ndo_xdp_xmit() */
+    u64 xmit_err;
+};
+
+/* Frames of one destination and TID collected by napi of the queue, they are delivered as one A-MPDU. */
+struct wifi_drv_agg {
+    struct sk_buff_head frames; /* empty if the slot is free */
+    u8 addr[ETH_ALEN];
+    u8 tid;
+    u32 bytes;
+    u64 start_ns; /* the first frame was added */
+};
+
+/* Why aggregate was delivered */
+enum wifi_drv_agg_flush {
+    WIFI_DRV_AGG_FLUSH_FULL, /* frame or byte limit */
+    WIFI_DRV_AGG_FLUSH_BURST, /* end of xmit_more batch */
+    WIFI_DRV_AGG_FLUSH_TIMEOUT, /* ampdu_timeout_us */
+    WIFI_DRV_AGG_FLUSH_EVICT, /* slot was taken by another destination */
+    WIFI_DRV_AGG_FLUSH_MAX,
+};
+
+/* Frame in the TX ring, skb->cb is ours from ndo_start_xmit() till the frame is delivered. */
+struct wifi_drv_tx_cb {
+    bool burst_end; /* nothing follows it right now, napi delivers open aggregates with it */
+};
+
+/* TX/RX queue pair of the loopback datapath.
+ * ndo_start_xmit() of queue N fills tx_ring under the txq lock, napi of queue N drains it and puts frames
+ * to rx_ring of queue N of the peer. So every ring has exactly one producer and one consumer and no locks are taken.
+ * XPS maps every CPU to its own queue, so senders on different cores do not share anything. */
+struct wifi_drv_queue {
+    struct net_device *ndev;
+    u16 qid;
+    struct napi_struct napi;
+    struct wifi_drv_ring tx_ring;
+    struct wifi_drv_ring rx_ring;
+    struct wifi_drv_queue_stats tx_stats;
+    struct wifi_drv_queue_stats rx_stats;
+    /* TX ring was full: the queue was stopped or a frame was refused, written under the txq lock */
+    u64 tx_ring_full;
+    /* napi kicks of ndo_start_xmit(), frames per kick show how well xmit_more batches, written under the txq lock */
+    u64 tx_kicks;
+    /* with the medium rx_ring is filled by timer wheels of several CPUs, they serialize on this lock */
+    spinlock_t rx_produce_lock;
+    /* frames refused by the full rx_ring, written by its producers */
+    u64 rx_ring_full;
+    /* receive buffers, pages come back to the pool when the stack frees skbs built over them */
+    struct page_pool *page_pool;
+    /* counters of wifi_drv_rx_build_skb(), written by napi of the queue only */
+    u64 rx_pp_copied;
+    u64 rx_pp_bypass;
+    u64 rx_pp_alloc_fail;
+    struct xdp_rxq_info xdp_rxq;
+    struct wifi_drv_xdp_stats xdp_stats;
+    /* TX aggregation, everything is owned by napi of the queue, agg_timer kicks napi when an aggregate times out */
+    struct wifi_drv_agg aggs[WIFI_DRV_AGG_SLOTS];
+    struct hrtimer agg_timer;
+    u64 agg_hist[WIFI_DRV_AGG_HIST_BUCKETS];
+    u64 agg_flush[WIFI_DRV_AGG_FLUSH_MAX];
+} ____cacheline_aligned_in_smp;
+
+/* Where napi of the queue sends frames during one poll, see wifi_drv_queue_tx() */
+struct wifi_drv_tx_ctx {
+    struct wifi_drv_queue *q;
+    struct wifi_drv_ndev_priv_context *ndev_data;
+    bool is_ap;
+    struct net_device *peer;
+    struct wifi_drv_queue *peer_q; /* loopback only */
+    bool peer_shared; /* other queues deliver to peer_q as well, see wifi_drv_queue_tx() */
+    unsigned int sent;
+    unsigned int sent_bytes;
+    unsigned int dropped;
+    bool scheduled; /* frames were queued to the airtime scheduler */
+};
+
+/* Resources of the queue that are reallocated when ethtool resizes rings or changes number of queues.
+ * xdp_rxq is registered over page_pool of the same resources, only while the device is running. */
+struct wifi_drv_queue_res {
+    struct wifi_drv_ring tx_ring;
+    struct wifi_drv_ring rx_ring;
+    struct page_pool *page_pool;
+    struct xdp_rxq_info xdp_rxq;
+};
+
+/* Per-CPU counters of the station, written by napi of the current CPU only. */
+struct wifi_drv_sta_stats {
+    u64_stats_t tx_packets;
+    u64_stats_t tx_bytes;
+    u64_stats_t rx_packets;
+    u64_stats_t rx_bytes;
+    struct u64_stats_sync syncp;
+};
+
+/* Frames of one TID of the station, CoDel state is per TID like in fq_codel. */
+struct wifi_drv_tid {
+    struct sk_buff_head q;
+    u32 backlog; /* bytes */
+    struct codel_vars cvars;
+    struct wifi_drv_sta *sta;
+};
+
+/* Station associated with the AP interface. */
+struct wifi_drv_sta {
+    struct rhash_head node;
+    u8 addr[ETH_ALEN];
+    unsigned long connected_at; /* jiffies */
+    struct wifi_drv_sta_stats __percpu *stats;
+    struct list_head list;
+    struct rcu_head rcu;
+
+    /* airtime scheduling, everything below is under airtime_lock of the AP */
+    u16 rate; /* simulated PHY rate, 100 kbps */
+    bool dead; /* unlinked, frames are not queued anymore */
+    struct list_head active; /* in airtime_active of the AP while it has frames */
+    s32 deficit; /* us */
+    struct wifi_drv_tid tids[WIFI_DRV_NUM_TIDS];
+    u64 airtime_us;
+    u64 tx_frames;
+    u64 sojourn_sum_us;
+    u32 sojourn_max_us;
+    u64 codel_drops;
+    u64 overflow_drops;
+};
+
+/* Enqueue time of the frame waiting in a TID queue, lives in skb->cb. */
+struct wifi_drv_tid_cb {
+    codel_time_t enqueue_time;
+};
+
+static const struct rhashtable_params wifi_drv_sta_params = {
+        .key_len = ETH_ALEN,
+        .key_offset = offsetof(struct wifi_drv_sta, addr),
+        .head_offset = offsetof(struct wifi_drv_sta, node),
+        .automatic_shrinking = true,
+};
+
+/* Network device attached to the medium, it receives unicast frames sent to its address and broadcasts of its channel. */
+struct wifi_drv_medium_member {
+    struct rhash_head node;
+    u8 addr[ETH_ALEN];
+    struct net_device *ndev;
+    struct list_head list;
+};
+
+static const struct rhashtable_params wifi_drv_medium_params = {
+        .key_len = ETH_ALEN,
+        .key_offset = offsetof(struct wifi_drv_medium_member, addr),
+        .head_offset = offsetof(struct wifi_drv_medium_member, node),
+        .automatic_shrinking = true,
+};
+
+/* Per-CPU timer wheel of the medium. Frames are put into the slot of the tick they should be delivered at,
+ * one hrtimer per CPU walks the slots, so there is no timer per frame.
+ * Wheel is filled by napi and drained by the soft hrtimer of the same CPU, both run in softirq and never interleave. */
+struct wifi_drv_wheel {
+    struct hrtimer timer;
+    bool armed;
+    u64 armed_tick;
+    u64 next_tick; /* first tick that is not processed yet */
+    unsigned int pending;
+    struct sk_buff_head *slots; /* WIFI_DRV_WHEEL_SLOTS */
+    /* counters, written by this CPU only */
+    u64 queued;
+    u64 delivered;
+    u64 lost;
+    u64 overflow;
+};
+
+/* Medium shared by all radios. */
+struct wifi_drv_medium {
+    spinlock_t lock; /* protects members */
+    struct rhashtable members_table;
+    struct list_head members;
+    u64 tick_ns;
+    /* time(ns) every channel is busy until, limits bandwidth */
+    atomic64_t busy_until[WIFI_DRV_MEDIUM_MAX_CHAN];
+    struct wifi_drv_wheel __percpu *wheels;
+};
+
+/* Medium information of the frame in the wheel, lives in skb->cb. */
+struct wifi_drv_medium_cb {
+    u16 chan;
+};
+
+static struct wifi_drv_medium g_medium;
+
 struct wifi_drv_ndev_priv_context {
     struct wifi_drv_context *wifi_drv;
     struct wireless_dev wdev;
+    struct wifi_drv_medium_member medium_member;
+
+    /* loopback datapath, one queue pair per TX queue of the net_device. max_queues are allocated, first num_queues
+     * of them are active and have rings, ethtool changes the number and ring sizes under RTNL. */
+    unsigned int num_queues;
+    unsigned int max_queues;
+    unsigned int tx_ring_size;
+    unsigned int rx_ring_size;
+    /* datapath is being reconfigured, other devices leave its rings alone, see wifi_drv_rx_ready() */
+    bool paused;
+    struct wifi_drv_queue *queues;
+    /* held by wifi_drv_set_queues() while it swaps rings and page_pools, so debugfs readers that can't take RTNL
+     * see num_queues and page_pools of the queues in step */
+    struct mutex queues_lock;
+    struct wifi_drv_pcpu_stats __percpu *pcpu_stats;
+    /* native XDP program run by napi on every received frame, replaced under RTNL */
+    struct bpf_prog __rcu *xdp_prog;
+
+    /* AP mode: associated stations keyed by MAC. Datapath looks them up lock-free under RCU,
+     * sta_lock serializes add/remove and dump_station(). */
+    struct rhashtable sta_table;
+    spinlock_t sta_lock;
+    struct list_head sta_list;
+    unsigned int n_sta;
+    /* dump_station() asks stations by index one by one, cursor keeps the whole dump O(n) */
+    int dump_idx;
+    struct wifi_drv_sta *dump_sta;
+
+    /* AP mode airtime scheduler. Air of the AP is shared by all its stations, so it has a single lock:
+     * TID queues are filled by napi of every queue and drained by napi or by airtime_timer. */
+    spinlock_t airtime_lock;
+    struct list_head airtime_active;
+    u64 air_busy_until_ns;
+    struct hrtimer airtime_timer;
+    struct codel_params cparams;
+    struct codel_stats cstats;
+};
+
+/* Network device of the radio in its registry, entries come from g_iface_cache. */
+struct wifi_drv_iface {
+    struct rhash_head node_ifindex;
+    struct rhash_head node_wdev;
+    struct list_head list;
+    int ifindex;
+    struct wireless_dev *wdev;
+    struct net_device *ndev;
+    struct rcu_head rcu;
+};
+
+static const struct rhashtable_params wifi_drv_iface_ifindex_params = {
+        .key_len = sizeof(int),
+        .key_offset = offsetof(struct wifi_drv_iface, ifindex),
+        .head_offset = offsetof(struct wifi_drv_iface, node_ifindex),
+        .automatic_shrinking = true,
+};
+
+static const struct rhashtable_params wifi_drv_iface_wdev_params = {
+        .key_len = sizeof(struct wireless_dev *),
+        .key_offset = offsetof(struct wifi_drv_iface, wdev),
+        .head_offset = offsetof(struct wifi_drv_iface, node_wdev),
+        .automatic_shrinking = true,
+};
+
+/* BSS population shared by all scans. BSSes are grouped by channel, channels of all bands are numbered one after
+ * another: channel N of band B is the channel number band_first[B] + N of the population.
+ * BSSes of the channel number C are bss[chan_first[C]] ... bss[chan_first[C + 1] - 1]. */
+struct wifi_drv_bss_population {
+    unsigned int n_bss;
+    unsigned int band_first[NUM_NL80211_BANDS];
+    unsigned int *chan_first;
+    struct wifi_drv_bss *bss;
+};
+
+static struct wifi_drv_bss_population g_bss_population;
+
+/* BSS in the index of the wifi, see wifi_drv_bss_index_add() */
+struct wifi_drv_bss_idx {
+    struct rhash_head bssid_node;
+    struct rhlist_head ssid_node;
+    struct wifi_drv_ssid_key ssid;
+    struct wifi_drv_bss bss;
+    unsigned long seen; /* jiffies */
+};
+
+static const struct rhashtable_params wifi_drv_bss_bssid_params = {
+        .key_len = ETH_ALEN,
+        .key_offset = offsetof(struct wifi_drv_bss_idx, bss.bssid),
+        .head_offset = offsetof(struct wifi_drv_bss_idx, bssid_node),
+        .automatic_shrinking = true,
+};
+
+static const struct rhashtable_params wifi_drv_bss_ssid_params = {
+        .key_len = sizeof(struct wifi_drv_ssid_key),
+        .key_offset = offsetof(struct wifi_drv_bss_idx, ssid),
+        .head_offset = offsetof(struct wifi_drv_bss_idx, ssid_node),
+        .automatic_shrinking = true,
+};
+
+/* Latency histogram of control-plane operations: bucket N counts operations that took [2^(N-1), 2^N) ns,
+ * last bucket takes everything longer. Histograms are per-CPU, so completions on different cores never share a line. */
+#define WIFI_DRV_HIST_BUCKETS 40
+
+struct wifi_drv_op_hist {
+    u64 count[WIFI_DRV_OP_MAX][WIFI_DRV_HIST_BUCKETS];
+};
+
+static DEFINE_PER_CPU(struct wifi_drv_op_hist, g_op_hist);
+
+/* Number of devices with XDP program attached, see nvf_ndo_features_check() */
+static atomic_t g_xdp_progs = ATOMIC_INIT(0);
+
+static const char *const wifi_drv_op_names[WIFI_DRV_OP_MAX] = {
+        [WIFI_DRV_OP_SCAN] = "scan",
+        [WIFI_DRV_OP_CONNECT] = "connect",
+        [WIFI_DRV_OP_DISCONNECT] = "disconnect",
+        [WIFI_DRV_OP_START_AP] = "start_ap",
+        [WIFI_DRV_OP_STOP_AP] = "stop_ap",
+        [WIFI_DRV_OP_ROAM] = "roam",
 };
 
 /* helper function that will retrieve main context from "priv" data of the wifi */
@@ -42,393 +722,4301 @@ wifi_get_wifi_drv_context(struct wifi *wifi) { return (struct wifi_drv_wifi_priv
 static struct wifi_drv_ndev_priv_context *
 ndev_get_wifi_drv_context(struct net_device *ndev) { return (struct wifi_drv_ndev_priv_context *) netdev_priv(ndev); }
 
-/* Helper function that will prepare structure with "dummy" BSS information and "inform" the kernel about "new" BSS */
-static void inform_dummy_bss(struct wifi_drv_context *wifi_drv) {
-    struct cfg80211_bss *bss = NULL;
-    struct cfg80211_inform_bss data = {
-            .chan = &wifi_drv->wifi->bands[NL80211_BAND_2GHZ]->channels[0], /* the only channel for this demo */
-            .scan_width = NL80211_BSS_CHAN_WIDTH_20,
-            /* signal "type" not specified in this DEMO so its basically unused, it can be some kind of percentage from 0 to 100 or mBm value*/
-            /* signal "type" may be specified before wifi registration by setting wifi->signal_type */
-            .signal = 1337,
-    };
-    char bssid[6] = {0xaa, 0xbb, 0xcc, 0xdd, 0xee, 0xff};
+/* Called when the kernel asks for the operation through cfg80211_ops. */
+static void wifi_drv_op_begin(struct wifi_drv_context *wifi_drv, enum wifi_drv_op op) {
+    WRITE_ONCE(wifi_drv->op_start_ns[op], ktime_get_ns());
+    trace_wifi_drv_op_begin(wifi_name(wifi_drv->wifi), op);
+}
 
-    /* ie - array of tags that usually retrieved from beacon frame or probe responce. */
-    char ie[SSID_DUMMY_SIZE + 2] = {WLAN_EID_SSID, SSID_DUMMY_SIZE};
-    memcpy(ie + 2, SSID_DUMMY, SSID_DUMMY_SIZE);
+/* Called when the operation is reported to the kernel as completed, accounts its latency in the histogram. */
+static void wifi_drv_op_end(struct wifi_drv_context *wifi_drv, enum wifi_drv_op op, int status) {
+    u64 latency = ktime_get_ns() - READ_ONCE(wifi_drv->op_start_ns[op]);
 
-    /* also it posible to use cfg80211_inform_bss() instead of cfg80211_inform_bss_data() */
-    bss = cfg80211_inform_bss_data(wifi_drv->wifi, &data, CFG80211_BSS_FTYPE_UNKNOWN, bssid, 0, WLAN_CAPABILITY_ESS, 100,
-                                   ie, sizeof(ie), GFP_KERNEL);
+    this_cpu_inc(g_op_hist.count[op][min_t(unsigned int, fls64(latency), WIFI_DRV_HIST_BUCKETS - 1)]);
+    trace_wifi_drv_op_end(wifi_name(wifi_drv->wifi), op, latency, status);
+}
 
-    /* free, cfg80211_inform_bss_data() returning cfg80211_bss structure refcounter of which should be decremented if its not used. */
-    cfg80211_put_bss(wifi_drv->wifi, bss);
+/* Reports of finished operations to the kernel. Every scan, connect and disconnect the kernel asks for ends with
+ * exactly one of them. Radios of the KUnit suite record them instead, see wifi_test.c. */
+enum wifi_drv_report {
+    WIFI_DRV_REPORT_SCAN_DONE,
+    WIFI_DRV_REPORT_SCAN_ABORTED,
+    WIFI_DRV_REPORT_CONNECT,
+    WIFI_DRV_REPORT_CONNECT_FAILED,
+    WIFI_DRV_REPORT_CONNECT_TIMEOUT,
+    WIFI_DRV_REPORT_ROAMED,
+    WIFI_DRV_REPORT_DISCONNECTED,
+    WIFI_DRV_REPORT_MAX,
+};
+
+#if IS_ENABLED(CONFIG_KUNIT)
+static bool wifi_drv_test_report(struct wifi_drv_context *wifi_drv, enum wifi_drv_report report, const u8 *bssid);
+#else
+static inline bool wifi_drv_test_report(struct wifi_drv_context *wifi_drv, enum wifi_drv_report report,
+                                        const u8 *bssid) {
+    return false;
 }
+#endif
 
-/* "Scan" routine for DEMO. It just inform the kernel about "dummy" BSS and "finishs" scan.
- * When scan is done it should call cfg80211_scan_done() to inform the kernel that scan is finished.
- * This routine called through workqueue, when the kernel asks about scan through cfg80211_ops. */
-static void wifi_drv_scan_routine(struct work_struct *w) {
-    struct wifi_drv_context *wifi_drv = container_of(w, struct wifi_drv_context, ws_scan);
+static void wifi_drv_report_scan_done(struct wifi_drv_context *wifi_drv, struct cfg80211_scan_request *request,
+                                      bool aborted) {
     struct cfg80211_scan_info info = {
             /* if scan was aborted by user(calling cfg80211_ops->abort_scan) or by any driver/hardware issue - field should be set to "true"*/
-            .aborted = false,
+            .aborted = aborted,
     };
 
-    /* pretend some work, also u can't call cfg80211_scan_done right away after cfg80211_ops->scan(),
-     * idk why, but netlink client would not get message with "scan done",
-     * is it because of "scan_routine" and cfg80211_ops->scan() may run in concurrent and cfg80211_scan_done() called before cfg80211_ops->scan() returns? */
-    msleep(100);
-
-    /* inform with dummy BSS */
-    inform_dummy_bss(wifi_drv);
+    if (wifi_drv_test_report(wifi_drv, aborted ? WIFI_DRV_REPORT_SCAN_ABORTED : WIFI_DRV_REPORT_SCAN_DONE, NULL)) {
+        return;
+    }
+    cfg80211_scan_done(request, &info);
+}
 
-    if(down_interruptible(&wifi_drv->sem)) {
+/* also its possible to use cfg80211_connect_result() or cfg80211_connect_done() */
+static void wifi_drv_report_connect(struct wifi_drv_context *wifi_drv, const u8 *bssid, u16 status) {
+    if (wifi_drv_test_report(wifi_drv, status == WLAN_STATUS_SUCCESS ? WIFI_DRV_REPORT_CONNECT
+                                                                     : WIFI_DRV_REPORT_CONNECT_FAILED, bssid)) {
         return;
     }
+    cfg80211_connect_bss(wifi_drv->ndev, bssid, NULL, NULL, 0, NULL, 0, status, GFP_KERNEL,
+                         NL80211_TIMEOUT_UNSPECIFIED);
+}
 
-    /* finish scan */
-    cfg80211_scan_done(wifi_drv->scan_request, &info);
+static void wifi_drv_report_connect_timeout(struct wifi_drv_context *wifi_drv, enum nl80211_timeout_reason reason) {
+    if (wifi_drv_test_report(wifi_drv, WIFI_DRV_REPORT_CONNECT_TIMEOUT, NULL)) {
+        return;
+    }
+    cfg80211_connect_timeout(wifi_drv->ndev, NULL, NULL, 0, GFP_KERNEL, reason);
+}
 
-    wifi_drv->scan_request = NULL;
+static void wifi_drv_report_roamed(struct wifi_drv_context *wifi_drv, const struct wifi_drv_bss *bss) {
+    struct cfg80211_roam_info info = {};
 
-    up(&wifi_drv->sem);
+    if (wifi_drv_test_report(wifi_drv, WIFI_DRV_REPORT_ROAMED, bss->bssid)) {
+        return;
+    }
+    info.links[0].channel = bss->chan;
+    info.links[0].bssid = bss->bssid;
+    cfg80211_roamed(wifi_drv->ndev, &info, GFP_KERNEL);
 }
 
-/* It just checks SSID of the ESS to connect and informs the kernel that connect is finished.
- * It should call cfg80211_connect_bss() when connect is finished or cfg80211_connect_timeout() when connect is failed.
- * This "demo" can connect only to ESS with SSID equal to SSID_DUMMY value.
- * This routine called through workqueue, when the kernel asks about connect through cfg80211_ops. */
-static void wifi_drv_connect_routine(struct work_struct *w) {
-    struct wifi_drv_context *wifi_drv = container_of(w, struct wifi_drv_context, ws_connect);
-
-    if(down_interruptible(&wifi_drv->sem)) {
+static void wifi_drv_report_disconnected(struct wifi_drv_context *wifi_drv, u16 reason, bool locally_generated) {
+    if (wifi_drv_test_report(wifi_drv, WIFI_DRV_REPORT_DISCONNECTED, NULL)) {
         return;
     }
+    cfg80211_disconnected(wifi_drv->ndev, reason, NULL, 0, locally_generated, GFP_KERNEL);
+}
 
-    if (memcmp(wifi_drv->connecting_ssid, SSID_DUMMY, sizeof(SSID_DUMMY)) != 0) {
-        cfg80211_connect_timeout(wifi_drv->ndev, NULL, NULL, 0, GFP_KERNEL, NL80211_TIMEOUT_SCAN);
-    } else {
-        /* we can connect to ESS that already know. If else, technically kernel will only warn.*/
-        /* so, lets send dummy bss to the kernel before complete. */
-        inform_dummy_bss(wifi_drv);
+/* Counts frame that "ndev" could not receive, may be called from any CPU in softirq. */
+static void wifi_drv_rx_drop(struct net_device *ndev, bool ring_full) {
+    struct wifi_drv_pcpu_stats *stats = this_cpu_ptr(ndev_get_wifi_drv_context(ndev)->pcpu_stats);
 
-        /* also its possible to use cfg80211_connect_result() or cfg80211_connect_done() */
-        cfg80211_connect_bss(wifi_drv->ndev, NULL, NULL, NULL, 0, NULL, 0, WLAN_STATUS_SUCCESS, GFP_KERNEL,
-                             NL80211_TIMEOUT_UNSPECIFIED);
+    u64_stats_update_begin(&stats->syncp);
+    u64_stats_inc(&stats->rx_dropped);
+    if (ring_full) {
+        u64_stats_inc(&stats->rx_fifo_errors);
     }
-    wifi_drv->connecting_ssid[0] = 0;
+    u64_stats_update_end(&stats->syncp);
+}
 
-    up(&wifi_drv->sem);
+static int wifi_drv_ring_init(struct wifi_drv_ring *ring, unsigned int size) {
+    ring->slots = kcalloc(size, sizeof(*ring->slots), GFP_KERNEL);
+    if (ring->slots == NULL) {
+        return -ENOMEM;
+    }
+    ring->head = 0;
+    ring->tail = 0;
+    ring->mask = size - 1;
+    return 0;
 }
 
-/* Just calls cfg80211_disconnected() that informs the kernel that disconnect is complete.
- * Overall disconnect may call cfg80211_connect_timeout() if disconnect interrupting connection routine, but for this demo I keep it simple.
- * This routine called through workqueue, when the kernel asks about disconnect through cfg80211_ops. */
-static void wifi_drv_disconnect_routine(struct work_struct *w) {
+/* Returns false if the ring is full, skb ownership stays with the caller in that case. */
+static bool wifi_drv_ring_produce(struct wifi_drv_ring *ring, struct sk_buff *skb) {
+    unsigned int head = ring->head;
 
-    struct wifi_drv_context *wifi_drv = container_of(w, struct wifi_drv_context, ws_disconnect);
+    if (head - smp_load_acquire(&ring->tail) > ring->mask) {
+        return false;
+    }
+    ring->slots[head & ring->mask] = skb;
+    /* publish slot before index, pairs with smp_load_acquire() in wifi_drv_ring_consume() */
+    smp_store_release(&ring->head, head + 1);
+    return true;
+}
 
-    if(down_interruptible(&wifi_drv->sem)) {
-        return;
+static struct sk_buff *wifi_drv_ring_consume(struct wifi_drv_ring *ring) {
+    unsigned int tail = ring->tail;
+    struct sk_buff *skb;
+
+    if (tail == smp_load_acquire(&ring->head)) {
+        return NULL;
     }
+    skb = ring->slots[tail & ring->mask];
+    smp_store_release(&ring->tail, tail + 1);
+    return skb;
+}
 
-    cfg80211_disconnected(wifi_drv->ndev, wifi_drv->disconnect_reason_code, NULL, 0, true, GFP_KERNEL);
+/* Producer side check. */
+static bool wifi_drv_ring_full(struct wifi_drv_ring *ring) {
+    return ring->head - READ_ONCE(ring->tail) > ring->mask;
+}
 
-    wifi_drv->disconnect_reason_code = 0;
-    
-    up(&wifi_drv->sem);
+/* Consumer side check. */
+static bool wifi_drv_ring_empty(struct wifi_drv_ring *ring) {
+    return ring->tail == READ_ONCE(ring->head);
 }
 
-/* HostAP mode functions */
-static int wifi_drv_start_ap(struct wifi *wifi, struct net_device *dev,
-                           struct cfg80211_config_params *params) {
-    struct wifi_drv_context *wifi_drv = wifi_get_wifi_drv_context(wifi)->wifi_drv;
+static void wifi_drv_ring_purge(struct wifi_drv_ring *ring) {
+    struct sk_buff *skb;
 
-    if (down_interruptible(&wifi_drv->sem)) {
-        return -ERESTARTSYS;
+    while ((skb = wifi_drv_ring_consume(ring)) != NULL) {
+        kfree_skb(skb);
     }
+}
 
-    // Set the AP mode in the driver context
-    wifi_drv->ap_mode_enabled = true;
-
-    // Perform any necessary initialization for AP mode, such as setting up beacon and DTIM parameters
+static void wifi_drv_ring_cleanup(struct wifi_drv_ring *ring) {
+    if (ring->slots != NULL) {
+        wifi_drv_ring_purge(ring);
+        kfree(ring->slots);
+        ring->slots = NULL;
+    }
+}
 
-    // Inform the kernel about the start of AP mode
-    cfg80211_ap_start(wifi_drv->ndev, params);
+static unsigned int wifi_drv_num_queues(void) {
+    return clamp_t(unsigned int, queues ? queues : num_online_cpus(), 1, WIFI_DRV_MAX_QUEUES);
+}
 
-    up(&wifi_drv->sem);
+/* Allocates rings and page_pool of the queue into "res", so the queue can be resized without stopping it
+ * until everything is in place. See wifi_drv_queue_res_swap(). */
+static int wifi_drv_queue_res_alloc(struct wifi_drv_queue *q, unsigned int tx_size, unsigned int rx_size,
+                                    struct wifi_drv_queue_res *res) {
+    struct page_pool_params pp_params = {
+            .order = 0,
+            .pool_size = rx_size,
+            .nid = NUMA_NO_NODE,
+            /* pages are allocated and recycled by napi of the queue only, so the lockless cache is used */
+            .napi = &q->napi,
+    };
+    int err;
 
-    return 0; /* OK */
+    err = wifi_drv_ring_init(&res->tx_ring, tx_size);
+    if (err) {
+        goto l_error;
+    }
+    err = wifi_drv_ring_init(&res->rx_ring, rx_size);
+    if (err) {
+        goto l_error_rx_ring;
+    }
+    res->page_pool = page_pool_create(&pp_params);
+    if (IS_ERR(res->page_pool)) {
+        err = PTR_ERR(res->page_pool);
+        res->page_pool = NULL;
+        goto l_error_page_pool;
+    }
+    return 0;
+    l_error_page_pool:
+    wifi_drv_ring_cleanup(&res->rx_ring);
+    l_error_rx_ring:
+    wifi_drv_ring_cleanup(&res->tx_ring);
+    l_error:
+    return err;
 }
 
-static void wifi_drv_stop_ap(struct net_device *dev) {
-    struct wifi_drv_context *wifi_drv = dev_priv(dev);
-    struct cfg80211_ap_config ap_config;
+/* Exchanges rings, page_pool and xdp_rxq of the queue with "res", napi of the queue should be disabled. */
+static void wifi_drv_queue_res_swap(struct wifi_drv_queue *q, struct wifi_drv_queue_res *res) {
+    swap(q->tx_ring, res->tx_ring);
+    swap(q->rx_ring, res->rx_ring);
+    swap(q->page_pool, res->page_pool);
+    swap(q->xdp_rxq, res->xdp_rxq);
+}
 
-    // Clear the device mode to station
-    dev_set_mode(dev, NL80211_IFTYPE_STATION);
+static void wifi_drv_queue_res_free(struct wifi_drv_queue_res *res) {
+    /* running device gave away registered xdp_rxq, it holds the page_pool and goes first */
+    if (xdp_rxq_info_is_reg(&res->xdp_rxq)) {
+        xdp_rxq_info_unreg(&res->xdp_rxq);
+    }
+    wifi_drv_ring_cleanup(&res->tx_ring);
+    wifi_drv_ring_cleanup(&res->rx_ring);
+    /* pages still held by the stack are returned to the page allocator when their skbs are freed */
+    page_pool_destroy(res->page_pool);
+    res->page_pool = NULL;
+}
 
-    // Unregister the AP configuration
-    memset(&ap_config, 0, sizeof(ap_config));
-    ap_config.ifindex = dev->ifindex;
-    cfg80211_unregister_bss(wifi_drv->wifi, &ap_config);
+static void wifi_drv_queue_stats_add(struct wifi_drv_queue_stats *stats, unsigned int packets,
+                                     unsigned int bytes, unsigned int drops) {
+    u64_stats_update_begin(&stats->syncp);
+    u64_stats_add(&stats->packets, packets);
+    u64_stats_add(&stats->bytes, bytes);
+    u64_stats_add(&stats->drops, drops);
+    u64_stats_update_end(&stats->syncp);
 }
 
-static int nvf_add_virtual_intf(struct wiphy *wiphy, struct net_device *dev,
-                                 enum nl80211_iftype type, const char *name,
-                                 unsigned char name_assign_type) {
-    struct wifi_drv_context *wifi_drv = wiphy_get_wifi_drv_context(wiphy)->wifi_drv;
-    struct net_device *new_dev;
+static void wifi_drv_queue_stats_read(const struct wifi_drv_queue_stats *stats, u64 *packets, u64 *bytes, u64 *drops) {
+    unsigned int start;
 
-    // Allocate a new net_device for the virtual interface
-    new_dev = alloc_netdev(sizeof(struct wifi_drv_context), name, NET_NAME_ENUM, ether_setup);
-    if (!new_dev) {
-        return -ENOMEM; // Memory allocation failed
-    }
+    do {
+        start = u64_stats_fetch_begin(&stats->syncp);
+        *packets = u64_stats_read(&stats->packets);
+        *bytes = u64_stats_read(&stats->bytes);
+        *drops = u64_stats_read(&stats->drops);
+    } while (u64_stats_fetch_retry(&stats->syncp, start));
+}
 
-    // Set the interface type
-    new_dev->ieee80211_ptr->iftype = type;
+static u16 wifi_drv_sta_rate(const u8 *addr);
 
-    // Set the parent wiphy
-    new_dev->ieee80211_ptr->wiphy = wiphy;
+/* Drops frames queued for the station, returns number of frames. airtime_lock should be held if the AP is up. */
+static unsigned int wifi_drv_sta_purge_tids(struct wifi_drv_sta *sta) {
+    unsigned int tid, n = 0;
 
-    // Register the new virtual interface
-    if (register_netdev(new_dev)) {
-        free_netdev(new_dev);
-        return -EIO; // Failed to register the device
+    for (tid = 0; tid < WIFI_DRV_NUM_TIDS; tid++) {
+        n += skb_queue_len(&sta->tids[tid].q);
+        __skb_queue_purge(&sta->tids[tid].q);
+        sta->tids[tid].backlog = 0;
     }
+    return n;
+}
 
-    // If the new interface is for AP mode, start the AP
-    if (type == NL80211_IFTYPE_AP) {
-        struct cfg80211_config_params params = { /* Initialize with necessary parameters */ };
-        if (wifi_drv_start_ap(wifi_drv, new_dev, &params) < 0) {
-            unregister_netdev(new_dev);
-            free_netdev(new_dev);
-            return -EIO; // Failed to start AP mode
-        }
-    }
+static void wifi_drv_sta_free(void *ptr, void *arg) {
+    struct wifi_drv_sta *sta = ptr;
 
-    // Add the new device to the driver context
-    // You may want to maintain a list of virtual interfaces in your driver context
+    wifi_drv_sta_purge_tids(sta);
+    free_percpu(sta->stats);
+    kfree(sta);
+}
 
-    return 0; // Success
+static void wifi_drv_sta_free_rcu(struct rcu_head *head) {
+    wifi_drv_sta_free(container_of(head, struct wifi_drv_sta, rcu), NULL);
 }
 
+/* Adds station to the table of the AP interface. Returns -EEXIST if it is already there. */
+static int wifi_drv_sta_add(struct wifi_drv_ndev_priv_context *ndev_data, const u8 *addr) {
+    struct wifi_drv_sta *sta;
+    unsigned int tid;
+    int cpu, err;
 
-static int nvf_change_virtual_intf(struct wiphy *wiphy, struct net_device *dev,
-                                    enum nl80211_iftype type) {
-    struct wifi_drv_context *wifi_drv = dev_priv(dev);
+    sta = kzalloc(sizeof(*sta), GFP_KERNEL);
+    if (sta == NULL) {
+        return -ENOMEM;
+    }
+    sta->stats = alloc_percpu(struct wifi_drv_sta_stats);
+    if (sta->stats == NULL) {
+        kfree(sta);
+        return -ENOMEM;
+    }
+    for_each_possible_cpu(cpu) {
+        u64_stats_init(&per_cpu_ptr(sta->stats, cpu)->syncp);
+    }
+    ether_addr_copy(sta->addr, addr);
+    sta->connected_at = jiffies;
+    sta->rate = wifi_drv_sta_rate(addr);
+    INIT_LIST_HEAD(&sta->active);
+    for (tid = 0; tid < WIFI_DRV_NUM_TIDS; tid++) {
+        __skb_queue_head_init(&sta->tids[tid].q);
+        codel_vars_init(&sta->tids[tid].cvars);
+        sta->tids[tid].sta = sta;
+    }
 
-    // Check if the requested type is valid
-    if (type != NL80211_IFTYPE_AP && type != NL80211_IFTYPE_STATION) {
-        return -EINVAL; // Invalid interface type
+    spin_lock_bh(&ndev_data->sta_lock);
+    err = rhashtable_lookup_insert_fast(&ndev_data->sta_table, &sta->node, wifi_drv_sta_params);
+    if (err == 0) {
+        list_add_tail(&sta->list, &ndev_data->sta_list);
+        ndev_data->n_sta++;
     }
+    spin_unlock_bh(&ndev_data->sta_lock);
 
-    // Update the interface type
-    dev->ieee80211_ptr->iftype = type;
+    if (err) {
+        free_percpu(sta->stats);
+        kfree(sta);
+    }
+    return err;
+}
 
-    // Perform any additional configuration needed for the new type
-    if (type == NL80211_IFTYPE_AP) {
-        // Initialize AP-specific settings
-        // e.g., start beaconing, set up security parameters, etc.
-    } else if (type == NL80211_IFTYPE_STATION) {
-        // Initialize Station-specific settings
-        // e.g., stop beaconing, clear associated clients, etc.
+/* Should be called with sta_lock held. Datapath may still use the station, it is freed after RCU grace period. */
+static void wifi_drv_sta_unlink(struct wifi_drv_ndev_priv_context *ndev_data, struct wifi_drv_sta *sta) {
+    rhashtable_remove_fast(&ndev_data->sta_table, &sta->node, wifi_drv_sta_params);
+    list_del(&sta->list);
+    ndev_data->n_sta--;
+    if (ndev_data->dump_sta == sta) {
+        ndev_data->dump_sta = NULL;
     }
 
-    return 0; // Success
+    /* datapath may have found the station already, "dead" stops it from queueing frames that nobody would send */
+    spin_lock(&ndev_data->airtime_lock);
+    sta->dead = true;
+    list_del_init(&sta->active);
+    wifi_drv_sta_purge_tids(sta);
+    spin_unlock(&ndev_data->airtime_lock);
+
+    call_rcu(&sta->rcu, wifi_drv_sta_free_rcu);
 }
 
-static void nvf_del_virtual_intf(struct wiphy *wiphy, struct net_device *dev) {
-    struct wifi_drv_context *wifi_drv = dev_priv(dev);
+static int wifi_drv_sta_del(struct wifi_drv_ndev_priv_context *ndev_data, const u8 *addr) {
+    struct wifi_drv_sta *sta;
+    int err = -ENOENT;
 
-    // Perform any necessary cleanup for the virtual interface
-    // e.g., stop beaconing, disconnect clients, etc.
+    spin_lock_bh(&ndev_data->sta_lock);
+    sta = rhashtable_lookup_fast(&ndev_data->sta_table, addr, wifi_drv_sta_params);
+    if (sta != NULL) {
+        wifi_drv_sta_unlink(ndev_data, sta);
+        err = 0;
+    }
+    spin_unlock_bh(&ndev_data->sta_lock);
+    return err;
+}
 
-    // Unregister the device
-    unregister_netdev(dev);
-    free_netdev(dev); // Free the allocated net_device structure
+/* Removes all stations, e.g. when AP stops. */
+static void wifi_drv_sta_flush(struct wifi_drv_ndev_priv_context *ndev_data) {
+    struct wifi_drv_sta *sta, *tmp;
 
-    // Remove the device from the driver context if you maintain a list
+    spin_lock_bh(&ndev_data->sta_lock);
+    list_for_each_entry_safe(sta, tmp, &ndev_data->sta_list, list) {
+        wifi_drv_sta_unlink(ndev_data, sta);
+    }
+    spin_unlock_bh(&ndev_data->sta_lock);
 }
 
+/* Associates "count" synthetic stations with the AP, their addresses are 02:5a:<number of the station>. */
+static void wifi_drv_sta_add_synthetic(struct wifi_drv_ndev_priv_context *ndev_data, unsigned int count) {
+    u8 addr[ETH_ALEN] = {0x02, 0x5a};
+    unsigned int i;
 
-/* callback that called by the kernel when user decided to scan.
- * This callback should initiate scan routine(through work_struct) and exit with 0 if everything ok.
- * Scan routine should be finished with cfg80211_scan_done() call. */
-static int nvf_scan(struct wifi *wifi, struct cfg80211_scan_request *request) {
-    struct wifi_drv_context *wifi_drv = wifi_get_wifi_drv_context(wifi)->wifi_drv;
+    count = min_t(unsigned int, count, WIFI_DRV_MAX_STATIONS);
+    for (i = 0; i < count; i++) {
+        put_unaligned_be32(i, addr + 2);
+        if (wifi_drv_sta_add(ndev_data, addr) == -ENOMEM) {
+            break;
+        }
+    }
+}
+
+/* Datapath accounting of "packets" frames of "len" bytes in total to/from station "addr", called from napi.
+ * Returns the station, it is valid until the end of the napi poll. */
+static struct wifi_drv_sta *wifi_drv_sta_account(struct wifi_drv_ndev_priv_context *ndev_data, const u8 *addr,
+                                                 unsigned int packets, unsigned int len, bool tx) {
+    struct wifi_drv_sta_stats *stats;
+    struct wifi_drv_sta *sta;
 
-    if(down_interruptible(&wifi_drv->sem)) {
-        return -ERESTARTSYS;
+    sta = rhashtable_lookup_fast(&ndev_data->sta_table, addr, wifi_drv_sta_params);
+    if (sta == NULL) {
+        return NULL;
     }
 
-    if (wifi_drv->scan_request != NULL) {
-        up(&wifi_drv->sem);
-        return -EBUSY;
+    stats = this_cpu_ptr(sta->stats);
+    u64_stats_update_begin(&stats->syncp);
+    if (tx) {
+        u64_stats_add(&stats->tx_packets, packets);
+        u64_stats_add(&stats->tx_bytes, len);
+    } else {
+        u64_stats_add(&stats->rx_packets, packets);
+        u64_stats_add(&stats->rx_bytes, len);
     }
-    wifi_drv->scan_request = request;
+    u64_stats_update_end(&stats->syncp);
+    return sta;
+}
 
-    up(&wifi_drv->sem);
+static void wifi_drv_sta_fill_info(struct wifi_drv_sta *sta, struct station_info *sinfo) {
+    int cpu;
 
-    if (!schedule_work(&wifi_drv->ws_scan)) {
-        return -EBUSY;
+    for_each_possible_cpu(cpu) {
+        const struct wifi_drv_sta_stats *stats = per_cpu_ptr(sta->stats, cpu);
+        u64 tx_packets, tx_bytes, rx_packets, rx_bytes;
+        unsigned int start;
+
+        do {
+            start = u64_stats_fetch_begin(&stats->syncp);
+            tx_packets = u64_stats_read(&stats->tx_packets);
+            tx_bytes = u64_stats_read(&stats->tx_bytes);
+            rx_packets = u64_stats_read(&stats->rx_packets);
+            rx_bytes = u64_stats_read(&stats->rx_bytes);
+        } while (u64_stats_fetch_retry(&stats->syncp, start));
+
+        sinfo->tx_packets += tx_packets;
+        sinfo->tx_bytes += tx_bytes;
+        sinfo->rx_packets += rx_packets;
+        sinfo->rx_bytes += rx_bytes;
     }
 
-    return 0; /* OK */
+    sinfo->connected_time = jiffies_to_msecs(jiffies - sta->connected_at) / MSEC_PER_SEC;
+    sinfo->txrate.legacy = sta->rate;
+    sinfo->tx_duration = READ_ONCE(sta->airtime_us);
+    sinfo->filled |= BIT_ULL(NL80211_STA_INFO_TX_PACKETS) | BIT_ULL(NL80211_STA_INFO_TX_BYTES64) |
+                     BIT_ULL(NL80211_STA_INFO_RX_PACKETS) | BIT_ULL(NL80211_STA_INFO_RX_BYTES64) |
+                     BIT_ULL(NL80211_STA_INFO_CONNECTED_TIME) | BIT_ULL(NL80211_STA_INFO_TX_BITRATE) |
+                     BIT_ULL(NL80211_STA_INFO_TX_DURATION);
 }
 
-/* callback that called by the kernel when there is need to "connect" to some network.
+/* Whether frames of other devices may be put to the rings of "ndev", checked by producers under RCU.
+ * Pairs with synchronize_net() in wifi_drv_set_queues(). */
+static bool wifi_drv_rx_ready(struct net_device *ndev) {
+    return netif_running(ndev) && !READ_ONCE(ndev_get_wifi_drv_context(ndev)->paused);
+}
+
+/* Puts frame that came from the medium to the RX ring of "ndev". */
+static void wifi_drv_medium_rx(struct net_device *ndev, struct sk_buff *skb) {
+    struct wifi_drv_ndev_priv_context *ndev_data = ndev_get_wifi_drv_context(ndev);
+    struct wifi_drv_queue *q;
+    bool queued;
+
+    if (!wifi_drv_rx_ready(ndev)) {
+        wifi_drv_rx_drop(ndev, false);
+        kfree_skb(skb);
+        return;
+    }
+    q = &ndev_data->queues[smp_processor_id() % READ_ONCE(ndev_data->num_queues)];
+
+    /* scrubs skb and sets protocol/pkt_type for the receiver, frees skb on failure. */
+    if (__dev_forward_skb(ndev, skb) != NET_RX_SUCCESS) {
+        wifi_drv_rx_drop(ndev, false);
+        return;
+    }
+
+    spin_lock(&q->rx_produce_lock);
+    queued = wifi_drv_ring_produce(&q->rx_ring, skb);
+    if (!queued) {
+        q->rx_ring_full++;
+    }
+    spin_unlock(&q->rx_produce_lock);
+
+    if (!queued) {
+        wifi_drv_rx_drop(ndev, true);
+        kfree_skb(skb);
+        return;
+    }
+    napi_schedule(&q->napi);
+}
+
+/* Delivers the frame to members of its channel: unicast to the owner of destination address, broadcast to everyone but sender.
+ * Returns true if anybody has received it. Called under RCU. */
+static bool wifi_drv_medium_deliver(struct sk_buff *skb) {
+    struct wifi_drv_medium_cb *cb = (struct wifi_drv_medium_cb *) skb->cb;
+    struct ethhdr *eth = (struct ethhdr *) skb->data;
+    struct wifi_drv_medium_member *member;
+    bool delivered = false;
+
+    if (!is_multicast_ether_addr(eth->h_dest)) {
+        member = rhashtable_lookup(&g_medium.members_table, eth->h_dest, wifi_drv_medium_params);
+        if (member == NULL || ndev_get_wifi_drv_context(member->ndev)->wifi_drv->oper_chan != cb->chan) {
+            kfree_skb(skb);
+            return false;
+        }
+        wifi_drv_medium_rx(member->ndev, skb);
+        return true;
+    }
+
+    list_for_each_entry_rcu(member, &g_medium.members, list) {
+        struct sk_buff *clone;
+
+        if (ndev_get_wifi_drv_context(member->ndev)->wifi_drv->oper_chan != cb->chan ||
+            ether_addr_equal(member->addr, eth->h_source)) {
+            continue;
+        }
+        clone = skb_clone(skb, GFP_ATOMIC);
+        if (clone != NULL) {
+            wifi_drv_medium_rx(member->ndev, clone);
+            delivered = true;
+        }
+    }
+    consume_skb(skb);
+    return delivered;
+}
+
+/* Soft hrtimer of the wheel: delivers frames of every tick that has passed and rearms for the next one while frames remain. */
+static enum hrtimer_restart wifi_drv_wheel_fire(struct hrtimer *timer) {
+    struct wifi_drv_wheel *wheel = container_of(timer, struct wifi_drv_wheel, timer);
+    u64 now_tick = div64_u64(ktime_get_ns(), g_medium.tick_ns);
+    struct sk_buff_head expired;
+    struct sk_buff *skb;
+
+    __skb_queue_head_init(&expired);
+    while (wheel->pending && wheel->next_tick <= now_tick) {
+        struct sk_buff_head *slot = &wheel->slots[wheel->next_tick & (WIFI_DRV_WHEEL_SLOTS - 1)];
+
+        wheel->pending -= skb_queue_len(slot);
+        skb_queue_splice_tail_init(slot, &expired);
+        wheel->next_tick++;
+    }
+
+    rcu_read_lock();
+    while ((skb = __skb_dequeue(&expired)) != NULL) {
+        if (wifi_drv_medium_deliver(skb)) {
+            wheel->delivered++;
+        }
+    }
+    rcu_read_unlock();
+
+    if (wheel->pending) {
+        wheel->armed_tick = wheel->next_tick;
+        hrtimer_set_expires(timer, ns_to_ktime(wheel->armed_tick * g_medium.tick_ns));
+        return HRTIMER_RESTART;
+    }
+    wheel->armed = false;
+    return HRTIMER_NORESTART;
+}
+
+/* Transmits frames of "dev" to the medium as one transmission(A-MPDU): they take their airtime on the channel
+ * (medium_bandwidth_kbps) together and are delivered medium_latency_us after that, every frame is lost
+ * with medium_loss_ppm probability. Called from napi. Returns false if frames could not be queued(delay is beyond
+ * the wheel), "frames" is empty on return. */
+static bool wifi_drv_medium_tx(struct net_device *dev, struct sk_buff_head *frames) {
+    struct wifi_drv_wheel *wheel = this_cpu_ptr(g_medium.wheels);
+    u16 chan = ndev_get_wifi_drv_context(dev)->wifi_drv->oper_chan;
+    unsigned int loss_ppm = READ_ONCE(medium_loss_ppm);
+    unsigned int bandwidth_kbps = READ_ONCE(medium_bandwidth_kbps);
+    struct sk_buff_head *slot;
+    u64 now = ktime_get_ns();
+    u64 deliver_at = now;
+    struct sk_buff *skb;
+    u64 tick;
+
+    if (bandwidth_kbps) {
+        atomic64_t *busy_until = &g_medium.busy_until[chan % WIFI_DRV_MEDIUM_MAX_CHAN];
+        u64 bytes = 0, airtime;
+        s64 old = atomic64_read(busy_until);
+
+        skb_queue_walk(frames, skb) {
+            bytes += skb->len;
+        }
+        airtime = div_u64(bytes * 8 * USEC_PER_SEC, bandwidth_kbps);
+
+        /* transmission starts when the channel becomes free */
+        do {
+            deliver_at = max_t(u64, old, now) + airtime;
+        } while (!atomic64_try_cmpxchg(busy_until, &old, deliver_at));
+    }
+    deliver_at += (u64) READ_ONCE(medium_latency_us) * NSEC_PER_USEC;
+
+    /* all slots are empty, so wheel may be moved to the current time */
+    if (wheel->pending == 0) {
+        wheel->next_tick = div64_u64(now, g_medium.tick_ns) + 1;
+    }
+    tick = max_t(u64, div64_u64(deliver_at + g_medium.tick_ns - 1, g_medium.tick_ns), wheel->next_tick);
+    if (tick - wheel->next_tick >= WIFI_DRV_WHEEL_SLOTS) {
+        wheel->overflow += skb_queue_len(frames);
+        __skb_queue_purge(frames);
+        return false;
+    }
+
+    slot = &wheel->slots[tick & (WIFI_DRV_WHEEL_SLOTS - 1)];
+    while ((skb = __skb_dequeue(frames)) != NULL) {
+        /* lost frame has taken its airtime as well */
+        if (loss_ppm && get_random_u32_below(1000000) < loss_ppm) {
+            wheel->lost++;
+            kfree_skb(skb);
+            continue;
+        }
+        ((struct wifi_drv_medium_cb *) skb->cb)->chan = chan;
+        __skb_queue_tail(slot, skb);
+        wheel->pending++;
+        wheel->queued++;
+    }
+
+    if (wheel->pending && (!wheel->armed || tick < wheel->armed_tick)) {
+        wheel->armed = true;
+        wheel->armed_tick = tick;
+        hrtimer_start(&wheel->timer, ns_to_ktime(tick * g_medium.tick_ns), HRTIMER_MODE_ABS_PINNED_SOFT);
+    }
+    return true;
+}
+
+static int wifi_drv_medium_join(struct net_device *ndev) {
+    struct wifi_drv_medium_member *member = &ndev_get_wifi_drv_context(ndev)->medium_member;
+    int err;
+
+    member->ndev = ndev;
+    ether_addr_copy(member->addr, ndev->dev_addr);
+
+    spin_lock_bh(&g_medium.lock);
+    err = rhashtable_lookup_insert_fast(&g_medium.members_table, &member->node, wifi_drv_medium_params);
+    if (err == 0) {
+        list_add_tail_rcu(&member->list, &g_medium.members);
+    }
+    spin_unlock_bh(&g_medium.lock);
+    return err;
+}
+
+/* Frames the wheels deliver right now may still see the member, device is not freed before RCU grace period. */
+static void wifi_drv_medium_leave(struct net_device *ndev) {
+    struct wifi_drv_medium_member *member = &ndev_get_wifi_drv_context(ndev)->medium_member;
+
+    spin_lock_bh(&g_medium.lock);
+    rhashtable_remove_fast(&g_medium.members_table, &member->node, wifi_drv_medium_params);
+    list_del_rcu(&member->list);
+    spin_unlock_bh(&g_medium.lock);
+}
+
+/* All members should have left already. */
+static void wifi_drv_medium_free(struct wifi_drv_medium *m) {
+    int cpu, i;
+
+    if (m->wheels == NULL) {
+        return;
+    }
+
+    for_each_possible_cpu(cpu) {
+        struct wifi_drv_wheel *wheel = per_cpu_ptr(m->wheels, cpu);
+
+        hrtimer_cancel(&wheel->timer);
+        if (wheel->slots == NULL) {
+            continue;
+        }
+        for (i = 0; i < WIFI_DRV_WHEEL_SLOTS; i++) {
+            __skb_queue_purge(&wheel->slots[i]);
+        }
+        kfree(wheel->slots);
+    }
+    free_percpu(m->wheels);
+    m->wheels = NULL;
+    rhashtable_destroy(&m->members_table);
+}
+
+static int wifi_drv_medium_init(struct wifi_drv_medium *m) {
+    int cpu, i, err;
+
+    spin_lock_init(&m->lock);
+    INIT_LIST_HEAD(&m->members);
+    m->tick_ns = (u64) max(medium_tick_us, 1U) * NSEC_PER_USEC;
+    for (i = 0; i < WIFI_DRV_MEDIUM_MAX_CHAN; i++) {
+        atomic64_set(&m->busy_until[i], 0);
+    }
+
+    err = rhashtable_init(&m->members_table, &wifi_drv_medium_params);
+    if (err) {
+        return err;
+    }
+
+    m->wheels = alloc_percpu(struct wifi_drv_wheel);
+    if (m->wheels == NULL) {
+        rhashtable_destroy(&m->members_table);
+        return -ENOMEM;
+    }
+    /* all timers are initialized first, wifi_drv_medium_free() cancels them on error */
+    for_each_possible_cpu(cpu) {
+        struct wifi_drv_wheel *wheel = per_cpu_ptr(m->wheels, cpu);
+
+        hrtimer_init(&wheel->timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS_PINNED_SOFT);
+        wheel->timer.function = wifi_drv_wheel_fire;
+    }
+    for_each_possible_cpu(cpu) {
+        struct wifi_drv_wheel *wheel = per_cpu_ptr(m->wheels, cpu);
+
+        wheel->slots = kcalloc_node(WIFI_DRV_WHEEL_SLOTS, sizeof(*wheel->slots), GFP_KERNEL, cpu_to_node(cpu));
+        if (wheel->slots == NULL) {
+            wifi_drv_medium_free(m);
+            return -ENOMEM;
+        }
+        for (i = 0; i < WIFI_DRV_WHEEL_SLOTS; i++) {
+            __skb_queue_head_init(&wheel->slots[i]);
+        }
+    }
+    return 0;
+}
+
+/* Returns device that receives frames transmitted on "ndev": the primary STA interface talks to the AP interface
+ * and vice versa. Other interfaces have no peer, so RX rings of the pair never get a second lockless producer.
+ * Must be called under rcu_read_lock_bh(), napi poll already runs with BH disabled. */
+static struct net_device *wifi_drv_get_peer(struct net_device *ndev) {
+    struct wifi_drv_context *wifi_drv = ndev_get_wifi_drv_context(ndev)->wifi_drv;
+    struct net_device *ap_ndev = rcu_dereference_bh(wifi_drv->ap_ndev);
+
+    if (ndev == wifi_drv->ndev) {
+        return ap_ndev;
+    }
+    if (ndev == ap_ndev) {
+        return wifi_drv->ndev;
+    }
+    return NULL;
+}
+
+/* Counts frame dropped by the airtime scheduler, may be called from any CPU in softirq. */
+static void wifi_drv_tx_drop(struct net_device *ndev, unsigned int n) {
+    struct wifi_drv_pcpu_stats *stats = this_cpu_ptr(ndev_get_wifi_drv_context(ndev)->pcpu_stats);
+
+    u64_stats_update_begin(&stats->syncp);
+    u64_stats_add(&stats->tx_dropped, n);
+    u64_stats_update_end(&stats->syncp);
+}
+
+/* Sends the frame of AP interface to the air. Called from napi of any queue and from airtime_timer,
+ * so the peer RX ring is filled under its rx_produce_lock like with the medium. Returns false if frame is dropped. */
+static bool wifi_drv_ap_deliver(struct net_device *ndev, struct sk_buff *skb) {
+    struct net_device *peer;
+
+    if (medium) {
+        struct sk_buff_head frames;
+
+        __skb_queue_head_init(&frames);
+        __skb_queue_tail(&frames, skb);
+        return wifi_drv_medium_tx(ndev, &frames);
+    }
+    peer = wifi_drv_get_peer(ndev);
+    if (peer == NULL || !wifi_drv_rx_ready(peer)) {
+        kfree_skb(skb);
+        return false;
+    }
+    wifi_drv_medium_rx(peer, skb);
+    return true;
+}
+
+/* Time frame of "len" bytes takes on the air at "rate"(100 kbps), us */
+static u32 wifi_drv_airtime_us(unsigned int len, u16 rate) {
+    return DIV_ROUND_UP(len * 80, rate);
+}
+
+/* CoDel callbacks, "ctx" is struct wifi_drv_tid */
+static u32 wifi_drv_codel_skb_len(const struct sk_buff *skb) {
+    return skb->len;
+}
+
+static codel_time_t wifi_drv_codel_skb_time(const struct sk_buff *skb) {
+    return ((const struct wifi_drv_tid_cb *) skb->cb)->enqueue_time;
+}
+
+static void wifi_drv_codel_drop(struct sk_buff *skb, void *ctx) {
+    struct wifi_drv_tid *tid = ctx;
+
+    tid->sta->codel_drops++;
+    kfree_skb(skb);
+}
+
+static struct sk_buff *wifi_drv_codel_dequeue(struct codel_vars *vars, void *ctx) {
+    struct wifi_drv_tid *tid = ctx;
+    struct sk_buff *skb = __skb_dequeue(&tid->q);
+
+    if (skb != NULL) {
+        tid->backlog -= skb->len;
+    }
+    return skb;
+}
+
+/* Takes next frame of the station: higher TID first, CoDel drops frames that waited too long. Under airtime_lock. */
+static struct sk_buff *wifi_drv_sta_dequeue(struct wifi_drv_ndev_priv_context *ndev_data, struct wifi_drv_sta *sta,
+                                            unsigned int *drops) {
+    struct sk_buff *skb;
+    int tid;
+
+    for (tid = WIFI_DRV_NUM_TIDS - 1; tid >= 0; tid--) {
+        struct wifi_drv_tid *t = &sta->tids[tid];
+        u64 dropped = sta->codel_drops;
+        u32 sojourn;
+
+        if (skb_queue_empty(&t->q)) {
+            continue;
+        }
+        skb = codel_dequeue(t, &t->backlog, &ndev_data->cparams, &t->cvars, &ndev_data->cstats,
+                            wifi_drv_codel_skb_len, wifi_drv_codel_skb_time, wifi_drv_codel_drop,
+                            wifi_drv_codel_dequeue);
+        *drops += sta->codel_drops - dropped;
+        if (skb == NULL) {
+            continue;
+        }
+
+        sojourn = codel_time_to_us(codel_get_time() - wifi_drv_codel_skb_time(skb));
+        sta->sojourn_sum_us += sojourn;
+        sta->sojourn_max_us = max(sta->sojourn_max_us, sojourn);
+        return skb;
+    }
+    return NULL;
+}
+
+static bool wifi_drv_sta_backlogged(struct wifi_drv_sta *sta) {
+    unsigned int tid;
+
+    for (tid = 0; tid < WIFI_DRV_NUM_TIDS; tid++) {
+        if (!skb_queue_empty(&sta->tids[tid].q)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Queues A-MPDU of frames for the station to the TID queue of its frames at once, frames beyond the queue limit
+ * are dropped. Returns false if the station is gone, frames are left to the caller then. Called from napi. */
+static bool wifi_drv_airtime_enqueue(struct wifi_drv_ndev_priv_context *ndev_data, struct wifi_drv_sta *sta,
+                                     struct sk_buff_head *frames) {
+    struct wifi_drv_tid *t = &sta->tids[skb_peek(frames)->priority & (WIFI_DRV_NUM_TIDS - 1)];
+    codel_time_t now = codel_get_time();
+    unsigned int dropped;
+    struct sk_buff *skb;
+
+    skb_queue_walk(frames, skb) {
+        ((struct wifi_drv_tid_cb *) skb->cb)->enqueue_time = now;
+    }
+
+    spin_lock(&ndev_data->airtime_lock);
+    if (sta->dead) {
+        spin_unlock(&ndev_data->airtime_lock);
+        return false;
+    }
+    while (skb_queue_len(&t->q) < WIFI_DRV_TID_LIMIT && (skb = __skb_dequeue(frames)) != NULL) {
+        __skb_queue_tail(&t->q, skb);
+        t->backlog += skb->len;
+    }
+    dropped = skb_queue_len(frames);
+    sta->overflow_drops += dropped;
+    if (list_empty(&sta->active)) {
+        list_add_tail(&sta->active, &ndev_data->airtime_active);
+    }
+    spin_unlock(&ndev_data->airtime_lock);
+
+    if (dropped) {
+        __skb_queue_purge(frames);
+        wifi_drv_tx_drop(ndev_data->wdev.netdev, dropped);
+    }
+    return true;
+}
+
+/* Sends frames of backlogged stations while the air is free. Stations are served by deficit round robin in airtime:
+ * station that has used its quantum goes to the end of the list, so slow stations can't take the air from fast ones.
+ * When the air is busy, airtime_timer runs the scheduler again at the moment it is free. Called in softirq. */
+static void wifi_drv_airtime_run(struct wifi_drv_ndev_priv_context *ndev_data) {
+    struct net_device *ndev = ndev_data->wdev.netdev;
+    struct sk_buff_head burst;
+    struct wifi_drv_sta *sta;
+    unsigned int drops = 0;
+    u64 now = ktime_get_ns(), busy_until;
+    struct sk_buff *skb;
+    bool backlogged;
+
+    __skb_queue_head_init(&burst);
+
+    spin_lock(&ndev_data->airtime_lock);
+    busy_until = max(ndev_data->air_busy_until_ns, now);
+    while (!list_empty(&ndev_data->airtime_active) && busy_until < now + WIFI_DRV_AIRTIME_BURST_NS) {
+        u32 airtime;
+
+        sta = list_first_entry(&ndev_data->airtime_active, struct wifi_drv_sta, active);
+        if (sta->deficit <= 0) {
+            sta->deficit += WIFI_DRV_AIRTIME_QUANTUM_US;
+            list_move_tail(&sta->active, &ndev_data->airtime_active);
+            continue;
+        }
+
+        skb = wifi_drv_sta_dequeue(ndev_data, sta, &drops);
+        if (skb == NULL) {
+            list_del_init(&sta->active);
+            continue;
+        }
+        airtime = wifi_drv_airtime_us(skb->len, sta->rate);
+        sta->deficit -= airtime;
+        sta->airtime_us += airtime;
+        sta->tx_frames++;
+        busy_until += (u64) airtime * NSEC_PER_USEC;
+        __skb_queue_tail(&burst, skb);
+
+        if (!wifi_drv_sta_backlogged(sta)) {
+            list_del_init(&sta->active);
+        }
+    }
+    ndev_data->air_busy_until_ns = busy_until;
+    backlogged = !list_empty(&ndev_data->airtime_active);
+    spin_unlock(&ndev_data->airtime_lock);
+
+    if (backlogged) {
+        hrtimer_start(&ndev_data->airtime_timer, ns_to_ktime(busy_until - WIFI_DRV_AIRTIME_BURST_NS),
+                      HRTIMER_MODE_ABS_SOFT);
+    }
+    if (drops) {
+        wifi_drv_tx_drop(ndev, drops);
+    }
+    while ((skb = __skb_dequeue(&burst)) != NULL) {
+        wifi_drv_ap_deliver(ndev, skb);
+    }
+}
+
+static enum hrtimer_restart wifi_drv_airtime_fire(struct hrtimer *timer) {
+    struct wifi_drv_ndev_priv_context *ndev_data = container_of(timer, struct wifi_drv_ndev_priv_context, airtime_timer);
+
+    rcu_read_lock_bh();
+    wifi_drv_airtime_run(ndev_data);
+    rcu_read_unlock_bh();
+    return HRTIMER_NORESTART;
+}
+
+/* Drops frames of all stations, the AP is going down. */
+static void wifi_drv_airtime_purge(struct wifi_drv_ndev_priv_context *ndev_data) {
+    struct wifi_drv_sta *sta, *tmp;
+    unsigned int n = 0;
+
+    hrtimer_cancel(&ndev_data->airtime_timer);
+
+    spin_lock_bh(&ndev_data->airtime_lock);
+    list_for_each_entry_safe(sta, tmp, &ndev_data->airtime_active, active) {
+        n += wifi_drv_sta_purge_tids(sta);
+        list_del_init(&sta->active);
+    }
+    spin_unlock_bh(&ndev_data->airtime_lock);
+
+    if (n) {
+        local_bh_disable();
+        wifi_drv_tx_drop(ndev_data->wdev.netdev, n);
+        local_bh_enable();
+    }
+}
+
+/* Network packet transmit.
+ * Callback that called by the kernel when packet of data should be sent.
+ * Frame is put to the TX ring of the queue selected by the stack (XPS), delivery and completion happen in napi.
+ * With xmit_more napi is kicked once per batch, BQL limits bytes in flight per queue. */
+static netdev_tx_t nvf_ndo_start_xmit(struct sk_buff *skb,
+                               struct net_device *dev) {
+    struct wifi_drv_ndev_priv_context *ndev_data = ndev_get_wifi_drv_context(dev);
+    u16 qid = skb_get_queue_mapping(skb);
+    struct wifi_drv_queue *q = &ndev_data->queues[qid];
+    struct netdev_queue *txq = netdev_get_tx_queue(dev, qid);
+    bool kick;
+
+    if (unlikely(wifi_drv_ring_full(&q->tx_ring))) {
+        /* should not happen, queue is stopped in advance when the ring becomes full */
+        netif_tx_stop_queue(txq);
+        q->tx_ring_full++;
+        return NETDEV_TX_BUSY;
+    }
+
+    /* bytes are accounted before frame is visible to napi, so completion never overtakes them. */
+    kick = __netdev_tx_sent_queue(txq, skb->len, netdev_xmit_more());
+    /* the stack has nothing more for us now(or BQL has stopped it), napi sends open aggregates with this frame */
+    ((struct wifi_drv_tx_cb *) skb->cb)->burst_end = kick;
+    wifi_drv_ring_produce(&q->tx_ring, skb);
+
+    if (wifi_drv_ring_full(&q->tx_ring)) {
+        netif_tx_stop_queue(txq);
+        q->tx_ring_full++;
+        /* napi may have drained the ring before the queue was stopped, pairs with smp_mb() in wifi_drv_queue_tx() */
+        smp_mb();
+        if (!wifi_drv_ring_full(&q->tx_ring)) {
+            netif_tx_start_queue(txq);
+        }
+        kick = true;
+    }
+
+    if (kick) {
+        q->tx_kicks++;
+        napi_schedule(&q->napi);
+    }
+    return NETDEV_TX_OK;
+}
+
+/* Delivers frames for "dest" as one A-MPDU: AP queues them to the TID of the station at once, the medium carries
+ * them as one transmission, loopback puts them to the peer RX ring. "frames" is empty on return. */
+static void wifi_drv_tx_deliver(struct wifi_drv_tx_ctx *tx, struct sk_buff_head *frames, const u8 *dest, u32 bytes) {
+    unsigned int n = skb_queue_len(frames);
+    struct wifi_drv_sta *sta;
+    struct sk_buff *skb;
+
+    tx->q->agg_hist[min(fls(n) - 1, WIFI_DRV_AGG_HIST_BUCKETS - 1)]++;
+
+    if (tx->is_ap) {
+        sta = wifi_drv_sta_account(tx->ndev_data, dest, n, bytes, true);
+        /* unicast to a station waits for its airtime, everything else goes to the air right away */
+        if (sta != NULL && wifi_drv_airtime_enqueue(tx->ndev_data, sta, frames)) {
+            tx->scheduled = true;
+            tx->sent += n;
+            tx->sent_bytes += bytes;
+            return;
+        }
+        while ((skb = __skb_dequeue(frames)) != NULL) {
+            unsigned int len = skb->len;
+
+            if (wifi_drv_ap_deliver(tx->q->ndev, skb)) {
+                tx->sent++;
+                tx->sent_bytes += len;
+            } else {
+                tx->dropped++;
+            }
+        }
+        return;
+    }
+    if (medium) {
+        /* frames are on the air from the sender point of view, even if the medium loses them */
+        if (wifi_drv_medium_tx(tx->q->ndev, frames)) {
+            tx->sent += n;
+            tx->sent_bytes += bytes;
+        } else {
+            tx->dropped += n;
+        }
+        return;
+    }
+    while ((skb = __skb_dequeue(frames)) != NULL) {
+        unsigned int len = skb->len;
+        bool queued;
+
+        if (tx->peer_q == NULL) {
+            kfree_skb(skb);
+            tx->dropped++;
+            continue;
+        }
+        /* scrubs skb and sets protocol/pkt_type for the peer, frees skb on failure. */
+        if (__dev_forward_skb(tx->peer, skb) != NET_RX_SUCCESS) {
+            wifi_drv_rx_drop(tx->peer, false);
+            tx->dropped++;
+            continue;
+        }
+        if (tx->peer_shared) {
+            spin_lock(&tx->peer_q->rx_produce_lock);
+        }
+        queued = wifi_drv_ring_produce(&tx->peer_q->rx_ring, skb);
+        if (!queued) {
+            tx->peer_q->rx_ring_full++;
+        }
+        if (tx->peer_shared) {
+            spin_unlock(&tx->peer_q->rx_produce_lock);
+        }
+        if (!queued) {
+            wifi_drv_rx_drop(tx->peer, true);
+            kfree_skb(skb);
+            tx->dropped++;
+            continue;
+        }
+        tx->sent++;
+        tx->sent_bytes += len;
+    }
+}
+
+static void wifi_drv_agg_flush(struct wifi_drv_tx_ctx *tx, struct wifi_drv_agg *agg, enum wifi_drv_agg_flush reason) {
+    tx->q->agg_flush[reason]++;
+    wifi_drv_tx_deliver(tx, &agg->frames, agg->addr, agg->bytes);
+    agg->bytes = 0;
+}
+
+static void wifi_drv_agg_flush_all(struct wifi_drv_tx_ctx *tx, enum wifi_drv_agg_flush reason) {
+    unsigned int i;
+
+    for (i = 0; i < WIFI_DRV_AGG_SLOTS; i++) {
+        if (!skb_queue_empty(&tx->q->aggs[i].frames)) {
+            wifi_drv_agg_flush(tx, &tx->q->aggs[i], reason);
+        }
+    }
+}
+
+/* Returns aggregate of "dest" and "tid". New one takes a free slot, or the slot of the oldest aggregate
+ * that is delivered first. */
+static struct wifi_drv_agg *wifi_drv_agg_get(struct wifi_drv_tx_ctx *tx, const u8 *dest, u8 tid) {
+    struct wifi_drv_agg *agg, *slot = NULL;
+    unsigned int i;
+
+    for (i = 0; i < WIFI_DRV_AGG_SLOTS; i++) {
+        agg = &tx->q->aggs[i];
+        if (skb_queue_empty(&agg->frames)) {
+            if (slot == NULL || !skb_queue_empty(&slot->frames)) {
+                slot = agg;
+            }
+            continue;
+        }
+        if (agg->tid == tid && ether_addr_equal(agg->addr, dest)) {
+            return agg;
+        }
+        if (slot == NULL || (!skb_queue_empty(&slot->frames) && agg->start_ns < slot->start_ns)) {
+            slot = agg;
+        }
+    }
+
+    if (!skb_queue_empty(&slot->frames)) {
+        wifi_drv_agg_flush(tx, slot, WIFI_DRV_AGG_FLUSH_EVICT);
+    }
+    ether_addr_copy(slot->addr, dest);
+    slot->tid = tid;
+    return slot;
+}
+
+/* Adds the frame to the aggregate of its destination and TID(skb->priority) and delivers the aggregate
+ * when it is full. Multicast frames are never aggregated, like in 802.11. */
+static void wifi_drv_agg_add(struct wifi_drv_tx_ctx *tx, struct sk_buff *skb, unsigned int max_frames) {
+    const u8 *dest = eth_hdr(skb)->h_dest;
+    struct wifi_drv_agg *agg;
+
+    if (max_frames <= 1 || is_multicast_ether_addr(dest)) {
+        struct sk_buff_head frames;
+
+        __skb_queue_head_init(&frames);
+        __skb_queue_tail(&frames, skb);
+        wifi_drv_tx_deliver(tx, &frames, dest, skb->len);
+        return;
+    }
+
+    agg = wifi_drv_agg_get(tx, dest, skb->priority & (WIFI_DRV_NUM_TIDS - 1));
+    if (!skb_queue_empty(&agg->frames) && agg->bytes + skb->len > WIFI_DRV_AGG_MAX_BYTES) {
+        wifi_drv_agg_flush(tx, agg, WIFI_DRV_AGG_FLUSH_FULL);
+    }
+    if (skb_queue_empty(&agg->frames)) {
+        agg->start_ns = ktime_get_ns();
+    }
+    __skb_queue_tail(&agg->frames, skb);
+    agg->bytes += skb->len;
+    if (skb_queue_len(&agg->frames) >= max_frames) {
+        wifi_drv_agg_flush(tx, agg, WIFI_DRV_AGG_FLUSH_FULL);
+    }
+}
+
+/* Delivers aggregates that have waited for more frames longer than ampdu_timeout_us,
+ * agg_timer is armed for the earliest of the rest. */
+static void wifi_drv_agg_expire(struct wifi_drv_tx_ctx *tx) {
+    u64 timeout_ns = (u64) READ_ONCE(ampdu_timeout_us) * NSEC_PER_USEC;
+    u64 now = 0, deadline = U64_MAX;
+    unsigned int i;
+
+    for (i = 0; i < WIFI_DRV_AGG_SLOTS; i++) {
+        struct wifi_drv_agg *agg = &tx->q->aggs[i];
+
+        if (skb_queue_empty(&agg->frames)) {
+            continue;
+        }
+        if (now == 0) {
+            now = ktime_get_ns();
+        }
+        if (agg->start_ns + timeout_ns <= now) {
+            wifi_drv_agg_flush(tx, agg, WIFI_DRV_AGG_FLUSH_TIMEOUT);
+            continue;
+        }
+        deadline = min(deadline, agg->start_ns + timeout_ns);
+    }
+    if (deadline != U64_MAX) {
+        hrtimer_start(&tx->q->agg_timer, ns_to_ktime(deadline), HRTIMER_MODE_ABS_SOFT);
+    }
+}
+
+static enum hrtimer_restart wifi_drv_agg_timer_fire(struct hrtimer *timer) {
+    struct wifi_drv_queue *q = container_of(timer, struct wifi_drv_queue, agg_timer);
+
+    napi_schedule(&q->napi);
+    return HRTIMER_NORESTART;
+}
+
+/* Drops frames of open aggregates, napi of the queue is disabled. */
+static void wifi_drv_agg_purge(struct wifi_drv_queue *q) {
+    unsigned int i;
+
+    hrtimer_cancel(&q->agg_timer);
+    for (i = 0; i < WIFI_DRV_AGG_SLOTS; i++) {
+        __skb_queue_purge(&q->aggs[i].frames);
+        q->aggs[i].bytes = 0;
+    }
+}
+
+/* Takes up to "budget" frames from the TX ring, delivers them to the peer in aggregates and completes them.
+ * Frames are completed when they get to an aggregate, open aggregates are delivered at the end of xmit_more batch
+ * or by agg_timer. Returns true if there are frames left in the TX ring. */
+static bool wifi_drv_queue_tx(struct wifi_drv_queue *q, int budget) {
+    struct wifi_drv_ndev_priv_context *ndev_data = ndev_get_wifi_drv_context(q->ndev);
+    struct netdev_queue *txq = netdev_get_tx_queue(q->ndev, q->qid);
+    unsigned int max_frames = min_t(unsigned int, READ_ONCE(ampdu_frames), WIFI_DRV_AGG_MAX_FRAMES);
+    struct wifi_drv_tx_ctx tx = {
+        .q = q,
+        .ndev_data = ndev_data,
+        .is_ap = ndev_data->wdev.iftype == NL80211_IFTYPE_AP,
+    };
+    unsigned int done = 0, bql_bytes = 0;
+    struct sk_buff *skb;
+
+    /* AP sends through wifi_drv_ap_deliver(), the peer RX ring is shared with airtime_timer then */
+    tx.peer = medium || tx.is_ap ? NULL : wifi_drv_get_peer(q->ndev);
+    if (tx.peer != NULL && wifi_drv_rx_ready(tx.peer)) {
+        struct wifi_drv_ndev_priv_context *peer_data = ndev_get_wifi_drv_context(tx.peer);
+        unsigned int peer_queues = READ_ONCE(peer_data->num_queues);
+
+        tx.peer_q = &peer_data->queues[q->qid % peer_queues];
+        /* queue N of the peer has the only producer while the peer has as many queues as we do,
+         * after ethtool -L has left it fewer several of our queues share it */
+        tx.peer_shared = ndev_data->num_queues > peer_queues;
+    }
+
+    while (done < budget && (skb = wifi_drv_ring_consume(&q->tx_ring)) != NULL) {
+        bool burst_end = ((struct wifi_drv_tx_cb *) skb->cb)->burst_end;
+
+        done++;
+        bql_bytes += skb->len;
+
+        wifi_drv_agg_add(&tx, skb, max_frames);
+        if (burst_end) {
+            wifi_drv_agg_flush_all(&tx, WIFI_DRV_AGG_FLUSH_BURST);
+        }
+    }
+    wifi_drv_agg_expire(&tx);
+
+    if (tx.peer_q != NULL && tx.sent) {
+        napi_schedule(&tx.peer_q->napi);
+    }
+    if (tx.scheduled) {
+        wifi_drv_airtime_run(ndev_data);
+    }
+    if (tx.sent || tx.dropped) {
+        wifi_drv_queue_stats_add(&q->tx_stats, tx.sent, tx.sent_bytes, tx.dropped);
+    }
+
+    if (done) {
+        netdev_tx_completed_queue(txq, done, bql_bytes);
+
+        /* pairs with smp_mb() in nvf_ndo_start_xmit() */
+        smp_mb();
+        if (netif_tx_queue_stopped(txq) && !wifi_drv_ring_full(&q->tx_ring)) {
+            netif_tx_wake_queue(txq);
+        }
+    }
+
+    return !wifi_drv_ring_empty(&q->tx_ring);
+}
+
+/* Builds skb over receive buffer "page" of the queue, frame starts at "headroom" and takes "len" bytes.
+ * Page is recycled on failure. */
+static struct sk_buff *wifi_drv_rx_page_skb(struct wifi_drv_queue *q, struct page *page, unsigned int headroom,
+                                            unsigned int len) {
+    struct sk_buff *skb = napi_build_skb(page_address(page), PAGE_SIZE);
+
+    if (skb == NULL) {
+        page_pool_recycle_direct(q->page_pool, page);
+        return NULL;
+    }
+    skb_mark_for_recycle(skb);
+    skb_reserve(skb, headroom);
+    skb_put(skb, len);
+    return skb;
+}
+
+/* Copies the frame delivered by the peer into a new receive buffer of the queue at WIFI_DRV_RX_HEADROOM,
+ * the way hardware would receive it. "skb" is not consumed.
+ * Returns NULL if the frame does not fit one buffer or there is no buffer. */
+static struct page *wifi_drv_rx_copy(struct wifi_drv_queue *q, struct sk_buff *skb, unsigned int *len) {
+    struct page *page;
+
+    *len = skb->len + ETH_HLEN;
+    if (skb_is_gso(skb) || *len > WIFI_DRV_RX_BUF_MAX) {
+        q->rx_pp_bypass++;
+        return NULL;
+    }
+    page = page_pool_dev_alloc_pages(q->page_pool);
+    if (page == NULL) {
+        q->rx_pp_alloc_fail++;
+        return NULL;
+    }
+
+    /* __dev_forward_skb() has already pulled the ethernet header, it is still in the linear part */
+    skb_push(skb, ETH_HLEN);
+    skb_copy_bits(skb, 0, page_address(page) + WIFI_DRV_RX_HEADROOM, *len);
+    __skb_pull(skb, ETH_HLEN);
+    return page;
+}
+
+/* Receives the frame into a buffer from page_pool of the queue and builds skb over it with napi_build_skb(),
+ * both are recycled in the steady state. Sender's skb is consumed. Returns skb that should be passed to the stack,
+ * the frame itself if it does not fit one buffer or there is no buffer.
+ * Only the receive side is allocation-free: the sender's skb is still allocated by the stack and freed here, and the
+ * frame is copied into the page on the way, like DMA of hardware would write it. GSO and oversized frames bypass
+ * the pool and are received as they came. */
+static struct sk_buff *wifi_drv_rx_build_skb(struct wifi_drv_queue *q, struct sk_buff *skb) {
+    struct sk_buff *rx_skb;
+    struct page *page;
+    unsigned int len;
+
+    page = wifi_drv_rx_copy(q, skb, &len);
+    if (page == NULL) {
+        return skb;
+    }
+    rx_skb = wifi_drv_rx_page_skb(q, page, WIFI_DRV_RX_HEADROOM, len);
+    if (rx_skb == NULL) {
+        q->rx_pp_alloc_fail++;
+        return skb;
+    }
+
+    rx_skb->protocol = eth_type_trans(rx_skb, q->ndev);
+    if (skb->ip_summed == CHECKSUM_PARTIAL) {
+        /* checksum is still not filled, keep it "partial" for the receiver like the forwarded skb would have it */
+        skb_partial_csum_set(rx_skb, skb_checksum_start_offset(skb), skb->csum_offset);
+    } else if (skb->ip_summed == CHECKSUM_UNNECESSARY) {
+        rx_skb->ip_summed = CHECKSUM_UNNECESSARY;
+        rx_skb->csum_level = skb->csum_level;
+    }
+    if (skb_vlan_tag_present(skb)) {
+        __vlan_hwaccel_put_tag(rx_skb, skb->vlan_proto, skb_vlan_tag_get(skb));
+    }
+    skb_record_rx_queue(rx_skb, q->qid);
+
+    napi_consume_skb(skb, 1);
+    q->rx_pp_copied++;
+    return rx_skb;
+}
+
+/* Puts frame that does not come from ndo_start_xmit() to the TX ring of the queue, "more" tells that other frames
+ * follow it like xmit_more. txq lock must be held, so the ring still has the only producer.
+ * Returns false if the ring is full. */
+static bool wifi_drv_tx_produce_locked(struct netdev_queue *txq, struct wifi_drv_queue *q, struct sk_buff *skb,
+                                       bool more) {
+    if (wifi_drv_ring_full(&q->tx_ring)) {
+        q->tx_ring_full++;
+        return false;
+    }
+    skb_reset_mac_header(skb);
+    ((struct wifi_drv_tx_cb *) skb->cb)->burst_end = !more;
+    netdev_tx_sent_queue(txq, skb->len);
+    wifi_drv_ring_produce(&q->tx_ring, skb);
+    return true;
+}
+
+/* XDP_TX: sends the frame back through the TX ring of the queue it was received on. Frees skb on failure. */
+static bool wifi_drv_xdp_tx(struct wifi_drv_queue *q, struct sk_buff *skb) {
+    struct netdev_queue *txq = netdev_get_tx_queue(q->ndev, q->qid);
+    bool queued;
+
+    __netif_tx_lock(txq, smp_processor_id());
+    queued = wifi_drv_tx_produce_locked(txq, q, skb, false);
+    __netif_tx_unlock(txq);
+
+    if (!queued) {
+        kfree_skb(skb);
+        return false;
+    }
+    /* we are in napi of this queue, it is polled again to complete the frame */
+    napi_schedule(&q->napi);
+    return true;
+}
+
+/* Runs XDP program on the frame received into a buffer of the queue. Sender's skb is consumed.
+ * Returns skb that should be passed to the stack on XDP_PASS, otherwise NULL.
+ * "redirect" is set if xdp_do_flush() is needed at the end of the poll. */
+static struct sk_buff *wifi_drv_rx_xdp(struct wifi_drv_queue *q, struct bpf_prog *prog, struct sk_buff *skb,
+                                       bool *redirect) {
+    struct sk_buff *rx_skb;
+    struct xdp_buff xdp;
+    unsigned int len, metasize;
+    struct page *page;
+    u32 act;
+
+    /* program sees the frame as it would be on the air, senders stop offloading checksum when XDP is attached,
+     * this one was queued before. */
+    if (skb->ip_summed == CHECKSUM_PARTIAL && skb_checksum_help(skb)) {
+        kfree_skb(skb);
+        q->xdp_stats.drop++;
+        return NULL;
+    }
+    /* frame that the program can't see is dropped, passing it around the program would break filtering */
+    page = wifi_drv_rx_copy(q, skb, &len);
+    napi_consume_skb(skb, 1);
+    if (page == NULL) {
+        q->xdp_stats.drop++;
+        return NULL;
+    }
+    q->rx_pp_copied++;
+
+    xdp_init_buff(&xdp, PAGE_SIZE, &q->xdp_rxq);
+    xdp_prepare_buff(&xdp, page_address(page), WIFI_DRV_RX_HEADROOM, len, true);
+    act = bpf_prog_run_xdp(prog, &xdp);
+
+    switch (act) {
+    case XDP_PASS:
+        metasize = xdp.data - xdp.data_meta;
+        rx_skb = wifi_drv_rx_page_skb(q, page, xdp.data - xdp.data_hard_start, xdp.data_end - xdp.data);
+        if (rx_skb == NULL) {
+            q->xdp_stats.drop++;
+            return NULL;
+        }
+        rx_skb->protocol = eth_type_trans(rx_skb, q->ndev);
+        if (metasize) {
+            skb_metadata_set(rx_skb, metasize);
+        }
+        skb_record_rx_queue(rx_skb, q->qid);
+        q->xdp_stats.pass++;
+        return rx_skb;
+    case XDP_TX:
+        rx_skb = wifi_drv_rx_page_skb(q, page, xdp.data - xdp.data_hard_start, xdp.data_end - xdp.data);
+        if (rx_skb != NULL && wifi_drv_xdp_tx(q, rx_skb)) {
+            q->xdp_stats.tx++;
+        } else {
+            q->xdp_stats.tx_err++;
+        }
+        return NULL;
+    case XDP_REDIRECT:
+        if (xdp_do_redirect(q->ndev, &xdp, prog) == 0) {
+            *redirect = true;
+            q->xdp_stats.redirect++;
+        } else {
+            page_pool_recycle_direct(q->page_pool, page);
+            q->xdp_stats.redirect_err++;
+        }
+        return NULL;
+    default:
+        bpf_warn_invalid_xdp_action(q->ndev, prog, act);
+        fallthrough;
+    case XDP_ABORTED:
+        trace_xdp_exception(q->ndev, prog, act);
+        fallthrough;
+    case XDP_DROP:
+        page_pool_recycle_direct(q->page_pool, page);
+        q->xdp_stats.drop++;
+        return NULL;
+    }
+}
+
+/* Passes up to "budget" frames from the RX ring to the stack, GRO is flushed by napi_complete_done(). */
+static int wifi_drv_queue_rx(struct wifi_drv_queue *q, int budget) {
+    struct wifi_drv_ndev_priv_context *ndev_data = ndev_get_wifi_drv_context(q->ndev);
+    bool is_ap = ndev_data->wdev.iftype == NL80211_IFTYPE_AP;
+    struct bpf_prog *prog = rcu_dereference_bh(ndev_data->xdp_prog);
+    unsigned int passed = 0, bytes = 0;
+    bool redirect = false;
+    struct sk_buff *skb;
+    int done = 0;
+
+    while (done < budget && (skb = wifi_drv_ring_consume(&q->rx_ring)) != NULL) {
+        done++;
+        if (prog != NULL) {
+            skb = wifi_drv_rx_xdp(q, prog, skb, &redirect);
+            if (skb == NULL) {
+                continue;
+            }
+        } else {
+            skb = wifi_drv_rx_build_skb(q, skb);
+        }
+        passed++;
+        bytes += skb->len;
+        if (is_ap) {
+            wifi_drv_sta_account(ndev_data, eth_hdr(skb)->h_source, 1, skb->len, false);
+        }
+        /* GRO merges segments of the same flow, so bulk TCP traverses the stack once per aggregate */
+        napi_gro_receive(&q->napi, skb);
+    }
+
+    if (redirect) {
+        xdp_do_flush();
+    }
+    if (passed) {
+        wifi_drv_queue_stats_add(&q->rx_stats, passed, bytes, 0);
+    }
+    return done;
+}
+
+/* napi poll of the queue pair, it serves both TX completion and receive. */
+static int wifi_drv_napi_poll(struct napi_struct *napi, int budget) {
+    struct wifi_drv_queue *q = container_of(napi, struct wifi_drv_queue, napi);
+    bool tx_pending = wifi_drv_queue_tx(q, budget);
+    int rx_done = wifi_drv_queue_rx(q, budget);
+
+    if (tx_pending || rx_done == budget) {
+        return budget;
+    }
+
+    /* napi_complete_done() reschedules poll by itself if napi was kicked while we were here. */
+    napi_complete_done(napi, rx_done);
+    return rx_done;
+}
+
+/* Steers every CPU to its own TX queue, so senders on different cores never share qdisc and txq locks. */
+static void wifi_drv_set_xps(struct net_device *dev) {
+    struct wifi_drv_ndev_priv_context *ndev_data = ndev_get_wifi_drv_context(dev);
+    cpumask_var_t mask;
+    unsigned int qid;
+    int cpu;
+
+    if (!zalloc_cpumask_var(&mask, GFP_KERNEL)) {
+        return;
+    }
+
+    for (qid = 0; qid < ndev_data->num_queues; qid++) {
+        cpumask_clear(mask);
+        for_each_online_cpu(cpu) {
+            if (cpu % ndev_data->num_queues == qid) {
+                cpumask_set_cpu(cpu, mask);
+            }
+        }
+        netif_set_xps_queue(dev, mask, qid);
+    }
+
+    free_cpumask_var(mask);
+}
+
+/* XDP buffers of queue "q" come from "page_pool", redirected frames are returned there. */
+static int wifi_drv_xdp_rxq_reg(struct xdp_rxq_info *xdp_rxq, struct wifi_drv_queue *q,
+                                struct page_pool *page_pool) {
+    int err;
+
+    err = xdp_rxq_info_reg(xdp_rxq, q->ndev, q->qid, q->napi.napi_id);
+    if (err) {
+        return err;
+    }
+    err = xdp_rxq_info_reg_mem_model(xdp_rxq, MEM_TYPE_PAGE_POOL, page_pool);
+    if (err) {
+        xdp_rxq_info_unreg(xdp_rxq);
+    }
+    return err;
+}
+
+/* Starts napi and TX of active queues. Can't fail, so wifi_drv_set_queues() restarts the device with it. */
+static void wifi_drv_datapath_start(struct net_device *dev) {
+    struct wifi_drv_ndev_priv_context *ndev_data = ndev_get_wifi_drv_context(dev);
+    unsigned int qid;
+
+    for (qid = 0; qid < ndev_data->num_queues; qid++) {
+        napi_enable(&ndev_data->queues[qid].napi);
+    }
+    wifi_drv_set_xps(dev);
+    netif_tx_start_all_queues(dev);
+}
+
+/* Stops TX and napi of active queues and drops frames they hold. Medium membership and xdp_rxq stay. */
+static void wifi_drv_datapath_stop(struct net_device *dev) {
+    struct wifi_drv_ndev_priv_context *ndev_data = ndev_get_wifi_drv_context(dev);
+    unsigned int qid;
+
+    netif_tx_stop_all_queues(dev);
+    for (qid = 0; qid < ndev_data->num_queues; qid++) {
+        struct wifi_drv_queue *q = &ndev_data->queues[qid];
+
+        napi_disable(&q->napi);
+        wifi_drv_agg_purge(q);
+        /* frames that were not completed are dropped, BQL state should be reset with them */
+        wifi_drv_ring_purge(&q->tx_ring);
+        netdev_tx_reset_queue(netdev_get_tx_queue(dev, qid));
+        /* peer may still have frames in flight, they are dropped here and in wifi_drv_free_ndev() */
+        wifi_drv_ring_purge(&q->rx_ring);
+    }
+    /* napi can't queue frames to stations anymore */
+    wifi_drv_airtime_purge(ndev_data);
+}
+
+static int nvf_ndo_open(struct net_device *dev) {
+    struct wifi_drv_ndev_priv_context *ndev_data = ndev_get_wifi_drv_context(dev);
+    unsigned int qid;
+    int err;
+
+    if (medium) {
+        err = wifi_drv_medium_join(dev);
+        if (err) {
+            netdev_err(dev, "can't join the medium: %d\n", err);
+            return err;
+        }
+    }
+
+    for (qid = 0; qid < ndev_data->num_queues; qid++) {
+        struct wifi_drv_queue *q = &ndev_data->queues[qid];
+
+        err = wifi_drv_xdp_rxq_reg(&q->xdp_rxq, q, q->page_pool);
+        if (err) {
+            goto l_error_rxq;
+        }
+    }
+    wifi_drv_datapath_start(dev);
+    return 0;
+    l_error_rxq:
+    while (qid--) {
+        xdp_rxq_info_unreg(&ndev_data->queues[qid].xdp_rxq);
+    }
+    if (medium) {
+        wifi_drv_medium_leave(dev);
+    }
+    return err;
+}
+
+static int nvf_ndo_stop(struct net_device *dev) {
+    struct wifi_drv_ndev_priv_context *ndev_data = ndev_get_wifi_drv_context(dev);
+    unsigned int qid;
+
+    if (medium) {
+        wifi_drv_medium_leave(dev);
+    }
+    wifi_drv_datapath_stop(dev);
+    for (qid = 0; qid < ndev_data->num_queues; qid++) {
+        xdp_rxq_info_unreg(&ndev_data->queues[qid].xdp_rxq);
+    }
+    return 0;
+}
+
+static void nvf_ndo_get_stats64(struct net_device *dev, struct rtnl_link_stats64 *stats) {
+    struct wifi_drv_ndev_priv_context *ndev_data = ndev_get_wifi_drv_context(dev);
+    u64 packets, bytes, drops, rx_dropped, rx_fifo_errors, tx_dropped;
+    unsigned int qid, start;
+    int cpu;
+
+    /* inactive queues keep their counters, so totals don't go back after ethtool -L */
+    for (qid = 0; qid < ndev_data->max_queues; qid++) {
+        struct wifi_drv_queue *q = &ndev_data->queues[qid];
+
+        wifi_drv_queue_stats_read(&q->tx_stats, &packets, &bytes, &drops);
+        stats->tx_packets += packets;
+        stats->tx_bytes += bytes;
+        stats->tx_dropped += drops;
+
+        wifi_drv_queue_stats_read(&q->rx_stats, &packets, &bytes, &drops);
+        stats->rx_packets += packets;
+        stats->rx_bytes += bytes;
+        stats->rx_dropped += drops;
+    }
+
+    for_each_possible_cpu(cpu) {
+        const struct wifi_drv_pcpu_stats *pcpu = per_cpu_ptr(ndev_data->pcpu_stats, cpu);
+
+        do {
+            start = u64_stats_fetch_begin(&pcpu->syncp);
+            rx_dropped = u64_stats_read(&pcpu->rx_dropped);
+            rx_fifo_errors = u64_stats_read(&pcpu->rx_fifo_errors);
+            tx_dropped = u64_stats_read(&pcpu->tx_dropped);
+        } while (u64_stats_fetch_retry(&pcpu->syncp, start));
+        stats->rx_dropped += rx_dropped;
+        stats->rx_fifo_errors += rx_fifo_errors;
+        stats->tx_dropped += tx_dropped;
+    }
+}
+
+/* XDP programs see every frame in one buffer with complete checksum. While any device has a program attached,
+ * senders stop offloading GSO and checksum, so the stack finishes frames in software before ndo_start_xmit().
+ * Counter is global since with the medium any device may receive the frame. */
+static netdev_features_t nvf_ndo_features_check(struct sk_buff *skb, struct net_device *dev,
+                                                netdev_features_t features) {
+    features = vlan_features_check(skb, features);
+    if (atomic_read(&g_xdp_progs)) {
+        features &= ~(NETIF_F_CSUM_MASK | NETIF_F_GSO_MASK);
+    }
+    return features;
+}
+
+/* Attaches or detaches native XDP program, called under RTNL. napi picks the new program up on its next poll. */
+static int nvf_ndo_bpf(struct net_device *dev, struct netdev_bpf *bpf) {
+    struct wifi_drv_ndev_priv_context *ndev_data = ndev_get_wifi_drv_context(dev);
+    struct bpf_prog *old;
+
+    switch (bpf->command) {
+    case XDP_SETUP_PROG:
+        old = rtnl_dereference(ndev_data->xdp_prog);
+        rcu_assign_pointer(ndev_data->xdp_prog, bpf->prog);
+        if (old == NULL && bpf->prog != NULL) {
+            atomic_inc(&g_xdp_progs);
+        } else if (old != NULL && bpf->prog == NULL) {
+            atomic_dec(&g_xdp_progs);
+        }
+        /* program is freed after RCU grace period, napi may still run it */
+        if (old != NULL) {
+            bpf_prog_put(old);
+        }
+        return 0;
+    default:
+        /* AF_XDP zero-copy is not implemented: there is no DMA device to map umem and no ndo_xsk_wakeup, so the core
+         * never offers XDP_SETUP_XSK_POOL and sockets bind in copy mode(XDP_ZEROCOPY fails with -EOPNOTSUPP) */
+        return -EOPNOTSUPP;
+    }
+}
+
+/* Frames redirected to this device by XDP of other devices. They go through the TX ring of the current CPU
+ * like frames of ndo_start_xmit(). Returns number of frames queued, the caller frees the rest. */
+static int nvf_ndo_xdp_xmit(struct net_device *dev, int n, struct xdp_frame **frames, u32 flags) {
+    struct wifi_drv_ndev_priv_context *ndev_data = ndev_get_wifi_drv_context(dev);
+    struct wifi_drv_queue *q;
+    struct netdev_queue *txq;
+    u16 qid;
+    int sent;
+
+    if (unlikely(flags & ~XDP_XMIT_FLAGS_MASK)) {
+        return -EINVAL;
+    }
+    if (unlikely(!wifi_drv_rx_ready(dev))) {
+        return -ENETDOWN;
+    }
+    qid = smp_processor_id() % READ_ONCE(ndev_data->num_queues);
+    q = &ndev_data->queues[qid];
+    txq = netdev_get_tx_queue(dev, qid);
+
+    __netif_tx_lock(txq, smp_processor_id());
+    for (sent = 0; sent < n; sent++) {
+        struct sk_buff *skb;
+
+        if (wifi_drv_ring_full(&q->tx_ring)) {
+            q->tx_ring_full++;
+            break;
+        }
+        skb = xdp_build_skb_from_frame(frames[sent], dev);
+        if (skb == NULL) {
+            break;
+        }
+        /* frame is transmitted from the ethernet header that eth_type_trans() of the builder has pulled */
+        skb_push(skb, ETH_HLEN);
+        wifi_drv_tx_produce_locked(txq, q, skb, sent + 1 < n || !(flags & XDP_XMIT_FLUSH));
+    }
+    q->xdp_stats.xmit += sent;
+    q->xdp_stats.xmit_err += n - sent;
+    __netif_tx_unlock(txq);
+
+    if (sent) {
+        napi_schedule(&q->napi);
+    }
+    return sent;
+}
+
+/* Structure of functions for network devices.
+ * It should have at least ndo_start_xmit functions that called for packet to be sent. */
+static struct net_device_ops nvf_ndev_ops = {
+        .ndo_open = nvf_ndo_open,
+        .ndo_stop = nvf_ndo_stop,
+        .ndo_start_xmit = nvf_ndo_start_xmit,
+        .ndo_get_stats64 = nvf_ndo_get_stats64,
+        .ndo_features_check = nvf_ndo_features_check,
+        .ndo_bpf = nvf_ndo_bpf,
+        .ndo_xdp_xmit = nvf_ndo_xdp_xmit,
+};
+
+/* Changes number of active queues and ring sizes of the device, called by ethtool under RTNL.
+ * New rings and page_pools are allocated first, so the device keeps the old ones if memory is short. For running
+ * device XDP info of the new queues is registered up front as well, so nothing can fail once it is stopped. Running
+ * device is paused for the swap: other devices and the medium stop putting frames to its rings(see
+ * wifi_drv_rx_ready()), TX is disabled and the datapath is stopped and started again, the device stays in the
+ * medium. Frames in the rings are dropped, the link stays up. */
+static int wifi_drv_set_queues(struct net_device *dev, unsigned int num_queues, unsigned int tx_size,
+                               unsigned int rx_size) {
+    struct wifi_drv_ndev_priv_context *ndev_data = ndev_get_wifi_drv_context(dev);
+    bool running = netif_running(dev);
+    struct wifi_drv_queue_res *res;
+    unsigned int qid;
+    int err = 0;
+
+    res = kcalloc(ndev_data->max_queues, sizeof(*res), GFP_KERNEL);
+    if (res == NULL) {
+        return -ENOMEM;
+    }
+    for (qid = 0; qid < num_queues; qid++) {
+        err = wifi_drv_queue_res_alloc(&ndev_data->queues[qid], tx_size, rx_size, &res[qid]);
+        if (err) {
+            goto l_error_res;
+        }
+        if (running) {
+            err = wifi_drv_xdp_rxq_reg(&res[qid].xdp_rxq, &ndev_data->queues[qid], res[qid].page_pool);
+            if (err) {
+                goto l_error_res;
+            }
+        }
+    }
+
+    if (running) {
+        WRITE_ONCE(ndev_data->paused, true);
+        netif_tx_disable(dev);
+        /* producers of other devices that have seen the device ready are done after the grace period */
+        synchronize_net();
+        wifi_drv_datapath_stop(dev);
+    }
+    err = netif_set_real_num_queues(dev, num_queues, num_queues);
+    if (err == 0) {
+        mutex_lock(&ndev_data->queues_lock);
+        /* queues that become inactive give their rings away, counters stay for ndo_get_stats64() */
+        for (qid = 0; qid < ndev_data->max_queues; qid++) {
+            wifi_drv_queue_res_swap(&ndev_data->queues[qid], &res[qid]);
+        }
+        WRITE_ONCE(ndev_data->num_queues, num_queues);
+        WRITE_ONCE(ndev_data->tx_ring_size, tx_size);
+        WRITE_ONCE(ndev_data->rx_ring_size, rx_size);
+        mutex_unlock(&ndev_data->queues_lock);
+    }
+    if (running) {
+        /* on failure the device is started again with the old queues */
+        wifi_drv_datapath_start(dev);
+        WRITE_ONCE(ndev_data->paused, false);
+    }
+    l_error_res:
+    for (qid = 0; qid < ndev_data->max_queues; qid++) {
+        wifi_drv_queue_res_free(&res[qid]);
+    }
+    kfree(res);
+    return err;
+}
+
+static void nvf_get_drvinfo(struct net_device *dev, struct ethtool_drvinfo *info) {
+    strscpy(info->driver, WIFI_NAME, sizeof(info->driver));
+    strscpy(info->bus_info, "virtual", sizeof(info->bus_info));
+}
+
+static void nvf_get_ringparam(struct net_device *dev, struct ethtool_ringparam *ring,
+                              struct kernel_ethtool_ringparam *kernel_ring, struct netlink_ext_ack *extack) {
+    struct wifi_drv_ndev_priv_context *ndev_data = ndev_get_wifi_drv_context(dev);
+
+    ring->rx_max_pending = WIFI_DRV_RING_MAX;
+    ring->tx_max_pending = WIFI_DRV_RING_MAX;
+    ring->rx_pending = ndev_data->rx_ring_size;
+    ring->tx_pending = ndev_data->tx_ring_size;
+}
+
+/* ethtool -G, sizes are rounded up to a power of 2 since rings index slots by mask. */
+static int nvf_set_ringparam(struct net_device *dev, struct ethtool_ringparam *ring,
+                             struct kernel_ethtool_ringparam *kernel_ring, struct netlink_ext_ack *extack) {
+    struct wifi_drv_ndev_priv_context *ndev_data = ndev_get_wifi_drv_context(dev);
+    unsigned int tx_size, rx_size;
+
+    if (ring->rx_pending < WIFI_DRV_RING_MIN || ring->tx_pending < WIFI_DRV_RING_MIN) {
+        NL_SET_ERR_MSG_MOD(extack, "ring size is less than " __stringify(WIFI_DRV_RING_MIN));
+        return -EINVAL;
+    }
+    tx_size = roundup_pow_of_two(ring->tx_pending);
+    rx_size = roundup_pow_of_two(ring->rx_pending);
+    if (tx_size == ndev_data->tx_ring_size && rx_size == ndev_data->rx_ring_size) {
+        return 0;
+    }
+    return wifi_drv_set_queues(dev, ndev_data->num_queues, tx_size, rx_size);
+}
+
+/* Every queue is a TX/RX pair, so only combined channels are reported. */
+static void nvf_get_channels(struct net_device *dev, struct ethtool_channels *ch) {
+    struct wifi_drv_ndev_priv_context *ndev_data = ndev_get_wifi_drv_context(dev);
+
+    ch->max_combined = ndev_data->max_queues;
+    ch->combined_count = ndev_data->num_queues;
+}
+
+/* ethtool -L combined N. The core has already checked the count against max_combined. */
+static int nvf_set_channels(struct net_device *dev, struct ethtool_channels *ch) {
+    struct wifi_drv_ndev_priv_context *ndev_data = ndev_get_wifi_drv_context(dev);
+
+    if (ch->combined_count == ndev_data->num_queues) {
+        return 0;
+    }
+    return wifi_drv_set_queues(dev, ch->combined_count, ndev_data->tx_ring_size, ndev_data->rx_ring_size);
+}
+
+/* Counters of ethtool -S: per-CPU counters of the device, then per-queue counters of active queues. */
+static const char wifi_drv_ethtool_stats[][ETH_GSTRING_LEN] = {
+        "rx_dropped", "rx_fifo_errors", "tx_airtime_dropped",
+};
+
+static const char wifi_drv_ethtool_queue_stats[][ETH_GSTRING_LEN] = {
+        "tx_packets", "tx_bytes", "tx_dropped", "tx_ring_full", "tx_kicks", "tx_ampdus",
+        "rx_packets", "rx_bytes", "rx_dropped", "rx_ring_full", "rx_pp_copied", "rx_pp_alloc_fail",
+};
+
+static int nvf_get_sset_count(struct net_device *dev, int sset) {
+    struct wifi_drv_ndev_priv_context *ndev_data = ndev_get_wifi_drv_context(dev);
+
+    if (sset != ETH_SS_STATS) {
+        return -EOPNOTSUPP;
+    }
+    return ARRAY_SIZE(wifi_drv_ethtool_stats) + ndev_data->num_queues * ARRAY_SIZE(wifi_drv_ethtool_queue_stats);
+}
+
+static void nvf_get_strings(struct net_device *dev, u32 sset, u8 *data) {
+    struct wifi_drv_ndev_priv_context *ndev_data = ndev_get_wifi_drv_context(dev);
+    unsigned int qid, i;
+
+    if (sset != ETH_SS_STATS) {
+        return;
+    }
+    for (i = 0; i < ARRAY_SIZE(wifi_drv_ethtool_stats); i++) {
+        ethtool_puts(&data, wifi_drv_ethtool_stats[i]);
+    }
+    for (qid = 0; qid < ndev_data->num_queues; qid++) {
+        for (i = 0; i < ARRAY_SIZE(wifi_drv_ethtool_queue_stats); i++) {
+            ethtool_sprintf(&data, "q%u_%s", qid, wifi_drv_ethtool_queue_stats[i]);
+        }
+    }
+}
+
+static void nvf_get_ethtool_stats(struct net_device *dev, struct ethtool_stats *estats, u64 *data) {
+    struct wifi_drv_ndev_priv_context *ndev_data = ndev_get_wifi_drv_context(dev);
+    u64 rx_dropped = 0, rx_fifo_errors = 0, tx_dropped = 0;
+    unsigned int qid, start, i;
+    int cpu;
+
+    for_each_possible_cpu(cpu) {
+        const struct wifi_drv_pcpu_stats *pcpu = per_cpu_ptr(ndev_data->pcpu_stats, cpu);
+        u64 rx_drop, rx_fifo, tx_drop;
+
+        do {
+            start = u64_stats_fetch_begin(&pcpu->syncp);
+            rx_drop = u64_stats_read(&pcpu->rx_dropped);
+            rx_fifo = u64_stats_read(&pcpu->rx_fifo_errors);
+            tx_drop = u64_stats_read(&pcpu->tx_dropped);
+        } while (u64_stats_fetch_retry(&pcpu->syncp, start));
+        rx_dropped += rx_drop;
+        rx_fifo_errors += rx_fifo;
+        tx_dropped += tx_drop;
+    }
+    *data++ = rx_dropped;
+    *data++ = rx_fifo_errors;
+    *data++ = tx_dropped;
+
+    for (qid = 0; qid < ndev_data->num_queues; qid++) {
+        struct wifi_drv_queue *q = &ndev_data->queues[qid];
+        u64 packets, bytes, drops, ampdus = 0;
+
+        for (i = 0; i < WIFI_DRV_AGG_HIST_BUCKETS; i++) {
+            ampdus += READ_ONCE(q->agg_hist[i]);
+        }
+        wifi_drv_queue_stats_read(&q->tx_stats, &packets, &bytes, &drops);
+        *data++ = packets;
+        *data++ = bytes;
+        *data++ = drops;
+        *data++ = READ_ONCE(q->tx_ring_full);
+        *data++ = READ_ONCE(q->tx_kicks);
+        *data++ = ampdus;
+
+        wifi_drv_queue_stats_read(&q->rx_stats, &packets, &bytes, &drops);
+        *data++ = packets;
+        *data++ = bytes;
+        *data++ = drops;
+        *data++ = READ_ONCE(q->rx_ring_full);
+        *data++ = READ_ONCE(q->rx_pp_copied);
+        *data++ = READ_ONCE(q->rx_pp_alloc_fail);
+    }
+}
+
+static const struct ethtool_ops nvf_ethtool_ops = {
+        .get_drvinfo = nvf_get_drvinfo,
+        .get_link = ethtool_op_get_link,
+        .get_ringparam = nvf_get_ringparam,
+        .set_ringparam = nvf_set_ringparam,
+        .get_channels = nvf_get_channels,
+        .set_channels = nvf_set_channels,
+        .get_sset_count = nvf_get_sset_count,
+        .get_strings = nvf_get_strings,
+        .get_ethtool_stats = nvf_get_ethtool_stats,
+};
+
+/* Allocates network device with wireless_dev and loopback datapath for the wifi_drv context.
+ * Device should be registered by the caller and freed with wifi_drv_free_ndev(). */
+static struct net_device *wifi_drv_alloc_ndev(struct wifi_drv_context *wifi_drv, const char *name,
+                                              unsigned char name_assign_type, enum nl80211_iftype type) {
+    struct net_device *ndev = NULL;
+    struct wifi_drv_ndev_priv_context *ndev_data = NULL;
+    unsigned int num_queues = wifi_drv_num_queues();
+    /* ethtool -L may raise the number up to one queue per possible CPU */
+    unsigned int max_queues = max(num_queues, min_t(unsigned int, num_possible_cpus(), WIFI_DRV_MAX_QUEUES));
+    unsigned int qid, i;
+
+    /* one TX and one RX queue per CPU, see wifi_drv_set_xps() */
+    ndev = alloc_netdev_mqs(sizeof(*ndev_data), name, name_assign_type, ether_setup, max_queues, max_queues);
+    if (ndev == NULL) {
+        goto l_error;
+    }
+    /* fill private data of network context.*/
+    ndev_data = ndev_get_wifi_drv_context(ndev);
+    ndev_data->wifi_drv = wifi_drv;
+
+    /* fill wireless_dev context.
+     * wireless_dev with net_device can be represented as inherited class of single net_device. */
+    ndev_data->wdev.wifi = wifi_drv->wifi;
+    ndev_data->wdev.netdev = ndev;
+    ndev_data->wdev.iftype = type;
+    ndev->ieee80211_ptr = &ndev_data->wdev;
+
+    /* set network device hooks. It should implement ndo_start_xmit() at least. */
+    ndev->netdev_ops = &nvf_ndev_ops;
+    ndev->ethtool_ops = &nvf_ethtool_ops;
+
+    ndev->features |= WIFI_DRV_FEATURES;
+    ndev->hw_features |= WIFI_DRV_FEATURES;
+    ndev->hw_enc_features |= WIFI_DRV_FEATURES;
+    ndev->vlan_features |= WIFI_DRV_FEATURES;
+    ndev->xdp_features = NETDEV_XDP_ACT_BASIC | NETDEV_XDP_ACT_REDIRECT | NETDEV_XDP_ACT_NDO_XMIT;
+
+    /* STA and AP ends of the loopback should have distinct addresses, or ARP/IP would not work across them. */
+    eth_hw_addr_random(ndev);
+
+    spin_lock_init(&ndev_data->sta_lock);
+    INIT_LIST_HEAD(&ndev_data->sta_list);
+    ndev_data->n_sta = 0;
+    ndev_data->dump_idx = 0;
+    ndev_data->dump_sta = NULL;
+    spin_lock_init(&ndev_data->airtime_lock);
+    INIT_LIST_HEAD(&ndev_data->airtime_active);
+    ndev_data->air_busy_until_ns = 0;
+    hrtimer_init(&ndev_data->airtime_timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS_SOFT);
+    ndev_data->airtime_timer.function = wifi_drv_airtime_fire;
+    codel_params_init(&ndev_data->cparams);
+    ndev_data->cparams.mtu = ETH_FRAME_LEN;
+    codel_stats_init(&ndev_data->cstats);
+    if (rhashtable_init(&ndev_data->sta_table, &wifi_drv_sta_params)) {
+        goto l_error_sta_table;
+    }
+
+    ndev_data->pcpu_stats = netdev_alloc_pcpu_stats(struct wifi_drv_pcpu_stats);
+    if (ndev_data->pcpu_stats == NULL) {
+        goto l_error_pcpu_stats;
+    }
+
+    ndev_data->num_queues = num_queues;
+    ndev_data->max_queues = max_queues;
+    ndev_data->tx_ring_size = WIFI_DRV_TX_RING_SIZE;
+    ndev_data->rx_ring_size = WIFI_DRV_RX_RING_SIZE;
+    ndev_data->paused = false;
+    mutex_init(&ndev_data->queues_lock);
+    ndev_data->queues = kcalloc(max_queues, sizeof(*ndev_data->queues), GFP_KERNEL);
+    if (ndev_data->queues == NULL) {
+        goto l_error_queues;
+    }
+    for (qid = 0; qid < max_queues; qid++) {
+        struct wifi_drv_queue *q = &ndev_data->queues[qid];
+
+        q->ndev = ndev;
+        q->qid = qid;
+        u64_stats_init(&q->tx_stats.syncp);
+        u64_stats_init(&q->rx_stats.syncp);
+        spin_lock_init(&q->rx_produce_lock);
+        for (i = 0; i < WIFI_DRV_AGG_SLOTS; i++) {
+            __skb_queue_head_init(&q->aggs[i].frames);
+        }
+        hrtimer_init(&q->agg_timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS_SOFT);
+        q->agg_timer.function = wifi_drv_agg_timer_fire;
+        netif_napi_add(ndev, &q->napi, wifi_drv_napi_poll);
+    }
+    for (qid = 0; qid < num_queues; qid++) {
+        struct wifi_drv_queue_res res = {};
+
+        if (wifi_drv_queue_res_alloc(&ndev_data->queues[qid], WIFI_DRV_TX_RING_SIZE, WIFI_DRV_RX_RING_SIZE, &res)) {
+            goto l_error_res;
+        }
+        wifi_drv_queue_res_swap(&ndev_data->queues[qid], &res);
+    }
+    if (netif_set_real_num_queues(ndev, num_queues, num_queues)) {
+        goto l_error_res;
+    }
+
+    return ndev;
+    l_error_res:
+    for (qid = 0; qid < max_queues; qid++) {
+        struct wifi_drv_queue_res res = {};
+
+        netif_napi_del(&ndev_data->queues[qid].napi);
+        wifi_drv_queue_res_swap(&ndev_data->queues[qid], &res);
+        wifi_drv_queue_res_free(&res);
+    }
+    kfree(ndev_data->queues);
+    l_error_queues:
+    free_percpu(ndev_data->pcpu_stats);
+    l_error_pcpu_stats:
+    rhashtable_destroy(&ndev_data->sta_table);
+    l_error_sta_table:
+    free_netdev(ndev);
+    l_error:
+    return NULL;
+}
+
+/* Frees everything wifi_drv_alloc_ndev() has allocated but net_device itself. It is priv_destructor of
+ * interfaces created through add_virtual_intf(), the core calls it when their unregistration completes. */
+static void wifi_drv_ndev_destructor(struct net_device *ndev) {
+    struct wifi_drv_ndev_priv_context *ndev_data = ndev_get_wifi_drv_context(ndev);
+    unsigned int qid;
+
+    for (qid = 0; qid < ndev_data->max_queues; qid++) {
+        struct wifi_drv_queue_res res = {};
+
+        netif_napi_del(&ndev_data->queues[qid].napi);
+        wifi_drv_queue_res_swap(&ndev_data->queues[qid], &res);
+        wifi_drv_queue_res_free(&res);
+    }
+    kfree(ndev_data->queues);
+    mutex_destroy(&ndev_data->queues_lock);
+    free_percpu(ndev_data->pcpu_stats);
+
+    /* device is unregistered, nobody looks stations up anymore */
+    rhashtable_free_and_destroy(&ndev_data->sta_table, wifi_drv_sta_free, NULL);
+}
+
+/* Counterpart of wifi_drv_alloc_ndev(), device should be already unregistered. */
+static void wifi_drv_free_ndev(struct net_device *ndev) {
+    wifi_drv_ndev_destructor(ndev);
+    free_netdev(ndev);
+}
+
+/* Cache of interface registry entries, interfaces come and go a lot when they are used for tenant isolation. */
+static struct kmem_cache *g_iface_cache;
+
+static struct wifi_drv_iface *wifi_drv_iface_find_ifindex(struct wifi_drv_context *wifi_drv, int ifindex) {
+    return rhashtable_lookup_fast(&wifi_drv->ifaces_by_ifindex, &ifindex, wifi_drv_iface_ifindex_params);
+}
+
+static struct wifi_drv_iface *wifi_drv_iface_find_wdev(struct wifi_drv_context *wifi_drv, struct wireless_dev *wdev) {
+    return rhashtable_lookup_fast(&wifi_drv->ifaces_by_wdev, &wdev, wifi_drv_iface_wdev_params);
+}
+
+/* Puts registered network device to the registry of the radio. Called under RTNL. */
+static int wifi_drv_iface_add(struct wifi_drv_context *wifi_drv, struct net_device *ndev) {
+    struct wifi_drv_iface *iface;
+    int err;
+
+    iface = kmem_cache_zalloc(g_iface_cache, GFP_KERNEL);
+    if (iface == NULL) {
+        return -ENOMEM;
+    }
+    iface->ifindex = ndev->ifindex;
+    iface->wdev = ndev->ieee80211_ptr;
+    iface->ndev = ndev;
+
+    err = rhashtable_insert_fast(&wifi_drv->ifaces_by_ifindex, &iface->node_ifindex, wifi_drv_iface_ifindex_params);
+    if (err) {
+        goto l_error;
+    }
+    err = rhashtable_insert_fast(&wifi_drv->ifaces_by_wdev, &iface->node_wdev, wifi_drv_iface_wdev_params);
+    if (err) {
+        goto l_error_wdev;
+    }
+    list_add_tail_rcu(&iface->list, &wifi_drv->ifaces);
+    WRITE_ONCE(wifi_drv->n_ifaces, wifi_drv->n_ifaces + 1);
+    WRITE_ONCE(wifi_drv->iface_adds, wifi_drv->iface_adds + 1);
+    return 0;
+    l_error_wdev:
+    rhashtable_remove_fast(&wifi_drv->ifaces_by_ifindex, &iface->node_ifindex, wifi_drv_iface_ifindex_params);
+    l_error:
+    kmem_cache_free(g_iface_cache, iface);
+    return err;
+}
+
+static void wifi_drv_iface_free_rcu(struct rcu_head *head) {
+    kmem_cache_free(g_iface_cache, container_of(head, struct wifi_drv_iface, rcu));
+}
+
+/* Number of interfaces of "type" in the registry other than "except", called under RTNL. */
+static unsigned int wifi_drv_iface_count_type(struct wifi_drv_context *wifi_drv, enum nl80211_iftype type,
+                                              struct net_device *except) {
+    struct wifi_drv_iface *iface;
+    unsigned int n = 0;
+
+    list_for_each_entry(iface, &wifi_drv->ifaces, list) {
+        if (iface->ndev != except && iface->wdev->iftype == type) {
+            n++;
+        }
+    }
+    return n;
+}
+
+/* Removes interface from the registry, called under RTNL before the device is unregistered.
+ * Readers walking the list under RCU may still see the entry, so it is freed after the grace period. */
+static void wifi_drv_iface_del(struct wifi_drv_context *wifi_drv, struct wifi_drv_iface *iface) {
+    rhashtable_remove_fast(&wifi_drv->ifaces_by_ifindex, &iface->node_ifindex, wifi_drv_iface_ifindex_params);
+    rhashtable_remove_fast(&wifi_drv->ifaces_by_wdev, &iface->node_wdev, wifi_drv_iface_wdev_params);
+    list_del_rcu(&iface->list);
+    WRITE_ONCE(wifi_drv->n_ifaces, wifi_drv->n_ifaces - 1);
+    WRITE_ONCE(wifi_drv->iface_dels, wifi_drv->iface_dels + 1);
+    call_rcu(&iface->rcu, wifi_drv_iface_free_rcu);
+}
+
+static void wifi_drv_bss_idx_free(void *ptr, void *arg) {
+    kfree(ptr);
+}
+
+/* Adds BSS reported by a scan to the index of the wifi or refreshes its entry. Called on the workqueue. */
+static void wifi_drv_bss_index_add(struct wifi_drv_context *wifi_drv, const struct wifi_drv_bss *entry) {
+    struct wifi_drv_bss_idx *idx;
+
+    idx = rhashtable_lookup_fast(&wifi_drv->bss_by_bssid, entry->bssid, wifi_drv_bss_bssid_params);
+    if (idx != NULL) {
+        /* SSID is a part of the key, BSS that has changed it is indexed anew */
+        if (idx->ssid.len == entry->ie[1] && memcmp(idx->ssid.ssid, &entry->ie[2], entry->ie[1]) == 0) {
+            idx->bss.signal = entry->signal;
+            idx->bss.chan = entry->chan;
+            idx->seen = jiffies;
+            return;
+        }
+        rhltable_remove(&wifi_drv->bss_by_ssid, &idx->ssid_node, wifi_drv_bss_ssid_params);
+        rhashtable_remove_fast(&wifi_drv->bss_by_bssid, &idx->bssid_node, wifi_drv_bss_bssid_params);
+        kfree_rcu_mightsleep(idx);
+    }
+
+    if (atomic_read(&wifi_drv->bss_by_bssid.nelems) >= WIFI_DRV_MAX_BSS_INDEX) {
+        return;
+    }
+    idx = kzalloc(sizeof(*idx), GFP_KERNEL);
+    if (idx == NULL) {
+        return;
+    }
+    memcpy(&idx->bss, entry, sizeof(*entry));
+    idx->ssid.len = entry->ie[1];
+    memcpy(idx->ssid.ssid, &entry->ie[2], idx->ssid.len);
+    idx->seen = jiffies;
+
+    if (rhashtable_insert_fast(&wifi_drv->bss_by_bssid, &idx->bssid_node, wifi_drv_bss_bssid_params)) {
+        kfree(idx);
+        return;
+    }
+    if (rhltable_insert(&wifi_drv->bss_by_ssid, &idx->ssid_node, wifi_drv_bss_ssid_params)) {
+        rhashtable_remove_fast(&wifi_drv->bss_by_bssid, &idx->bssid_node, wifi_drv_bss_bssid_params);
+        kfree_rcu_mightsleep(idx);
+    }
+}
+
+/* Finds BSS of the ESS "ssid" to connect to: "bssid" if it is given and belongs to the ESS, otherwise the strongest
+ * BSS of the ESS except "exclude". A "fixed" BSSID has no fallback, NULL is returned if it is not in the ESS.
+ * Called on the workqueue, the entry stays valid there. */
+static struct wifi_drv_bss_idx *wifi_drv_bss_index_find(struct wifi_drv_context *wifi_drv,
+                                                        const struct wifi_drv_ssid_key *ssid, const u8 *bssid,
+                                                        bool fixed, const u8 *exclude) {
+    struct wifi_drv_bss_idx *idx, *best = NULL;
+    struct rhlist_head *list, *pos;
+
+    if (bssid != NULL && !is_zero_ether_addr(bssid)) {
+        idx = rhashtable_lookup_fast(&wifi_drv->bss_by_bssid, bssid, wifi_drv_bss_bssid_params);
+        if (idx != NULL && memcmp(&idx->ssid, ssid, sizeof(*ssid)) == 0) {
+            return idx;
+        }
+        if (fixed) {
+            return NULL;
+        }
+    }
+
+    rcu_read_lock();
+    list = rhltable_lookup(&wifi_drv->bss_by_ssid, ssid, wifi_drv_bss_ssid_params);
+    rhl_for_each_entry_rcu(idx, pos, list, ssid_node) {
+        if (exclude != NULL && ether_addr_equal(idx->bss.bssid, exclude)) {
+            continue;
+        }
+        if (best == NULL || idx->bss.signal > best->bss.signal) {
+            best = idx;
+        }
+    }
+    rcu_read_unlock();
+    return best;
+}
+
+/* Helper function that "informs" the kernel about prebuilt BSS, it is remembered in the BSS index as well */
+static void wifi_drv_inform_bss(struct wifi_drv_context *wifi_drv, const struct wifi_drv_bss *entry) {
+    struct cfg80211_bss *bss = NULL;
+    struct cfg80211_inform_bss data = {
+            .chan = entry->chan,
+            .scan_width = NL80211_BSS_CHAN_WIDTH_20,
+            /* signal "type" is set to mBm before wifi registration(wifi->signal_type) */
+            .signal = entry->signal,
+    };
+
+    /* also it posible to use cfg80211_inform_bss() instead of cfg80211_inform_bss_data() */
+    bss = cfg80211_inform_bss_data(wifi_drv->wifi, &data, CFG80211_BSS_FTYPE_UNKNOWN, entry->bssid, 0, WLAN_CAPABILITY_ESS,
+                                   100, entry->ie, entry->ie_len, GFP_KERNEL);
+
+    /* free, cfg80211_inform_bss_data() returning cfg80211_bss structure refcounter of which should be decremented if its not used. */
+    cfg80211_put_bss(wifi_drv->wifi, bss);
+
+    wifi_drv_bss_index_add(wifi_drv, entry);
+}
+
+/* Number of "chan" of the wifi in the population, bands of all radios are the same ones the population is built for.
+ * Returns -1 if the wifi doesn't have the band. */
+static int wifi_drv_bss_population_chan(struct wifi_drv_context *wifi_drv, const struct ieee80211_channel *chan) {
+    struct ieee80211_supported_band *band = wifi_drv->wifi->bands[chan->band];
+
+    if (band == NULL) {
+        return -1;
+    }
+    return g_bss_population.band_first[chan->band] + (chan - band->channels);
+}
+
+/* Reports BSSes of the population that are on "chan".
+ * Work item gives CPU away every WIFI_DRV_BSS_BATCH BSSes, so scans with thousands of results do not hog it. */
+static void wifi_drv_inform_channel_bss(struct wifi_drv_context *wifi_drv, struct ieee80211_channel *chan) {
+    struct wifi_drv_bss_population *pop = &g_bss_population;
+    int idx = wifi_drv_bss_population_chan(wifi_drv, chan);
+    unsigned int i;
+
+    if (idx < 0) {
+        return;
+    }
+
+    for (i = pop->chan_first[idx]; i < pop->chan_first[idx + 1]; i++) {
+        wifi_drv_inform_bss(wifi_drv, &pop->bss[i]);
+        if ((i + 1 - pop->chan_first[idx]) % WIFI_DRV_BSS_BATCH == 0) {
+            cond_resched();
+        }
+    }
+}
+
+/* Helper function that will "inform" the kernel about "dummy" BSS, it is the first one of the population. */
+static void inform_dummy_bss(struct wifi_drv_context *wifi_drv) {
+    wifi_drv_inform_bss(wifi_drv, &g_bss_population.bss[0]);
+}
+
+/* Puts command to the cmd ring and rings the doorbell if the firmware sleeps. Returns -ENOSPC if the ring is full. */
+static int wifi_drv_fw_post(struct wifi_drv_fw *fw, struct wifi_drv_fw_cmd *cmd) {
+    struct wifi_drv_fw_ring *ring = &fw->shm->cmd;
+    u32 tail;
+
+    spin_lock_bh(&fw->cmd_lock);
+    /* tail comes from userspace, any value that makes the ring look overfull just stops commands */
+    tail = smp_load_acquire(&ring->tail);
+    if (fw->cmd_head - tail >= WIFI_DRV_FW_RING_ENTRIES) {
+        fw->cmd_full++;
+        spin_unlock_bh(&fw->cmd_lock);
+        return -ENOSPC;
+    }
+    cmd->ts_ns = ktime_get_ns();
+    memcpy(&fw->shm->cmds[fw->cmd_head % WIFI_DRV_FW_RING_ENTRIES], cmd, sizeof(*cmd));
+    smp_store_release(&ring->head, ++fw->cmd_head);
+    fw->cmds++;
+
+    /* pairs with the barrier of the firmware between setting need_wakeup and checking the ring */
+    smp_mb();
+    if (READ_ONCE(ring->need_wakeup)) {
+        eventfd_signal(fw->cmd_efd);
+        fw->cmd_doorbells++;
+    }
+    spin_unlock_bh(&fw->cmd_lock);
+    return 0;
+}
+
+/* Sends command to the firmware attached to the wifi, seq is assigned here unless the caller did it.
+ * Returns -ENODEV if there is no firmware, then the caller emulates the operation by itself. */
+static int wifi_drv_fw_cmd(struct wifi_drv_context *wifi_drv, struct wifi_drv_fw_cmd *cmd) {
+    struct wifi_drv_fw *fw;
+    int err = -ENODEV;
+
+    while (cmd->seq == 0) {
+        cmd->seq = atomic_inc_return(&wifi_drv->fw_seq);
+    }
+
+    rcu_read_lock();
+    fw = rcu_dereference(wifi_drv->fw);
+    if (fw != NULL) {
+        err = wifi_drv_fw_post(fw, cmd);
+    }
+    rcu_read_unlock();
+    return err;
+}
+
+/* Dwell time of "chan": no-IR and DFS channels are scanned passively, scan waits for beacons there. */
+static unsigned long wifi_drv_scan_dwell(const struct ieee80211_channel *chan) {
+    if (chan->flags & (IEEE80211_CHAN_NO_IR | IEEE80211_CHAN_RADAR)) {
+        return msecs_to_jiffies(READ_ONCE(scan_passive_dwell_ms));
+    }
+    return msecs_to_jiffies(READ_ONCE(scan_dwell_ms));
+}
+
+/* Returns the first channel of the request starting from "idx" that belongs to the walk, n_channels if none. */
+static unsigned int wifi_drv_scan_next(const struct cfg80211_scan_request *request,
+                                       const struct wifi_drv_scan_band *walk, unsigned int idx) {
+    while (idx < request->n_channels && walk->band != NUM_NL80211_BANDS && request->channels[idx]->band != walk->band) {
+        idx++;
+    }
+    return idx;
+}
+
+/* Stops band walks and the queued abort of the scan. Called on the workqueue, so none of them is running. */
+static void wifi_drv_scan_cancel_work(struct wifi_drv_context *wifi_drv) {
+    unsigned int i;
+
+    for (i = 0; i < NUM_NL80211_BANDS; i++) {
+        cancel_delayed_work(&wifi_drv->scan_bands[i].work);
+    }
+    cancel_delayed_work(&wifi_drv->ws_scan);
+    wifi_drv->scan_bands_active = 0;
+}
+
+/* Finishes the scan on the workqueue: it should call cfg80211_scan_done() to inform the kernel that scan is finished. */
+static void wifi_drv_scan_finish(struct wifi_drv_context *wifi_drv, struct cfg80211_scan_request *request, bool aborted) {
+    wifi_drv_scan_cancel_work(wifi_drv);
+
+    /* release scan state before finishing, the kernel may start next scan right after cfg80211_scan_done() */
+    xchg(&wifi_drv->scan_request, NULL);
+
+    /* finish scan */
+    wifi_drv_report_scan_done(wifi_drv, request, aborted);
+    wifi_drv_op_end(wifi_drv, WIFI_DRV_OP_SCAN, aborted ? -ECANCELED : 0);
+}
+
+/* "Scan" routine for DEMO. Scan is a state machine per band that walks channels of the band in the request one by one.
+ * Every run of the routine happens when "dwell" on the current channel of the band is over: it informs the kernel about
+ * BSSes of that channel and requeues itself for the next one after its dwell, so no worker is blocked while scanning.
+ * Walks of different bands overlap like on a dual-band radio, the last one to complete finishes the scan.
+ * This routine called through workqueue, when the kernel asks about scan through cfg80211_ops. */
+static void wifi_drv_scan_band_routine(struct work_struct *w) {
+    struct wifi_drv_scan_band *walk = container_of(to_delayed_work(w), struct wifi_drv_scan_band, work);
+    struct wifi_drv_context *wifi_drv = walk->wifi_drv;
+    struct cfg80211_scan_request *request = READ_ONCE(wifi_drv->scan_request);
+
+    /* aborted scan is finished by wifi_drv_scan_routine() */
+    if (request == NULL || READ_ONCE(wifi_drv->scan_aborted)) {
+        return;
+    }
+
+    /* inform with BSSes of the channel that was just "dwelled" */
+    wifi_drv_inform_channel_bss(wifi_drv, request->channels[walk->idx]);
+
+    walk->idx = wifi_drv_scan_next(request, walk, walk->idx + 1);
+    if (walk->idx < request->n_channels) {
+        queue_delayed_work(wifi_drv->wq, &walk->work, wifi_drv_scan_dwell(request->channels[walk->idx]));
+        return;
+    }
+    if (--wifi_drv->scan_bands_active == 0) {
+        wifi_drv_scan_finish(wifi_drv, request, false);
+    }
+}
+
+/* Starts walks of the scan: one per band of the request that run concurrently, or a single walk over all channels.
+ * Bands are walked one after another if the scan asks for low power or scan_parallel_bands is off,
+ * low span scan is always concurrent. */
+static void wifi_drv_scan_start_bands(struct wifi_drv_context *wifi_drv, struct cfg80211_scan_request *request) {
+    bool parallel = (request->flags & NL80211_SCAN_FLAG_LOW_SPAN) ||
+                    (READ_ONCE(scan_parallel_bands) && !(request->flags & NL80211_SCAN_FLAG_LOW_POWER));
+    struct wifi_drv_scan_band *walk;
+    unsigned int b, n = 0;
+
+    for (b = 0; b < NUM_NL80211_BANDS && (parallel || n == 0); b++) {
+        walk = &wifi_drv->scan_bands[n];
+        walk->band = parallel ? b : NUM_NL80211_BANDS;
+        walk->idx = wifi_drv_scan_next(request, walk, 0);
+        if (walk->idx < request->n_channels) {
+            n++;
+        }
+    }
+
+    wifi_drv->scan_bands_active = n;
+    for (b = 0; b < n; b++) {
+        walk = &wifi_drv->scan_bands[b];
+        queue_delayed_work(wifi_drv->wq, &walk->work, wifi_drv_scan_dwell(request->channels[walk->idx]));
+    }
+}
+
+/* Finishes the aborted scan right away instead of waiting for the end of the current dwells.
+ * Abort queued for the previous scan finds the scan not aborted and does nothing. */
+static void wifi_drv_scan_routine(struct work_struct *w) {
+    struct wifi_drv_context *wifi_drv = container_of(to_delayed_work(w), struct wifi_drv_context, ws_scan);
+    struct cfg80211_scan_request *request = READ_ONCE(wifi_drv->scan_request);
+
+    /* the last band may have completed the scan right before abort */
+    if (request == NULL || !READ_ONCE(wifi_drv->scan_aborted)) {
+        return;
+    }
+    wifi_drv_scan_finish(wifi_drv, request, true);
+}
+
+/* Returns true if BSS matches any match set of the scheduled scan: SSID(empty SSID matches any) and RSSI threshold.
+ * Every BSS matches if there are no match sets. */
+static bool wifi_drv_sched_scan_match(const struct cfg80211_sched_scan_request *request,
+                                      const struct wifi_drv_bss *entry) {
+    s32 signal = entry->signal / 100; /* mBm -> dBm */
+    int i;
+
+    if (request->n_match_sets == 0) {
+        return true;
+    }
+    for (i = 0; i < request->n_match_sets; i++) {
+        const struct cfg80211_match_set *match = &request->match_sets[i];
+
+        if (match->ssid.ssid_len != 0 &&
+            (match->ssid.ssid_len != entry->ie[1] || memcmp(match->ssid.ssid, &entry->ie[2], entry->ie[1]) != 0)) {
+            continue;
+        }
+        if (match->rssi_thold != NL80211_SCAN_RSSI_THOLD_OFF && signal < match->rssi_thold) {
+            continue;
+        }
+        return true;
+    }
+    return false;
+}
+
+/* Reports BSSes of the population that are on "chan" and match the scheduled scan, returns number of them. */
+static unsigned int wifi_drv_sched_scan_channel(struct wifi_drv_context *wifi_drv,
+                                                const struct cfg80211_sched_scan_request *request,
+                                                struct ieee80211_channel *chan) {
+    struct wifi_drv_bss_population *pop = &g_bss_population;
+    int idx = wifi_drv_bss_population_chan(wifi_drv, chan);
+    unsigned int i, matched = 0;
+
+    if (idx < 0) {
+        return 0;
+    }
+
+    for (i = pop->chan_first[idx]; i < pop->chan_first[idx + 1]; i++) {
+        if (wifi_drv_sched_scan_match(request, &pop->bss[i])) {
+            wifi_drv_inform_bss(wifi_drv, &pop->bss[i]);
+            matched++;
+        }
+        if ((i + 1 - pop->chan_first[idx]) % WIFI_DRV_BSS_BATCH == 0) {
+            cond_resched();
+        }
+    }
+    wifi_drv->sched_scan_filtered += pop->chan_first[idx + 1] - pop->chan_first[idx] - matched;
+    return matched;
+}
+
+/* One cycle of the scheduled scan: all channels of the request are scanned at once and only matching BSSes
+ * are reported. Results of the whole cycle are coalesced into one cfg80211_sched_scan_results(), cycles that found
+ * nothing do not wake userspace at all. Requeues itself according to the scan plans of the request. */
+static void wifi_drv_sched_scan_routine(struct work_struct *w) {
+    struct wifi_drv_context *wifi_drv = container_of(to_delayed_work(w), struct wifi_drv_context, ws_sched_scan);
+    struct cfg80211_sched_scan_request *request = READ_ONCE(wifi_drv->sched_scan_request);
+    struct cfg80211_sched_scan_plan *plan;
+    unsigned int matched = 0, c;
+
+    /* stop may have come while the cycle was queued */
+    if (request == NULL) {
+        return;
+    }
+
+    for (c = 0; c < request->n_channels; c++) {
+        matched += wifi_drv_sched_scan_channel(wifi_drv, request, request->channels[c]);
+    }
+    WRITE_ONCE(wifi_drv->sched_scan_cycles, wifi_drv->sched_scan_cycles + 1);
+    WRITE_ONCE(wifi_drv->sched_scan_matched, wifi_drv->sched_scan_matched + matched);
+    if (matched) {
+        cfg80211_sched_scan_results(wifi_drv->wifi, request->reqid);
+        WRITE_ONCE(wifi_drv->sched_scan_notified, wifi_drv->sched_scan_notified + 1);
+    }
+
+    /* the last plan has no iterations limit, it runs till sched_scan_stop() */
+    plan = &request->scan_plans[wifi_drv->sched_scan_plan];
+    if (plan->iterations != 0 && ++wifi_drv->sched_scan_iter >= plan->iterations &&
+        wifi_drv->sched_scan_plan + 1 < request->n_scan_plans) {
+        wifi_drv->sched_scan_plan++;
+        wifi_drv->sched_scan_iter = 0;
+        plan++;
+    }
+    queue_delayed_work(wifi_drv->wq, &wifi_drv->ws_sched_scan, msecs_to_jiffies(plan->interval * MSEC_PER_SEC));
+}
+
+/* STA interface of the wifi is also a station of its AP interface, so loopback traffic is accounted per station. */
+static void wifi_drv_loopback_sta_update(struct wifi_drv_context *wifi_drv, bool associated) {
+    struct wifi_drv_ndev_priv_context *ap_data;
+    struct net_device *ap_ndev;
+
+    rcu_read_lock();
+    ap_ndev = rcu_dereference(wifi_drv->ap_ndev);
+    if (ap_ndev != NULL) {
+        dev_hold(ap_ndev);
+    }
+    rcu_read_unlock();
+
+    if (ap_ndev == NULL) {
+        return;
+    }
+
+    ap_data = ndev_get_wifi_drv_context(ap_ndev);
+    if (associated) {
+        wifi_drv_sta_add(ap_data, wifi_drv->ndev->dev_addr);
+    } else {
+        wifi_drv_sta_del(ap_data, wifi_drv->ndev->dev_addr);
+    }
+    dev_put(ap_ndev);
+}
+
+/* Returns index of PMKSA of "bssid" in the cache or -1, pmksa_lock should be held. */
+static int wifi_drv_pmksa_find(struct wifi_drv_context *wifi_drv, const u8 *bssid) {
+    unsigned int i;
+
+    for (i = 0; i < wifi_drv->n_pmksa; i++) {
+        if (ether_addr_equal(wifi_drv->pmksa[i].bssid, bssid)) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/* Puts PMKSA to the cache, the oldest entry is dropped when the cache is full. */
+static void wifi_drv_pmksa_set(struct wifi_drv_context *wifi_drv, const u8 *bssid, const u8 *pmkid) {
+    int i;
+
+    spin_lock_bh(&wifi_drv->pmksa_lock);
+    i = wifi_drv_pmksa_find(wifi_drv, bssid);
+    if (i < 0) {
+        if (wifi_drv->n_pmksa == WIFI_DRV_MAX_PMKIDS) {
+            memmove(&wifi_drv->pmksa[0], &wifi_drv->pmksa[1], (WIFI_DRV_MAX_PMKIDS - 1) * sizeof(wifi_drv->pmksa[0]));
+            wifi_drv->n_pmksa--;
+        }
+        i = wifi_drv->n_pmksa++;
+        ether_addr_copy(wifi_drv->pmksa[i].bssid, bssid);
+    }
+    memcpy(wifi_drv->pmksa[i].pmkid, pmkid, WLAN_PMKID_LEN);
+    spin_unlock_bh(&wifi_drv->pmksa_lock);
+}
+
+/* Starts emulated management exchanges of (re)association with "bss", every one takes assoc_frame_us.
+ * Cached PMKSA of the BSS lets the station skip 802.1X, FT reassociation carries the keys and skips the 4-way
+ * handshake as well. The exchanges are a delayed step of ws_assoc like channel dwells of the scan, so scan,
+ * disconnect and firmware events queued meanwhile are not held up. Called on the workqueue. */
+static void wifi_drv_associate(struct wifi_drv_context *wifi_drv, const struct wifi_drv_bss *bss, bool ft, bool roam) {
+    unsigned int frames = WIFI_DRV_AUTH_FRAMES + WIFI_DRV_ASSOC_FRAMES;
+    bool cached;
+
+    spin_lock_bh(&wifi_drv->pmksa_lock);
+    cached = wifi_drv_pmksa_find(wifi_drv, bss->bssid) >= 0;
+    spin_unlock_bh(&wifi_drv->pmksa_lock);
+
+    if (!cached) {
+        frames += WIFI_DRV_8021X_FRAMES;
+    }
+    if (!cached || !ft) {
+        frames += WIFI_DRV_4WAY_FRAMES;
+    }
+
+    memcpy(&wifi_drv->assoc_bss, bss, sizeof(*bss));
+    wifi_drv->assoc_roam = roam;
+    wifi_drv->assoc_cached = cached;
+    wifi_drv->assoc_pending = true;
+    queue_delayed_work(wifi_drv->wq, &wifi_drv->ws_assoc, usecs_to_jiffies(frames * READ_ONCE(assoc_frame_us)));
+}
+
+/* Association started by wifi_drv_associate() has taken its time: informs the kernel with cfg80211_connect_bss()
+ * or cfg80211_roamed(). After full authentication PMKSA is cached like firmware does, so the next connect is fast. */
+static void wifi_drv_assoc_routine(struct work_struct *w) {
+    struct wifi_drv_context *wifi_drv = container_of(to_delayed_work(w), struct wifi_drv_context, ws_assoc);
+    struct wifi_drv_bss *bss = &wifi_drv->assoc_bss;
+    u8 pmkid[WLAN_PMKID_LEN];
+
+    /* cancelled by disconnect */
+    if (!wifi_drv->assoc_pending) {
+        return;
+    }
+    wifi_drv->assoc_pending = false;
+
+    if (!wifi_drv->assoc_cached) {
+        get_random_bytes(pmkid, sizeof(pmkid));
+        wifi_drv_pmksa_set(wifi_drv, bss->bssid, pmkid);
+    }
+    /* cfg80211 looks the BSS up by BSSID and channel, its entry may have expired since the scan */
+    wifi_drv_inform_bss(wifi_drv, bss);
+
+    if (wifi_drv->assoc_roam) {
+        wifi_drv_report_roamed(wifi_drv, bss);
+
+        ether_addr_copy(wifi_drv->conn_bssid, bss->bssid);
+        wifi_drv->roams++;
+        wifi_drv->roams_fast += wifi_drv->assoc_cached;
+        wifi_drv_op_end(wifi_drv, WIFI_DRV_OP_ROAM, 0);
+        return;
+    }
+
+    wifi_drv_report_connect(wifi_drv, bss->bssid, WLAN_STATUS_SUCCESS);
+    wifi_drv_op_end(wifi_drv, WIFI_DRV_OP_CONNECT, 0);
+
+    wifi_drv->connected = true;
+    ether_addr_copy(wifi_drv->conn_bssid, bss->bssid);
+    if (wifi_drv->assoc_cached) {
+        wifi_drv->conn_fast++;
+    } else {
+        wifi_drv->conn_full++;
+    }
+    wifi_drv_loopback_sta_update(wifi_drv, true);
+}
+
+/* Moves the connection to another BSS of the same ESS: "bssid" if given, otherwise(unless it is "fixed") the strongest
+ * other one, and informs the kernel with cfg80211_roamed(). Failed roam requested by connect with prev_bssid("requested")
+ * ends the connection, failed roam of the driver just stays on the current BSS. Called on the workqueue. */
+static void wifi_drv_roam(struct wifi_drv_context *wifi_drv, const u8 *bssid, bool fixed, bool requested) {
+    struct wifi_drv_bss_idx *target = NULL;
+    enum nl80211_auth_type auth_type;
+
+    /* one reassociation at a time */
+    if (wifi_drv->connected && !wifi_drv->assoc_pending) {
+        target = wifi_drv_bss_index_find(wifi_drv, &wifi_drv->conn_ssid, bssid, fixed, wifi_drv->conn_bssid);
+    }
+    if (target == NULL) {
+        wifi_drv->roams_failed++;
+        if (requested && wifi_drv->connected) {
+            wifi_drv->connected = false;
+            wifi_drv_loopback_sta_update(wifi_drv, false);
+            wifi_drv_report_disconnected(wifi_drv, WLAN_REASON_UNSPECIFIED, true);
+        }
+        wifi_drv_op_end(wifi_drv, WIFI_DRV_OP_ROAM, -ENOENT);
+        return;
+    }
+
+    spin_lock_bh(&wifi_drv->conn_lock);
+    auth_type = wifi_drv->auth_type;
+    spin_unlock_bh(&wifi_drv->conn_lock);
+
+    wifi_drv_associate(wifi_drv, &target->bss, auth_type == NL80211_AUTHTYPE_FT, true);
+}
+
+/* Roam started by the driver through "roam" file in debugfs, like firmware does on weak signal. */
+static void wifi_drv_roam_routine(struct work_struct *w) {
+    struct wifi_drv_context *wifi_drv = container_of(w, struct wifi_drv_context, ws_roam);
+    u8 bssid[ETH_ALEN];
+
+    spin_lock_bh(&wifi_drv->conn_lock);
+    ether_addr_copy(bssid, wifi_drv->roam_bssid);
+    spin_unlock_bh(&wifi_drv->conn_lock);
+
+    wifi_drv_roam(wifi_drv, bssid, false, false);
+}
+
+/* Connects to BSS of the requested ESS that is found in the BSS index: the requested BSSID or the strongest one.
+ * Connect with a fixed BSSID(sme->bssid) fails if that BSS is not known, only a BSSID hint falls back.
+ * It should call cfg80211_connect_bss() when connect is finished or cfg80211_connect_timeout() when connect is failed.
+ * Connect with prev_bssid while connected is a reassociation, it is done by wifi_drv_roam().
+ * This routine called through workqueue, when the kernel asks about connect through cfg80211_ops. */
+static void wifi_drv_connect_routine(struct work_struct *w) {
+    struct wifi_drv_context *wifi_drv = container_of(w, struct wifi_drv_context, ws_connect);
+    struct wifi_drv_ssid_key ssid;
+    struct wifi_drv_bss_idx *target;
+    u8 bssid[ETH_ALEN];
+    bool fixed, reassoc;
+    struct wifi_drv_fw_cmd cmd = {
+            .type = WIFI_DRV_FW_CMD_CONNECT,
+    };
+    int err;
+
+    spin_lock_bh(&wifi_drv->conn_lock);
+    memcpy(&ssid, &wifi_drv->connecting_ssid, sizeof(ssid));
+    ether_addr_copy(bssid, wifi_drv->connecting_bssid);
+    fixed = wifi_drv->connecting_bssid_fixed;
+    reassoc = wifi_drv->connecting_reassoc;
+    memset(&wifi_drv->connecting_ssid, 0, sizeof(wifi_drv->connecting_ssid));
+    spin_unlock_bh(&wifi_drv->conn_lock);
+
+    /* the firmware has no reassociation command, roam is always done by the driver */
+    if (reassoc && wifi_drv->connected) {
+        wifi_drv_roam(wifi_drv, bssid, fixed, true);
+        return;
+    }
+    /* cfg80211 passes prev_bssid while not connected as well, that is a plain connect */
+    if (reassoc) {
+        wifi_drv_op_end(wifi_drv, WIFI_DRV_OP_ROAM, -ENOTCONN);
+        wifi_drv_op_begin(wifi_drv, WIFI_DRV_OP_CONNECT);
+    }
+
+    /* with the firmware attached connect is finished by its WIFI_DRV_FW_EVT_CONNECT_RESULT */
+    memcpy(&wifi_drv->conn_ssid, &ssid, sizeof(ssid));
+    cmd.connect.ssid_len = ssid.len;
+    memcpy(cmd.connect.ssid, ssid.ssid, ssid.len);
+    err = wifi_drv_fw_cmd(wifi_drv, &cmd);
+    if (err == 0) {
+        wifi_drv->fw_connect_pending = true;
+        return;
+    }
+    if (err != -ENODEV) {
+        wifi_drv_report_connect_timeout(wifi_drv, NL80211_TIMEOUT_UNSPECIFIED);
+        wifi_drv_op_end(wifi_drv, WIFI_DRV_OP_CONNECT, err);
+        return;
+    }
+
+    target = wifi_drv_bss_index_find(wifi_drv, &ssid, bssid, fixed, NULL);
+    /* the dummy network can be connected without scan, it is indexed when it is informed */
+    if (target == NULL && ssid.len == SSID_DUMMY_SIZE && memcmp(ssid.ssid, SSID_DUMMY, SSID_DUMMY_SIZE) == 0) {
+        inform_dummy_bss(wifi_drv);
+        target = wifi_drv_bss_index_find(wifi_drv, &ssid, bssid, fixed, NULL);
+    }
+    if (target == NULL) {
+        wifi_drv->bss_index_miss++;
+        wifi_drv_report_connect_timeout(wifi_drv, NL80211_TIMEOUT_SCAN);
+        wifi_drv_op_end(wifi_drv, WIFI_DRV_OP_CONNECT, -ETIMEDOUT);
+        return;
+    }
+
+    /* we can connect to ESS that already know. If else, technically kernel will only warn.*/
+    /* so, wifi_drv_assoc_routine() sends the BSS to the kernel before complete. */
+    wifi_drv_associate(wifi_drv, &target->bss, false, false);
+}
+
+/* Just calls cfg80211_disconnected() that informs the kernel that disconnect is complete.
+ * Disconnect that interrupts association of connect finishes the connect with cfg80211_connect_timeout() instead,
+ * interrupted roam is dropped and the current connection is ended.
+ * This routine called through workqueue, when the kernel asks about disconnect through cfg80211_ops. */
+static void wifi_drv_disconnect_routine(struct work_struct *w) {
+
+    struct wifi_drv_context *wifi_drv = container_of(w, struct wifi_drv_context, ws_disconnect);
+    struct wifi_drv_fw_cmd cmd = {
+            .type = WIFI_DRV_FW_CMD_DISCONNECT,
+    };
+    u16 reason_code;
+
+    spin_lock_bh(&wifi_drv->conn_lock);
+    reason_code = wifi_drv->disconnect_reason_code;
+    wifi_drv->disconnect_reason_code = 0;
+    spin_unlock_bh(&wifi_drv->conn_lock);
+
+    /* ws_assoc runs on the same ordered workqueue, it is not running now */
+    if (wifi_drv->assoc_pending) {
+        cancel_delayed_work(&wifi_drv->ws_assoc);
+        wifi_drv->assoc_pending = false;
+        if (wifi_drv->assoc_roam) {
+            wifi_drv->roams_failed++;
+            wifi_drv_op_end(wifi_drv, WIFI_DRV_OP_ROAM, -ECANCELED);
+        } else {
+            wifi_drv_report_connect_timeout(wifi_drv, NL80211_TIMEOUT_UNSPECIFIED);
+            wifi_drv_op_end(wifi_drv, WIFI_DRV_OP_CONNECT, -ECANCELED);
+            wifi_drv_op_end(wifi_drv, WIFI_DRV_OP_DISCONNECT, 0);
+            return;
+        }
+    }
+
+    /* with the firmware attached disconnect is finished by its WIFI_DRV_FW_EVT_DEAUTH */
+    cmd.disconnect.reason_code = reason_code;
+    if (wifi_drv_fw_cmd(wifi_drv, &cmd) == 0) {
+        wifi_drv->fw_disconnect_pending = true;
+        return;
+    }
+
+    wifi_drv->connected = false;
+    wifi_drv_loopback_sta_update(wifi_drv, false);
+
+    wifi_drv_report_disconnected(wifi_drv, reason_code, true);
+    wifi_drv_op_end(wifi_drv, WIFI_DRV_OP_DISCONNECT, 0);
+}
+
+/* Reports BSS found by the firmware scan. */
+static void wifi_drv_fw_inform_bss(struct wifi_drv_context *wifi_drv, const struct wifi_drv_fw_evt *evt) {
+    u8 ssid_len = min_t(u8, evt->scan_result.ssid_len, WIFI_DRV_FW_SSID_MAX);
+    struct wifi_drv_bss entry = {
+            .signal = evt->scan_result.signal,
+            .chan = ieee80211_get_channel(wifi_drv->wifi, evt->scan_result.freq),
+            .ie_len = 2 + ssid_len,
+    };
+
+    if (entry.chan == NULL) {
+        return;
+    }
+    ether_addr_copy(entry.bssid, evt->scan_result.bssid);
+    entry.ie[0] = WLAN_EID_SSID;
+    entry.ie[1] = ssid_len;
+    memcpy(&entry.ie[2], evt->scan_result.ssid, ssid_len);
+    wifi_drv_inform_bss(wifi_drv, &entry);
+}
+
+/* Completes the operation the event answers. Event is a copy, the firmware may reuse its slot already. */
+static void wifi_drv_fw_handle_event(struct wifi_drv_fw *fw, const struct wifi_drv_fw_evt *evt) {
+    struct wifi_drv_context *wifi_drv = fw->wifi_drv;
+    struct cfg80211_scan_request *request;
+    bool aborted, locally_generated;
+    u64 rtt;
+
+    switch (evt->type) {
+    case WIFI_DRV_FW_EVT_SCAN_RESULT:
+        /* results of scans that are aborted or finished already are dropped */
+        if (evt->seq == READ_ONCE(wifi_drv->fw_scan_seq) && READ_ONCE(wifi_drv->scan_request) != NULL) {
+            wifi_drv_fw_inform_bss(wifi_drv, evt);
+        }
+        fw->evts++;
+        return;
+    case WIFI_DRV_FW_EVT_SCAN_DONE:
+        if (evt->seq != READ_ONCE(wifi_drv->fw_scan_seq)) {
+            break;
+        }
+        request = xchg(&wifi_drv->scan_request, NULL);
+        if (request != NULL) {
+            aborted = evt->status != 0 || READ_ONCE(wifi_drv->scan_aborted);
+            wifi_drv_report_scan_done(wifi_drv, request, aborted);
+            wifi_drv_op_end(wifi_drv, WIFI_DRV_OP_SCAN, aborted ? -ECANCELED : 0);
+        }
+        break;
+    case WIFI_DRV_FW_EVT_CONNECT_RESULT:
+        if (!wifi_drv->fw_connect_pending) {
+            break;
+        }
+        wifi_drv->fw_connect_pending = false;
+        wifi_drv_report_connect(wifi_drv, evt->connect_result.bssid, evt->status);
+        wifi_drv_op_end(wifi_drv, WIFI_DRV_OP_CONNECT, evt->status == WLAN_STATUS_SUCCESS ? 0 : -ECONNREFUSED);
+        if (evt->status == WLAN_STATUS_SUCCESS) {
+            wifi_drv->connected = true;
+            ether_addr_copy(wifi_drv->conn_bssid, evt->connect_result.bssid);
+            wifi_drv_loopback_sta_update(wifi_drv, true);
+        }
+        break;
+    case WIFI_DRV_FW_EVT_DEAUTH:
+        /* answer to our disconnect or AP has kicked us out */
+        locally_generated = wifi_drv->fw_disconnect_pending;
+        wifi_drv->fw_disconnect_pending = false;
+        wifi_drv->connected = false;
+        wifi_drv_loopback_sta_update(wifi_drv, false);
+        wifi_drv_report_disconnected(wifi_drv, evt->deauth.reason_code, locally_generated);
+        if (locally_generated) {
+            wifi_drv_op_end(wifi_drv, WIFI_DRV_OP_DISCONNECT, 0);
+        }
+        break;
+    case WIFI_DRV_FW_EVT_AP_RESULT:
+        break;
+    default:
+        fw->evt_invalid++;
+        return;
+    }
+
+    fw->evts++;
+    if (evt->seq != 0 && evt->cmd_ts_ns != 0) {
+        rtt = ktime_get_ns() - evt->cmd_ts_ns;
+        fw->rtt_count++;
+        fw->rtt_sum_ns += rtt;
+        fw->rtt_max_ns = max(fw->rtt_max_ns, rtt);
+    }
+}
+
+/* Drains the evt ring, runs on the workqueue of the wifi when the firmware rings the doorbell.
+ * Before going idle it asks for the next doorbell with need_wakeup and checks the ring once more. */
+static void wifi_drv_fw_events_routine(struct work_struct *w) {
+    struct wifi_drv_fw *fw = container_of(w, struct wifi_drv_fw, ws_events);
+    struct wifi_drv_fw_ring *ring = &fw->shm->evt;
+    struct wifi_drv_fw_evt evt;
+    unsigned int n = 0;
+    u32 head, tail = fw->evt_tail;
+
+    fw->evt_runs++;
+    WRITE_ONCE(ring->need_wakeup, 0);
+    for (;;) {
+        head = smp_load_acquire(&ring->head);
+        if (head == tail) {
+            WRITE_ONCE(ring->need_wakeup, 1);
+            /* pairs with the barrier of the firmware between publishing head and checking need_wakeup */
+            smp_mb();
+            if (smp_load_acquire(&ring->head) == tail) {
+                break;
+            }
+            WRITE_ONCE(ring->need_wakeup, 0);
+            continue;
+        }
+        if (head - tail > WIFI_DRV_FW_RING_ENTRIES) {
+            /* head comes from userspace, ring is ignored until the next doorbell */
+            fw->evt_invalid++;
+            break;
+        }
+
+        memcpy(&evt, &fw->shm->evts[tail % WIFI_DRV_FW_RING_ENTRIES], sizeof(evt));
+        smp_store_release(&ring->tail, ++tail);
+        wifi_drv_fw_handle_event(fw, &evt);
+
+        if (++n % WIFI_DRV_BSS_BATCH == 0) {
+            cond_resched();
+        }
+    }
+    fw->evt_tail = tail;
+}
+
+/* Firmware is gone, operations it has not answered are completed by the driver. */
+static void wifi_drv_fw_detached_routine(struct work_struct *w) {
+    struct wifi_drv_context *wifi_drv = container_of(w, struct wifi_drv_context, ws_fw_detached);
+
+    if (wifi_drv->fw_connect_pending) {
+        wifi_drv->fw_connect_pending = false;
+        wifi_drv_report_connect_timeout(wifi_drv, NL80211_TIMEOUT_UNSPECIFIED);
+        wifi_drv_op_end(wifi_drv, WIFI_DRV_OP_CONNECT, -ETIMEDOUT);
+    }
+    if (wifi_drv->fw_disconnect_pending) {
+        wifi_drv->fw_disconnect_pending = false;
+        wifi_drv->connected = false;
+        wifi_drv_loopback_sta_update(wifi_drv, false);
+        wifi_drv_report_disconnected(wifi_drv, 0, true);
+        wifi_drv_op_end(wifi_drv, WIFI_DRV_OP_DISCONNECT, 0);
+    }
+    /* scan routine finishes the scan as aborted */
+    if (READ_ONCE(wifi_drv->scan_request) != NULL) {
+        WRITE_ONCE(wifi_drv->scan_aborted, true);
+        /* firmware stops its scan, its late WIFI_DRV_FW_EVT_SCAN_DONE is ignored since the routine finishes the scan first */
+        wifi_drv_fw_cmd(wifi_drv, &(struct wifi_drv_fw_cmd) { .type = WIFI_DRV_FW_CMD_SCAN_ABORT,
+                                                              .seq = READ_ONCE(wifi_drv->fw_scan_seq) });
+        mod_delayed_work(wifi_drv->wq, &wifi_drv->ws_scan, 0);
+    }
+}
+
+/* HostAP mode functions */
+static int wifi_drv_start_ap(struct wifi *wifi, struct net_device *dev,
+                           struct cfg80211_config_params *params) {
+    struct wifi_drv_context *wifi_drv = wifi_get_wifi_drv_context(wifi)->wifi_drv;
+
+    wifi_drv_op_begin(wifi_drv, WIFI_DRV_OP_START_AP);
+    mutex_lock(&wifi_drv->ap_lock);
+
+    // Set the AP mode in the driver context
+    wifi_drv->ap_mode_enabled = true;
+
+    // Perform any necessary initialization for AP mode, such as setting up beacon and DTIM parameters
+
+    // Inform the kernel about the start of AP mode
+    cfg80211_ap_start(wifi_drv->ndev, params);
+
+    // Let the firmware know, AP start itself stays synchronous
+    wifi_drv_fw_cmd(wifi_drv, &(struct wifi_drv_fw_cmd) { .type = WIFI_DRV_FW_CMD_START_AP });
+
+    mutex_unlock(&wifi_drv->ap_lock);
+    wifi_drv_op_end(wifi_drv, WIFI_DRV_OP_START_AP, 0);
+
+    return 0; /* OK */
+}
+
+static void wifi_drv_stop_ap(struct wifi *wifi, struct net_device *dev) {
+    struct wifi_drv_context *wifi_drv = wifi_get_wifi_drv_context(wifi)->wifi_drv;
+    struct cfg80211_ap_config ap_config;
+
+    // The AP should be an interface of this radio
+    if (wifi_drv_iface_find_wdev(wifi_drv, dev->ieee80211_ptr) == NULL) {
+        return;
+    }
+
+    wifi_drv_op_begin(wifi_drv, WIFI_DRV_OP_STOP_AP);
+    mutex_lock(&wifi_drv->ap_lock);
+    wifi_drv->ap_mode_enabled = false;
+    mutex_unlock(&wifi_drv->ap_lock);
+
+    wifi_drv_fw_cmd(wifi_drv, &(struct wifi_drv_fw_cmd) { .type = WIFI_DRV_FW_CMD_STOP_AP });
+
+    // Clear the device mode to station
+    dev_set_mode(dev, NL80211_IFTYPE_STATION);
+
+    // Unregister the AP configuration
+    memset(&ap_config, 0, sizeof(ap_config));
+    ap_config.ifindex = dev->ifindex;
+    cfg80211_unregister_bss(wifi_drv->wifi, &ap_config);
+    wifi_drv_op_end(wifi_drv, WIFI_DRV_OP_STOP_AP, 0);
+}
+
+/* Creates STA or AP interface on the radio, called by the kernel under RTNL(eg. `iw phy <wifi> interface add`).
+ * Interfaces are limited by wifi_drv_iface_combinations, they are tracked in the registry of the radio. */
+static int nvf_add_virtual_intf(struct wifi *wifi, struct net_device *dev,
+                                 enum nl80211_iftype type, const char *name,
+                                 unsigned char name_assign_type) {
+    struct wifi_drv_context *wifi_drv = wifi_get_wifi_drv_context(wifi)->wifi_drv;
+    struct net_device *new_dev;
+    int err;
+
+    // Only one AP interface per wifi_drv, it is the peer of the STA interface in the loopback datapath
+    if (type == NL80211_IFTYPE_AP && wifi_drv_iface_count_type(wifi_drv, NL80211_IFTYPE_AP, NULL) != 0) {
+        return -EBUSY;
+    }
+    if (wifi_drv->n_ifaces >= WIFI_DRV_MAX_IFACES) {
+        return -EBUSY;
+    }
+
+    // Allocate a new net_device for the virtual interface, type and parent wifi are set there
+    new_dev = wifi_drv_alloc_ndev(wifi_drv, name, name_assign_type, type);
+    if (!new_dev) {
+        return -ENOMEM; // Memory allocation failed
+    }
+
+    // Register the new virtual interface, RTNL is already held by the kernel
+    err = register_netdevice(new_dev);
+    if (err) {
+        wifi_drv_free_ndev(new_dev);
+        return err;
+    }
+    // From now the core frees the device when its unregistration completes, see nvf_del_virtual_intf()
+    new_dev->needs_free_netdev = true;
+    new_dev->priv_destructor = wifi_drv_ndev_destructor;
+
+    err = wifi_drv_iface_add(wifi_drv, new_dev);
+    if (err) {
+        unregister_netdevice(new_dev);
+        return err;
+    }
+
+    // If the new interface is for AP mode, start the AP
+    if (type == NL80211_IFTYPE_AP) {
+        struct cfg80211_config_params params = { /* Initialize with necessary parameters */ };
+        if (wifi_drv_start_ap(wifi, new_dev, &params) < 0) {
+            wifi_drv_iface_del(wifi_drv, wifi_drv_iface_find_wdev(wifi_drv, new_dev->ieee80211_ptr));
+            unregister_netdevice(new_dev);
+            return -EIO; // Failed to start AP mode
+        }
+
+        // Synthetic clients, see ap_stations module parameter
+        wifi_drv_sta_add_synthetic(ndev_get_wifi_drv_context(new_dev), ap_stations);
+
+        // From now STA traffic is delivered to this interface
+        rcu_assign_pointer(wifi_drv->ap_ndev, new_dev);
+    }
+
+    return 0; // Success
+}
+
+
+/* Changes type of the interface, called by the kernel under RTNL(eg. `iw dev <dev> set type __ap`).
+ * The AP interface is the loopback peer of the primary STA interface, so ap_ndev follows the type in both
+ * directions. The primary STA interface stays a STA. */
+static int nvf_change_virtual_intf(struct wifi *wifi, struct net_device *dev,
+                                    enum nl80211_iftype type) {
+    struct wifi_drv_context *wifi_drv = wifi_get_wifi_drv_context(wifi)->wifi_drv;
+    struct wifi_drv_ndev_priv_context *ndev_data = ndev_get_wifi_drv_context(dev);
+    enum nl80211_iftype old_type = dev->ieee80211_ptr->iftype;
+
+    // Check if the requested type is valid
+    if (type != NL80211_IFTYPE_AP && type != NL80211_IFTYPE_STATION) {
+        return -EINVAL; // Invalid interface type
+    }
+    if (type == old_type) {
+        return 0;
+    }
+    if (type == NL80211_IFTYPE_AP) {
+        // The primary interface is the STA side of the loopback datapath
+        if (dev == wifi_drv->ndev) {
+            return -EOPNOTSUPP;
+        }
+        // Interface combinations allow one AP per radio
+        if (wifi_drv_iface_count_type(wifi_drv, NL80211_IFTYPE_AP, dev) != 0) {
+            return -EBUSY;
+        }
+    }
+
+    // Update the interface type
+    dev->ieee80211_ptr->iftype = type;
+
+    // Perform any additional configuration needed for the new type
+    if (type == NL80211_IFTYPE_AP) {
+        // Synthetic clients, see ap_stations module parameter
+        wifi_drv_sta_add_synthetic(ndev_data, ap_stations);
+        // From now STA traffic is delivered to this interface
+        rcu_assign_pointer(wifi_drv->ap_ndev, dev);
+    } else {
+        if (rtnl_dereference(wifi_drv->ap_ndev) == dev) {
+            if (wifi_drv->ap_mode_enabled) {
+                wifi_drv_stop_ap(wifi, dev);
+            }
+            RCU_INIT_POINTER(wifi_drv->ap_ndev, NULL);
+            // Wait for STA napi polls that may still deliver to the AP side of this interface
+            synchronize_net();
+        }
+        wifi_drv_sta_flush(ndev_data);
+    }
+
+    return 0; // Success
+}
+
+/* Deletes interface created by nvf_add_virtual_intf(), called by the kernel under RTNL. The device is looked up
+ * in the registry of the radio, so only interfaces of this radio are touched. The primary STA interface lives as
+ * long as the radio. */
+static void nvf_del_virtual_intf(struct wifi *wifi, struct net_device *dev) {
+    struct wifi_drv_context *wifi_drv = wifi_get_wifi_drv_context(wifi)->wifi_drv;
+    struct wifi_drv_iface *iface = wifi_drv_iface_find_ifindex(wifi_drv, dev->ifindex);
+
+    if (iface == NULL || iface->ndev != dev || dev == wifi_drv->ndev) {
+        netdev_warn(dev, "interface can't be deleted from %s\n", wifi_name(wifi));
+        return;
+    }
+
+    // Detach from the loopback datapath, unregistration waits until STA xmit in flight is done with it
+    if (rtnl_dereference(wifi_drv->ap_ndev) == dev) {
+        if (wifi_drv->ap_mode_enabled) {
+            wifi_drv_stop_ap(wifi, dev);
+        }
+        RCU_INIT_POINTER(wifi_drv->ap_ndev, NULL);
+    }
+
+    wifi_drv_iface_del(wifi_drv, iface);
+    // Unregister the device, its rings and net_device are freed by the core through wifi_drv_ndev_destructor()
+    unregister_netdevice(dev);
+}
+
+
+/* Starts scan of "request" that owns scan_request: by the firmware if it is attached, otherwise by band walks of the
+ * driver. scan_request is released if the scan could not start. Used by nvf_scan() and the scan benchmark. */
+static int wifi_drv_scan_run(struct wifi_drv_context *wifi_drv, struct cfg80211_scan_request *request) {
+    struct wifi_drv_fw_cmd cmd = {
+            .type = WIFI_DRV_FW_CMD_SCAN,
+    };
+    unsigned int i;
+    int err;
+
+    /* seq is published before the command, so the answer is never taken for a stale one */
+    cmd.seq = atomic_inc_return(&wifi_drv->fw_seq) ?: atomic_inc_return(&wifi_drv->fw_seq);
+    WRITE_ONCE(wifi_drv->fw_scan_seq, cmd.seq);
+    cmd.scan.n_freqs = min_t(u32, request->n_channels, WIFI_DRV_FW_MAX_SCAN_FREQS);
+    for (i = 0; i < cmd.scan.n_freqs; i++) {
+        cmd.scan.freqs[i] = request->channels[i]->center_freq;
+    }
+    err = wifi_drv_fw_cmd(wifi_drv, &cmd);
+    if (err != -ENODEV) {
+        if (err) {
+            xchg(&wifi_drv->scan_request, NULL);
+        }
+        return err;
+    }
+    WRITE_ONCE(wifi_drv->fw_scan_seq, 0);
+
+    /* first channel of every band is reported after its dwell, also u can't call cfg80211_scan_done right away after
+     * cfg80211_ops->scan(), netlink client would not get message with "scan done". */
+    wifi_drv_scan_start_bands(wifi_drv, request);
+
+    return 0; /* OK */
+}
+
+/* callback that called by the kernel when user decided to scan.
+ * This callback should initiate scan routine(through work_struct) and exit with 0 if everything ok.
+ * Scan routine should be finished with cfg80211_scan_done() call. */
+static int nvf_scan(struct wifi *wifi, struct cfg80211_scan_request *request) {
+    struct wifi_drv_context *wifi_drv = wifi_get_wifi_drv_context(wifi)->wifi_drv;
+
+    /* scan and abort_scan are serialized by the kernel, and it asks for the next scan only after the previous one is
+     * reported, so no scan of the kernel is running here. The flag is cleared before the request is published:
+     * abort that is still queued for the previous scan sees it is not aborted and leaves this one alone. */
+    WRITE_ONCE(wifi_drv->scan_aborted, false);
+    if (cmpxchg(&wifi_drv->scan_request, NULL, request) != NULL) {
+        return -EBUSY;
+    }
+    wifi_drv_op_begin(wifi_drv, WIFI_DRV_OP_SCAN);
+
+    return wifi_drv_scan_run(wifi_drv, request);
+}
+
+/* callback that called by the kernel when user decided to cancel the scan.
+ * Scan routine is run right away instead of waiting for the end of the current dwells, it finishes scan with "aborted" flag. */
+static void nvf_abort_scan(struct wifi *wifi, struct wireless_dev *wdev) {
+    struct wifi_drv_context *wifi_drv = wifi_get_wifi_drv_context(wifi)->wifi_drv;
+
+    if (READ_ONCE(wifi_drv->scan_request) != NULL) {
+        WRITE_ONCE(wifi_drv->scan_aborted, true);
+        /* firmware stops its scan, its late WIFI_DRV_FW_EVT_SCAN_DONE is ignored since the routine finishes the scan first */
+        wifi_drv_fw_cmd(wifi_drv, &(struct wifi_drv_fw_cmd) { .type = WIFI_DRV_FW_CMD_SCAN_ABORT,
+                                                              .seq = READ_ONCE(wifi_drv->fw_scan_seq) });
+        mod_delayed_work(wifi_drv->wq, &wifi_drv->ws_scan, 0);
+    }
+}
+
+/* callback that called by the kernel when userspace starts scheduled(background) scan,
+ * eg: `iw dev wlan0 scan sched_start interval 30 matches ssid WiFi`.
+ * Cycles run in the driver, so userspace is woken only when something it looks for is found. */
+static int nvf_sched_scan_start(struct wifi *wifi, struct net_device *dev, struct cfg80211_sched_scan_request *request) {
+    struct wifi_drv_context *wifi_drv = wifi_get_wifi_drv_context(wifi)->wifi_drv;
+
+    /* sched_scan_start/stop are serialized by the kernel, the routine is not queued when there is no request */
+    if (wifi_drv->sched_scan_request != NULL) {
+        return -EBUSY;
+    }
+    wifi_drv->sched_scan_plan = 0;
+    wifi_drv->sched_scan_iter = 0;
+    WRITE_ONCE(wifi_drv->sched_scan_request, request);
+
+    queue_delayed_work(wifi_drv->wq, &wifi_drv->ws_sched_scan, msecs_to_jiffies(request->delay * MSEC_PER_SEC));
+    return 0;
+}
+
+/* callback that called by the kernel when scheduled scan should be stopped, the request is freed after it returns. */
+static int nvf_sched_scan_stop(struct wifi *wifi, struct net_device *dev, u64 reqid) {
+    struct wifi_drv_context *wifi_drv = wifi_get_wifi_drv_context(wifi)->wifi_drv;
+    struct cfg80211_sched_scan_request *request = wifi_drv->sched_scan_request;
+
+    if (request == NULL || request->reqid != reqid) {
+        return -ENOENT;
+    }
+    WRITE_ONCE(wifi_drv->sched_scan_request, NULL);
+    /* waits for the cycle that may be running and drops the queued one */
+    cancel_delayed_work_sync(&wifi_drv->ws_sched_scan);
+    return 0;
+}
+
+/* callback that called by the kernel when there is need to "connect" to some network.
  * It inits connection routine through work_struct and exits with 0 if everything ok.
  * connect routine should be finished with cfg80211_connect_bss()/cfg80211_connect_result()/cfg80211_connect_done() or cfg80211_connect_timeout(). */
 static int nvf_connect(struct wifi *wifi, struct net_device *dev,
                 struct cfg80211_connect_params *sme) {
     struct wifi_drv_context *wifi_drv = wifi_get_wifi_drv_context(wifi)->wifi_drv;
-    size_t ssid_len = sme->ssid_len > 15 ? 15 : sme->ssid_len;
+    size_t ssid_len = min_t(size_t, sme->ssid_len, IEEE80211_MAX_SSID_LEN);
+    /* a fixed BSSID locks the connection to that BSS, a hint only tells which one to prefer */
+    const u8 *bssid = sme->bssid != NULL ? sme->bssid : sme->bssid_hint;
+
+    /* connection state is per radio and reported to its primary interface, other stations can't connect */
+    if (dev != wifi_drv->ndev) {
+        return -EOPNOTSUPP;
+    }
+
+    /* connect with prev_bssid while connected is reassociation to another BSS of the ESS */
+    wifi_drv_op_begin(wifi_drv, sme->prev_bssid != NULL ? WIFI_DRV_OP_ROAM : WIFI_DRV_OP_CONNECT);
+
+    spin_lock_bh(&wifi_drv->conn_lock);
+    memset(&wifi_drv->connecting_ssid, 0, sizeof(wifi_drv->connecting_ssid));
+    memcpy(wifi_drv->connecting_ssid.ssid, sme->ssid, ssid_len);
+    wifi_drv->connecting_ssid.len = ssid_len;
+    if (bssid != NULL) {
+        ether_addr_copy(wifi_drv->connecting_bssid, bssid);
+    } else {
+        eth_zero_addr(wifi_drv->connecting_bssid);
+    }
+    wifi_drv->connecting_bssid_fixed = sme->bssid != NULL;
+    wifi_drv->connecting_reassoc = sme->prev_bssid != NULL;
+    wifi_drv->auth_type = sme->auth_type;
+    spin_unlock_bh(&wifi_drv->conn_lock);
+
+    if (!queue_work(wifi_drv->wq, &wifi_drv->ws_connect)) {
+        return -EBUSY;
+    }
+    return 0;
+}
+/* callback that called by the kernel when userspace changes parameters of the connection for the next roam,
+ * the driver roams by itself(see wifi_drv_roam()). Only auth type matters for the emulation: FT roams are faster. */
+static int nvf_update_connect_params(struct wifi *wifi, struct net_device *dev, struct cfg80211_connect_params *sme,
+                                     u32 changed) {
+    struct wifi_drv_context *wifi_drv = wifi_get_wifi_drv_context(wifi)->wifi_drv;
+
+    if (dev != wifi_drv->ndev) {
+        return -EOPNOTSUPP;
+    }
+    if (changed & UPDATE_AUTH_TYPE) {
+        spin_lock_bh(&wifi_drv->conn_lock);
+        wifi_drv->auth_type = sme->auth_type;
+        spin_unlock_bh(&wifi_drv->conn_lock);
+    }
+    return 0;
+}
+
+/* callback that called by the kernel when userspace caches PMKSA, eg. wpa_supplicant after 802.1X authentication.
+ * Connect and roam to the BSS skip 802.1X then. */
+static int nvf_set_pmksa(struct wifi *wifi, struct net_device *dev, struct cfg80211_pmksa *pmksa) {
+    struct wifi_drv_context *wifi_drv = wifi_get_wifi_drv_context(wifi)->wifi_drv;
+
+    /* FILS caches(cache id + SSID) are not supported */
+    if (pmksa->bssid == NULL || pmksa->pmkid == NULL) {
+        return -EOPNOTSUPP;
+    }
+    wifi_drv_pmksa_set(wifi_drv, pmksa->bssid, pmksa->pmkid);
+    return 0;
+}
+
+static int nvf_del_pmksa(struct wifi *wifi, struct net_device *dev, struct cfg80211_pmksa *pmksa) {
+    struct wifi_drv_context *wifi_drv = wifi_get_wifi_drv_context(wifi)->wifi_drv;
+    int i;
+
+    if (pmksa->bssid == NULL) {
+        return -EOPNOTSUPP;
+    }
+    spin_lock_bh(&wifi_drv->pmksa_lock);
+    i = wifi_drv_pmksa_find(wifi_drv, pmksa->bssid);
+    if (i >= 0) {
+        memmove(&wifi_drv->pmksa[i], &wifi_drv->pmksa[i + 1], (wifi_drv->n_pmksa - i - 1) * sizeof(wifi_drv->pmksa[0]));
+        wifi_drv->n_pmksa--;
+    }
+    spin_unlock_bh(&wifi_drv->pmksa_lock);
+    return i >= 0 ? 0 : -ENOENT;
+}
+
+static int nvf_flush_pmksa(struct wifi *wifi, struct net_device *dev) {
+    struct wifi_drv_context *wifi_drv = wifi_get_wifi_drv_context(wifi)->wifi_drv;
+
+    spin_lock_bh(&wifi_drv->pmksa_lock);
+    wifi_drv->n_pmksa = 0;
+    spin_unlock_bh(&wifi_drv->pmksa_lock);
+    return 0;
+}
+
+/* callback that called by the kernel when there is need to "diconnect" from currently connected network.
+ * It inits disconnect routine through work_struct and exits with 0 if everything ok.
+ * disconnect routine should call cfg80211_disconnected() to inform the kernel that disconnection is complete. */
+static int nvf_disconnect(struct wifi *wifi, struct net_device *dev,
+                   u16 reason_code) {
+    struct wifi_drv_context *wifi_drv = wifi_get_wifi_drv_context(wifi)->wifi_drv;
+
+    if (dev != wifi_drv->ndev) {
+        return -EOPNOTSUPP;
+    }
+
+    wifi_drv_op_begin(wifi_drv, WIFI_DRV_OP_DISCONNECT);
+
+    spin_lock_bh(&wifi_drv->conn_lock);
+    wifi_drv->disconnect_reason_code = reason_code;
+    spin_unlock_bh(&wifi_drv->conn_lock);
+
+    if (!queue_work(wifi_drv->wq, &wifi_drv->ws_disconnect)) {
+        return -EBUSY;
+    }
+    return 0;
+}
+
+/* callback that called by the kernel to get statistics of the station associated with AP interface, eg: `iw dev wlan0 station get <mac>` */
+static int nvf_get_station(struct wifi *wifi, struct net_device *dev, const u8 *mac,
+                           struct station_info *sinfo) {
+    struct wifi_drv_ndev_priv_context *ndev_data = ndev_get_wifi_drv_context(dev);
+    struct wifi_drv_sta *sta;
+    int ret = -ENOENT;
+
+    rcu_read_lock();
+    sta = rhashtable_lookup(&ndev_data->sta_table, mac, wifi_drv_sta_params);
+    if (sta != NULL) {
+        wifi_drv_sta_fill_info(sta, sinfo);
+        ret = 0;
+    }
+    rcu_read_unlock();
+
+    return ret;
+}
+
+/* callback that called by the kernel for every station in turn, "idx" goes from 0 until -ENOENT is returned,
+ * eg: `iw dev wlan0 station dump`. Only sta_lock is taken, datapath keeps running while the dump is in progress. */
+static int nvf_dump_station(struct wifi *wifi, struct net_device *dev, int idx, u8 *mac,
+                            struct station_info *sinfo) {
+    struct wifi_drv_ndev_priv_context *ndev_data = ndev_get_wifi_drv_context(dev);
+    struct wifi_drv_sta *sta = NULL;
+    struct wifi_drv_sta *iter;
+    int i = 0;
+
+    spin_lock_bh(&ndev_data->sta_lock);
+
+    if (ndev_data->dump_sta != NULL && idx == ndev_data->dump_idx + 1) {
+        /* continue from the previous call */
+        if (!list_is_last(&ndev_data->dump_sta->list, &ndev_data->sta_list)) {
+            sta = list_next_entry(ndev_data->dump_sta, list);
+        }
+    } else {
+        list_for_each_entry(iter, &ndev_data->sta_list, list) {
+            if (i++ == idx) {
+                sta = iter;
+                break;
+            }
+        }
+    }
+
+    ndev_data->dump_sta = sta;
+    ndev_data->dump_idx = idx;
+    if (sta != NULL) {
+        ether_addr_copy(mac, sta->addr);
+        wifi_drv_sta_fill_info(sta, sinfo);
+    }
+
+    spin_unlock_bh(&ndev_data->sta_lock);
+
+    return sta != NULL ? 0 : -ENOENT;
+}
+
+/* Structure of functions for FullMAC 80211 drivers.
+ * Functions that implemented along with fields/flags in wifi structure would represent drivers features.
+ * This DEMO can only perform "scan" and "connect".
+ * Some functions cant be implemented alone, for example: with "connect" there is should be function "disconnect". */
+static struct cfg80211_ops nvf_cfg_ops = {
+        .scan = nvf_scan,
+        .abort_scan = nvf_abort_scan,
+        .sched_scan_start = nvf_sched_scan_start,
+        .sched_scan_stop = nvf_sched_scan_stop,
+        .connect = nvf_connect,
+        .disconnect = nvf_disconnect,
+        .update_connect_params = nvf_update_connect_params,
+        .set_pmksa = nvf_set_pmksa,
+        .del_pmksa = nvf_del_pmksa,
+        .flush_pmksa = nvf_flush_pmksa,
+        .add_virtual_intf = nvf_add_virtual_intf, // Add callbacks for AP mode
+        .change_virtual_intf = nvf_change_virtual_intf, // Add callbacks for AP mode
+        .del_virtual_intf = nvf_del_virtual_intf, // Add callbacks for AP mode
+        .get_station = nvf_get_station,
+        .dump_station = nvf_dump_station,
+};
+
+/* Array of "supported" channels in 2ghz band. It's required for wifi.
+ * For demo - the only channel 6. */
+static struct ieee80211_channel nvf_supported_channels_2ghz[] = {
+    {
+        .band = NL80211_BAND_2GHZ,
+        .hw_value = 6,
+        .center_freq = 2437,
+        .flags = IEEE80211_CHAN_NO_IBSS, 
+    },
+    {
+        .band = NL80211_BAND_2GHZ,
+        .hw_value = 1,
+        .center_freq = 2412,
+        .flags = IEEE80211_CHAN_NO_IBSS,
+    },
+    {
+        .band = NL80211_BAND_2GHZ,
+        .hw_value = 11,
+        .center_freq = 2462,
+        .flags = IEEE80211_CHAN_NO_IBSS,
+    },
+    // Add additional channels as needed for 40 MHz support
+};
+
+/* Array of supported rates. Its required to support at least those next rates for 2ghz band. */
+static struct ieee80211_rate nvf_supported_rates_2ghz[] = {
+    {
+        .bitrate = 10,
+        .hw_value = 0x1,
+    },
+    {
+        .bitrate = 20,
+        .hw_value = 0x2,
+    },
+    {
+        .bitrate = 55,
+        .hw_value = 0x4,
+    },
+    {
+        .bitrate = 110,
+        .hw_value = 0x8,
+    },
+    {
+        .bitrate = 30, // 40 MHz rate
+        .hw_value = 0x10,
+    },
+    {
+        .bitrate = 60, // 40 MHz rate
+        .hw_value = 0x20,
+    },
+    {
+        .bitrate = 150, // 40 MHz rate
+        .hw_value = 0x40,
+    },
+    {
+        .bitrate = 300, // 40 MHz rate
+        .hw_value = 0x80,
+    },
+};
+
+/* 5ghz channels of UNII-1, UNII-2, UNII-2e and UNII-3, channels of UNII-2/2e require DFS: radar detection before
+ * the channel can be used and passive scan. */
+#define WIFI_DRV_CHAN_5GHZ(_chan, _flags) { \
+        .band = NL80211_BAND_5GHZ, \
+        .hw_value = (_chan), \
+        .center_freq = 5000 + 5 * (_chan), \
+        .flags = IEEE80211_CHAN_NO_IBSS | (_flags), \
+    }
+#define WIFI_DRV_CHAN_DFS (IEEE80211_CHAN_RADAR | IEEE80211_CHAN_NO_IR)
+
+static struct ieee80211_channel nvf_supported_channels_5ghz[] = {
+    WIFI_DRV_CHAN_5GHZ(36, 0),
+    WIFI_DRV_CHAN_5GHZ(40, 0),
+    WIFI_DRV_CHAN_5GHZ(44, 0),
+    WIFI_DRV_CHAN_5GHZ(48, 0),
+    WIFI_DRV_CHAN_5GHZ(52, WIFI_DRV_CHAN_DFS),
+    WIFI_DRV_CHAN_5GHZ(56, WIFI_DRV_CHAN_DFS),
+    WIFI_DRV_CHAN_5GHZ(60, WIFI_DRV_CHAN_DFS),
+    WIFI_DRV_CHAN_5GHZ(64, WIFI_DRV_CHAN_DFS),
+    WIFI_DRV_CHAN_5GHZ(100, WIFI_DRV_CHAN_DFS),
+    WIFI_DRV_CHAN_5GHZ(104, WIFI_DRV_CHAN_DFS),
+    WIFI_DRV_CHAN_5GHZ(108, WIFI_DRV_CHAN_DFS),
+    WIFI_DRV_CHAN_5GHZ(112, WIFI_DRV_CHAN_DFS),
+    WIFI_DRV_CHAN_5GHZ(116, WIFI_DRV_CHAN_DFS),
+    WIFI_DRV_CHAN_5GHZ(120, WIFI_DRV_CHAN_DFS),
+    WIFI_DRV_CHAN_5GHZ(124, WIFI_DRV_CHAN_DFS),
+    WIFI_DRV_CHAN_5GHZ(128, WIFI_DRV_CHAN_DFS),
+    WIFI_DRV_CHAN_5GHZ(132, WIFI_DRV_CHAN_DFS),
+    WIFI_DRV_CHAN_5GHZ(136, WIFI_DRV_CHAN_DFS),
+    WIFI_DRV_CHAN_5GHZ(140, WIFI_DRV_CHAN_DFS),
+    WIFI_DRV_CHAN_5GHZ(144, WIFI_DRV_CHAN_DFS),
+    WIFI_DRV_CHAN_5GHZ(149, 0),
+    WIFI_DRV_CHAN_5GHZ(153, 0),
+    WIFI_DRV_CHAN_5GHZ(157, 0),
+    WIFI_DRV_CHAN_5GHZ(161, 0),
+    WIFI_DRV_CHAN_5GHZ(165, 0),
+};
+
+/* OFDM rates only, there is no CCK in 5ghz band. */
+static struct ieee80211_rate nvf_supported_rates_5ghz[] = {
+    {
+        .bitrate = 60,
+        .hw_value = 0x1,
+    },
+    {
+        .bitrate = 90,
+        .hw_value = 0x2,
+    },
+    {
+        .bitrate = 120,
+        .hw_value = 0x4,
+    },
+    {
+        .bitrate = 180,
+        .hw_value = 0x8,
+    },
+    {
+        .bitrate = 240,
+        .hw_value = 0x10,
+    },
+    {
+        .bitrate = 360,
+        .hw_value = 0x20,
+    },
+    {
+        .bitrate = 480,
+        .hw_value = 0x40,
+    },
+    {
+        .bitrate = 540,
+        .hw_value = 0x80,
+    },
+};
+
+/* VHT MCS map: MCS 0-9 on 2 spatial streams, other streams are not supported */
+#define WIFI_DRV_VHT_MCS_MAP (IEEE80211_VHT_MCS_SUPPORT_0_9 | IEEE80211_VHT_MCS_SUPPORT_0_9 << 2 | 0xfff0)
+
+/* Structure that describes supported band of 5ghz: HT40 and VHT80 with 2 spatial streams. */
+static struct ieee80211_supported_band nf_band_5ghz = {
+    .ht_cap.cap = IEEE80211_HT_CAP_SUP_WIDTH_20_40 | IEEE80211_HT_CAP_SGI_20 | IEEE80211_HT_CAP_SGI_40,
+    .ht_cap.ht_supported = true,
+    .ht_cap.ampdu_factor = IEEE80211_HT_MAX_AMPDU_64K, // A-MPDUs up to 64K, see wifi_drv_agg_add()
+    .ht_cap.ampdu_density = IEEE80211_HT_MPDU_DENSITY_NONE,
+    .ht_cap.mcs.rx_mask = {0xff, 0xff}, // MCS 0-15
+    .ht_cap.mcs.tx_params = IEEE80211_HT_MCS_TX_DEFINED,
+    .vht_cap.vht_supported = true,
+    .vht_cap.cap = IEEE80211_VHT_CAP_MAX_MPDU_LENGTH_11454 | IEEE80211_VHT_CAP_RXLDPC | IEEE80211_VHT_CAP_SHORT_GI_80 |
+                   3 << IEEE80211_VHT_CAP_MAX_A_MPDU_LENGTH_EXPONENT_SHIFT, // A-MPDUs up to 64K as well
+    .vht_cap.vht_mcs.rx_mcs_map = cpu_to_le16(WIFI_DRV_VHT_MCS_MAP),
+    .vht_cap.vht_mcs.tx_mcs_map = cpu_to_le16(WIFI_DRV_VHT_MCS_MAP),
+    .channels = nvf_supported_channels_5ghz,
+    .n_channels = ARRAY_SIZE(nvf_supported_channels_5ghz),
+    .bitrates = nvf_supported_rates_5ghz,
+    .n_bitrates = ARRAY_SIZE(nvf_supported_rates_5ghz),
+};
+
+/* Structure that describes supported band of 2ghz. */
+static struct ieee80211_supported_band nf_band_2ghz = {
+    .ht_cap.cap = IEEE80211_HT_CAP_SGI_20 | IEEE80211_HT_CAP_SGI_40, // Enable short guard interval for both 20 and 40 MHz
+    .ht_cap.ht_supported = true, // Indicate that HT is supported
+    .ht_cap.ampdu_factor = IEEE80211_HT_MAX_AMPDU_64K, // A-MPDUs up to 64K, see wifi_drv_agg_add()
+    .ht_cap.ampdu_density = IEEE80211_HT_MPDU_DENSITY_NONE,
+    .channels = nvf_supported_channels_2ghz,
+    .n_channels = ARRAY_SIZE(nvf_supported_channels_2ghz),
+    .bitrates = nvf_supported_rates_2ghz,
+    .n_bitrates = ARRAY_SIZE(nvf_supported_rates_2ghz),
+};
+
+/* Bands of every radio, BSS population is spread over their channels */
+static struct ieee80211_supported_band *const g_bands[NUM_NL80211_BANDS] = {
+        [NL80211_BAND_2GHZ] = &nf_band_2ghz,
+        [NL80211_BAND_5GHZ] = &nf_band_5ghz,
+};
+
+/* Stations created through add_virtual_intf() and one AP(peer of the loopback datapath), all on one channel */
+static const struct ieee80211_iface_limit wifi_drv_iface_limits[] = {
+        { .max = WIFI_DRV_MAX_IFACES - 1, .types = BIT(NL80211_IFTYPE_STATION) },
+        { .max = 1, .types = BIT(NL80211_IFTYPE_AP) },
+};
+
+static const struct ieee80211_iface_combination wifi_drv_iface_combinations[] = {
+        {
+                .limits = wifi_drv_iface_limits,
+                .n_limits = ARRAY_SIZE(wifi_drv_iface_limits),
+                .max_interfaces = WIFI_DRV_MAX_IFACES,
+                .num_different_channels = 1,
+        },
+};
+
+/* Simulated PHY rate of the station(100 kbps), one of the rates of the band picked by the station address,
+ * so the same station always gets the same rate and synthetic stations get a mix of fast and slow ones. */
+static u16 wifi_drv_sta_rate(const u8 *addr) {
+    return nvf_supported_rates_2ghz[jhash(addr, ETH_ALEN, 0) % ARRAY_SIZE(nvf_supported_rates_2ghz)].bitrate;
+}
+
+/* Builds synthetic BSS population of "n_bss" BSSes spread over channels of all "bands".
+ * The BSS number 0 is the "dummy" network that connect accepts, it stays on the first channel of the first band. */
+static int wifi_drv_build_bss_population(struct wifi_drv_bss_population *pop,
+                                         struct ieee80211_supported_band *const *bands, unsigned int n_bss) {
+    struct ieee80211_channel **chans;
+    unsigned int n_channels = 0;
+    unsigned int b, c, i;
+    const u8 dummy_bssid[ETH_ALEN] = {0xaa, 0xbb, 0xcc, 0xdd, 0xee, 0xff};
+
+    n_bss = clamp_t(unsigned int, n_bss, 1, WIFI_DRV_MAX_BSS);
+    if (bss_signal_max < bss_signal_min) {
+        swap(bss_signal_min, bss_signal_max);
+    }
+
+    for (b = 0; b < NUM_NL80211_BANDS; b++) {
+        pop->band_first[b] = n_channels;
+        n_channels += bands[b] != NULL ? bands[b]->n_channels : 0;
+    }
+    /* channel number of the population -> channel, needed while the population is built only */
+    chans = kcalloc(n_channels, sizeof(*chans), GFP_KERNEL);
+    if (chans == NULL) {
+        return -ENOMEM;
+    }
+    for (b = 0; b < NUM_NL80211_BANDS; b++) {
+        for (c = 0; bands[b] != NULL && c < bands[b]->n_channels; c++) {
+            chans[pop->band_first[b] + c] = &bands[b]->channels[c];
+        }
+    }
+
+    pop->chan_first = kcalloc(n_channels + 1, sizeof(*pop->chan_first), GFP_KERNEL);
+    if (pop->chan_first == NULL) {
+        kfree(chans);
+        return -ENOMEM;
+    }
+    pop->bss = kvcalloc(n_bss, sizeof(*pop->bss), GFP_KERNEL);
+    if (pop->bss == NULL) {
+        kfree(pop->chan_first);
+        kfree(chans);
+        return -ENOMEM;
+    }
+    pop->n_bss = n_bss;
+
+    /* BSS number i goes to the channel i % n_channels */
+    for (c = 0; c < n_channels; c++) {
+        pop->chan_first[c + 1] = pop->chan_first[c] + n_bss / n_channels + (c < n_bss % n_channels);
+    }
+
+    for (i = 0; i < n_bss; i++) {
+        struct wifi_drv_bss *bss = &pop->bss[pop->chan_first[i % n_channels] + i / n_channels];
+        u8 ssid_len;
+
+        bss->chan = chans[i % n_channels];
+        bss->signal = bss_signal_min + (s32) get_random_u32_below(bss_signal_max - bss_signal_min + 1);
+
+        if (i == 0) {
+            ether_addr_copy(bss->bssid, dummy_bssid);
+            memcpy(bss->ie + 2, SSID_DUMMY, SSID_DUMMY_SIZE);
+            ssid_len = SSID_DUMMY_SIZE;
+        } else {
+            /* locally administered address with BSS number in the lower bytes */
+            bss->bssid[0] = 0x02;
+            bss->bssid[1] = 0x00;
+            put_unaligned_be32(i, bss->bssid + 2);
+            ssid_len = scnprintf((char *) bss->ie + 2, IEEE80211_MAX_SSID_LEN + 1, "%s%u", bss_ssid_prefix, i);
+        }
+
+        /* ie - array of tags that usually retrieved from beacon frame or probe responce. */
+        bss->ie[0] = WLAN_EID_SSID;
+        bss->ie[1] = ssid_len;
+        bss->ie_len = ssid_len + 2;
+    }
+
+    kfree(chans);
+    return 0;
+}
+
+static void wifi_drv_free_bss_population(struct wifi_drv_bss_population *pop) {
+    kvfree(pop->bss);
+    kfree(pop->chan_first);
+    memset(pop, 0, sizeof(*pop));
+}
+
+/* Memory the driver allocates for the network device: net_device with its queues, private data, rings. */
+static size_t wifi_drv_ndev_footprint(struct net_device *ndev) {
+    struct wifi_drv_ndev_priv_context *ndev_data = ndev_get_wifi_drv_context(ndev);
+    size_t size = ALIGN(sizeof(*ndev), NETDEV_ALIGN) + sizeof(*ndev_data);
+
+    size += ndev->num_tx_queues * sizeof(struct netdev_queue);
+    size += ndev->num_rx_queues * sizeof(struct netdev_rx_queue);
+    /* only active queues have rings */
+    size += ndev_data->max_queues * sizeof(struct wifi_drv_queue);
+    size += (size_t) READ_ONCE(ndev_data->num_queues) *
+            (READ_ONCE(ndev_data->tx_ring_size) + READ_ONCE(ndev_data->rx_ring_size)) * sizeof(struct sk_buff *);
+    return size;
+}
+
+/* Memory the driver allocates for one radio. Allocations of the wifi core itself are not counted. */
+static size_t wifi_drv_footprint(struct wifi_drv_context *ctx) {
+    size_t size = sizeof(*ctx) + sizeof(struct wifi_drv_wifi_priv_context);
+    struct wifi_drv_iface *iface;
+
+    /* devices are freed only after unregister_netdevice() has waited for RCU readers */
+    rcu_read_lock();
+    list_for_each_entry_rcu(iface, &ctx->ifaces, list) {
+        size += sizeof(*iface) + wifi_drv_ndev_footprint(iface->ndev);
+    }
+    rcu_read_unlock();
+
+    return size;
+}
+
+static int wifi_drv_footprint_show(struct seq_file *seq, void *v) {
+    seq_printf(seq, "%zu\n", wifi_drv_footprint(seq->private));
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(wifi_drv_footprint);
+
+/* Interfaces of the radio with memory each one takes and add/del counters. Interface churn rate is the
+ * difference of the counters over time, see also "iface" operation of tools/wifi_drv_bench.
+ * The registry is walked under RCU like in wifi_drv_footprint(): the core removes debugfs directory of the wifi
+ * under RTNL and waits for readers, so RTNL can't be taken here. Counters may be a change behind the list. */
+static int wifi_drv_ifaces_show(struct seq_file *seq, void *v) {
+    struct wifi_drv_context *ctx = seq->private;
+    struct wifi_drv_iface *iface;
+
+    seq_printf(seq, "ifaces: %u\nadds: %llu\ndels: %llu\n", READ_ONCE(ctx->n_ifaces), READ_ONCE(ctx->iface_adds),
+               READ_ONCE(ctx->iface_dels));
+    rcu_read_lock();
+    list_for_each_entry_rcu(iface, &ctx->ifaces, list) {
+        seq_printf(seq, "%d %s %s %zu\n", iface->ifindex, netdev_name(iface->ndev),
+                   READ_ONCE(iface->wdev->iftype) == NL80211_IFTYPE_AP ? "ap" : "station",
+                   sizeof(*iface) + wifi_drv_ndev_footprint(iface->ndev));
+    }
+    rcu_read_unlock();
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(wifi_drv_ifaces);
+
+/* Receive buffer counters of the device: frames copied to page_pool buffers, passed as they came (GSO/too long)
+ * and buffer allocation failures. With CONFIG_PAGE_POOL_STATS also page_pool allocation and recycling counters:
+ * "fast" pages came from the lockless cache, "slow" from the page allocator. */
+static void wifi_drv_page_pool_show_ndev(struct seq_file *seq, struct net_device *ndev) {
+    struct wifi_drv_ndev_priv_context *ndev_data = ndev_get_wifi_drv_context(ndev);
+    u64 copied = 0, bypass = 0, alloc_fail = 0;
+    unsigned int qid;
+#ifdef CONFIG_PAGE_POOL_STATS
+    struct page_pool_stats pp_stats = {};
+    u64 fast, slow;
+#endif
+
+    for (qid = 0; qid < ndev_data->num_queues; qid++) {
+        struct wifi_drv_queue *q = &ndev_data->queues[qid];
+
+        copied += READ_ONCE(q->rx_pp_copied);
+        bypass += READ_ONCE(q->rx_pp_bypass);
+        alloc_fail += READ_ONCE(q->rx_pp_alloc_fail);
+#ifdef CONFIG_PAGE_POOL_STATS
+        page_pool_get_stats(q->page_pool, &pp_stats);
+#endif
+    }
+    seq_printf(seq, "%s: copied %llu bypass %llu alloc_fail %llu\n", netdev_name(ndev), copied, bypass, alloc_fail);
+
+#ifdef CONFIG_PAGE_POOL_STATS
+    fast = pp_stats.alloc_stats.fast;
+    slow = pp_stats.alloc_stats.slow + pp_stats.alloc_stats.slow_high_order;
+    seq_printf(seq, "%s: alloc_fast %llu alloc_slow %llu recycle_cached %llu recycle_ring %llu released %llu hit_pct %llu\n",
+               netdev_name(ndev), fast, slow, pp_stats.recycle_stats.cached, pp_stats.recycle_stats.ring,
+               pp_stats.recycle_stats.released_refcnt, fast + slow ? div64_u64(fast * 100, fast + slow) : 0);
+#endif
+}
+
+static void wifi_drv_show_ndev(struct seq_file *seq, struct net_device *ndev,
+                               void (*show)(struct seq_file *, struct net_device *)) {
+    struct wifi_drv_ndev_priv_context *ndev_data = ndev_get_wifi_drv_context(ndev);
+
+    mutex_lock(&ndev_data->queues_lock);
+    show(seq, ndev);
+    mutex_unlock(&ndev_data->queues_lock);
+}
+
+/* Shows counters of STA and AP(if any) interfaces of the wifi. RTNL can't be taken here: the core removes debugfs
+ * directory of the wifi under RTNL and waits for readers. queues_lock keeps queues of the device from being
+ * reconfigured by ethtool meanwhile, the AP interface is held, so it is not freed under the reader. */
+static void wifi_drv_show_ndevs(struct seq_file *seq, void (*show)(struct seq_file *, struct net_device *)) {
+    struct wifi_drv_context *ctx = seq->private;
+    struct net_device *ap_ndev;
+
+    /* primary interface is freed after wifi unregister, debugfs readers are done by then */
+    wifi_drv_show_ndev(seq, ctx->ndev, show);
+
+    rcu_read_lock();
+    ap_ndev = rcu_dereference(ctx->ap_ndev);
+    if (ap_ndev != NULL) {
+        dev_hold(ap_ndev);
+    }
+    rcu_read_unlock();
+
+    if (ap_ndev != NULL) {
+        wifi_drv_show_ndev(seq, ap_ndev, show);
+        dev_put(ap_ndev);
+    }
+}
+
+static int wifi_drv_page_pool_show(struct seq_file *seq, void *v) {
+    wifi_drv_show_ndevs(seq, wifi_drv_page_pool_show_ndev);
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(wifi_drv_page_pool);
+
+/* XDP verdicts of received frames and frames redirected to the device, summed over queues. */
+static void wifi_drv_xdp_show_ndev(struct seq_file *seq, struct net_device *ndev) {
+    struct wifi_drv_ndev_priv_context *ndev_data = ndev_get_wifi_drv_context(ndev);
+    struct wifi_drv_xdp_stats sum = {};
+    unsigned int qid;
+
+    for (qid = 0; qid < ndev_data->num_queues; qid++) {
+        const struct wifi_drv_xdp_stats *xs = &ndev_data->queues[qid].xdp_stats;
+
+        sum.pass += READ_ONCE(xs->pass);
+        sum.drop += READ_ONCE(xs->drop);
+        sum.tx += READ_ONCE(xs->tx);
+        sum.tx_err += READ_ONCE(xs->tx_err);
+        sum.redirect += READ_ONCE(xs->redirect);
+        sum.redirect_err += READ_ONCE(xs->redirect_err);
+        sum.xmit += READ_ONCE(xs->xmit);
+        sum.xmit_err += READ_ONCE(xs->xmit_err);
+    }
+    seq_printf(seq, "%s: pass %llu drop %llu tx %llu tx_err %llu redirect %llu redirect_err %llu xmit %llu xmit_err %llu\n",
+               netdev_name(ndev), sum.pass, sum.drop, sum.tx, sum.tx_err, sum.redirect, sum.redirect_err,
+               sum.xmit, sum.xmit_err);
+}
+
+static int wifi_drv_xdp_show(struct seq_file *seq, void *v) {
+    wifi_drv_show_ndevs(seq, wifi_drv_xdp_show_ndev);
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(wifi_drv_xdp);
+
+static const char *const wifi_drv_agg_flush_names[WIFI_DRV_AGG_FLUSH_MAX] = {
+    [WIFI_DRV_AGG_FLUSH_FULL] = "full",
+    [WIFI_DRV_AGG_FLUSH_BURST] = "burst_end",
+    [WIFI_DRV_AGG_FLUSH_TIMEOUT] = "timeout",
+    [WIFI_DRV_AGG_FLUSH_EVICT] = "evict",
+};
+
+/* A-MPDU size distribution(bucket N counts deliveries of 2^N..2^(N+1)-1 frames) and flush reasons, summed over queues.
+ * Single frames are deliveries of size 1, so frames/deliveries is the per-delivery overhead saved by aggregation. */
+static void wifi_drv_ampdu_show_ndev(struct seq_file *seq, struct net_device *ndev) {
+    struct wifi_drv_ndev_priv_context *ndev_data = ndev_get_wifi_drv_context(ndev);
+    u64 hist[WIFI_DRV_AGG_HIST_BUCKETS] = {}, flush[WIFI_DRV_AGG_FLUSH_MAX] = {};
+    u64 deliveries = 0, frames = 0;
+    unsigned int qid, i;
+
+    for (qid = 0; qid < ndev_data->num_queues; qid++) {
+        const struct wifi_drv_queue *q = &ndev_data->queues[qid];
+
+        for (i = 0; i < WIFI_DRV_AGG_HIST_BUCKETS; i++) {
+            hist[i] += READ_ONCE(q->agg_hist[i]);
+        }
+        for (i = 0; i < WIFI_DRV_AGG_FLUSH_MAX; i++) {
+            flush[i] += READ_ONCE(q->agg_flush[i]);
+        }
+    }
+    for (i = 0; i < WIFI_DRV_AGG_HIST_BUCKETS; i++) {
+        deliveries += hist[i];
+    }
+    for (qid = 0; qid < ndev_data->num_queues; qid++) {
+        const struct wifi_drv_queue_stats *stats = &ndev_data->queues[qid].tx_stats;
+        unsigned int start;
+        u64 packets, drops;
+
+        do {
+            start = u64_stats_fetch_begin(&stats->syncp);
+            packets = u64_stats_read(&stats->packets);
+            drops = u64_stats_read(&stats->drops);
+        } while (u64_stats_fetch_retry(&stats->syncp, start));
+        frames += packets + drops;
+    }
+
+    seq_printf(seq, "%s: deliveries %llu frames %llu frames_per_delivery_x100 %llu\n", netdev_name(ndev), deliveries,
+               frames, deliveries ? div64_u64(frames * 100, deliveries) : 0);
+    for (i = 0; i < WIFI_DRV_AGG_HIST_BUCKETS; i++) {
+        seq_printf(seq, "  %u-%u: %llu\n", 1U << i, (2U << i) - 1, hist[i]);
+    }
+    for (i = 0; i < WIFI_DRV_AGG_FLUSH_MAX; i++) {
+        seq_printf(seq, "  flush_%s: %llu\n", wifi_drv_agg_flush_names[i], flush[i]);
+    }
+}
+
+static int wifi_drv_ampdu_show(struct seq_file *seq, void *v) {
+    wifi_drv_show_ndevs(seq, wifi_drv_ampdu_show_ndev);
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(wifi_drv_ampdu);
+
+/* Command/event counters and round trip latency of the attached firmware. */
+static int wifi_drv_fw_show(struct seq_file *seq, void *v) {
+    struct wifi_drv_context *ctx = seq->private;
+    struct wifi_drv_fw *fw;
+    u64 rtt_count;
+
+    rcu_read_lock();
+    fw = rcu_dereference(ctx->fw);
+    if (fw == NULL) {
+        seq_puts(seq, "detached\n");
+    } else {
+        rtt_count = READ_ONCE(fw->rtt_count);
+        seq_printf(seq, "cmds: %llu\ncmd_full: %llu\ncmd_doorbells: %llu\n", READ_ONCE(fw->cmds),
+                   READ_ONCE(fw->cmd_full), READ_ONCE(fw->cmd_doorbells));
+        seq_printf(seq, "evts: %llu\nevt_invalid: %llu\nevt_runs: %llu\n", READ_ONCE(fw->evts),
+                   READ_ONCE(fw->evt_invalid), READ_ONCE(fw->evt_runs));
+        seq_printf(seq, "rtt_count: %llu\nrtt_avg_ns: %llu\nrtt_max_ns: %llu\n", rtt_count,
+                   rtt_count ? div64_u64(READ_ONCE(fw->rtt_sum_ns), rtt_count) : 0, READ_ONCE(fw->rtt_max_ns));
+    }
+    rcu_read_unlock();
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(wifi_drv_fw);
+
+/* Scheduled scan counters. Host driven periodic scan wakes userspace twice per cycle(scan trigger and results),
+ * offloaded one only once per cycle that has found something, the difference is "wakeups_saved". */
+static int wifi_drv_sched_scan_show(struct seq_file *seq, void *v) {
+    struct wifi_drv_context *ctx = seq->private;
+    u64 cycles = READ_ONCE(ctx->sched_scan_cycles);
+    u64 notified = READ_ONCE(ctx->sched_scan_notified);
+
+    seq_printf(seq, "running: %d\ncycles: %llu\nnotified: %llu\nwakeups_saved: %llu\n",
+               READ_ONCE(ctx->sched_scan_request) != NULL, cycles, notified, 2 * cycles - notified);
+    seq_printf(seq, "bss_matched: %llu\nbss_filtered: %llu\n", READ_ONCE(ctx->sched_scan_matched),
+               READ_ONCE(ctx->sched_scan_filtered));
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(wifi_drv_sched_scan);
 
-    if(down_interruptible(&wifi_drv->sem)) {
-        return -ERESTARTSYS;
+/* BSS index, PMKSA cache and connect/roam counters, latency of connects and roams is in "latency" file. */
+static int wifi_drv_conn_show(struct seq_file *seq, void *v) {
+    struct wifi_drv_context *ctx = seq->private;
+
+    seq_printf(seq, "bss_index: %u\nbss_index_miss: %llu\npmksa: %u\n", atomic_read(&ctx->bss_by_bssid.nelems),
+               READ_ONCE(ctx->bss_index_miss), READ_ONCE(ctx->n_pmksa));
+    seq_printf(seq, "connect_full: %llu\nconnect_fast: %llu\n", READ_ONCE(ctx->conn_full), READ_ONCE(ctx->conn_fast));
+    seq_printf(seq, "roams: %llu\nroams_fast: %llu\nroams_failed: %llu\n", READ_ONCE(ctx->roams),
+               READ_ONCE(ctx->roams_fast), READ_ONCE(ctx->roams_failed));
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(wifi_drv_conn);
+
+/* Starts roam of the driver: `echo > roam` roams to the strongest other BSS of the ESS, `echo <bssid> > roam`
+ * to the given one. */
+static ssize_t wifi_drv_roam_write(struct file *file, const char __user *buf, size_t count, loff_t *ppos) {
+    struct wifi_drv_context *ctx = file->private_data;
+    char str[3 * ETH_ALEN];
+    size_t len = min(count, sizeof(str) - 1);
+    u8 bssid[ETH_ALEN];
+
+    if (copy_from_user(str, buf, len)) {
+        return -EFAULT;
+    }
+    str[len] = 0;
+    if (len < 3 * ETH_ALEN - 1 || !mac_pton(str, bssid)) {
+        eth_zero_addr(bssid);
+    }
+
+    spin_lock_bh(&ctx->conn_lock);
+    ether_addr_copy(ctx->roam_bssid, bssid);
+    spin_unlock_bh(&ctx->conn_lock);
+
+    wifi_drv_op_begin(ctx, WIFI_DRV_OP_ROAM);
+    if (!queue_work(ctx->wq, &ctx->ws_roam)) {
+        return -EBUSY;
+    }
+    return count;
+}
+
+static const struct file_operations wifi_drv_roam_fops = {
+        .owner = THIS_MODULE,
+        .open = simple_open,
+        .write = wifi_drv_roam_write,
+        .llseek = noop_llseek,
+};
+
+/* Airtime and queueing delay of every station of the AP, counters are read without airtime_lock. */
+static int wifi_drv_airtime_show(struct seq_file *seq, void *v) {
+    struct wifi_drv_context *ctx = seq->private;
+    struct wifi_drv_ndev_priv_context *ap_data;
+    struct net_device *ap_ndev;
+    struct wifi_drv_sta *sta;
+
+    rcu_read_lock();
+    ap_ndev = rcu_dereference(ctx->ap_ndev);
+    if (ap_ndev == NULL) {
+        rcu_read_unlock();
+        seq_puts(seq, "no AP\n");
+        return 0;
+    }
+    ap_data = ndev_get_wifi_drv_context(ap_ndev);
+    seq_printf(seq, "codel: drops %u ecn_marks %u maxpacket %u\n", READ_ONCE(ap_data->cstats.drop_count),
+               READ_ONCE(ap_data->cstats.ecn_mark), READ_ONCE(ap_data->cstats.maxpacket));
+
+    spin_lock_bh(&ap_data->sta_lock);
+    list_for_each_entry(sta, &ap_data->sta_list, list) {
+        u64 frames = READ_ONCE(sta->tx_frames);
+        unsigned int tid, backlog = 0;
+
+        for (tid = 0; tid < WIFI_DRV_NUM_TIDS; tid++) {
+            backlog += skb_queue_len_lockless(&sta->tids[tid].q);
+        }
+        seq_printf(seq, "%pM: rate %u airtime_us %llu frames %llu sojourn_avg_us %llu sojourn_max_us %u "
+                   "codel_drops %llu overflow_drops %llu backlog %u\n",
+                   sta->addr, sta->rate, READ_ONCE(sta->airtime_us), frames,
+                   frames ? div64_u64(READ_ONCE(sta->sojourn_sum_us), frames) : 0, READ_ONCE(sta->sojourn_max_us),
+                   READ_ONCE(sta->codel_drops), READ_ONCE(sta->overflow_drops), backlog);
+    }
+    spin_unlock_bh(&ap_data->sta_lock);
+    rcu_read_unlock();
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(wifi_drv_airtime);
+
+/* Microbenchmarks of the hot callbacks, run through "bench" file in debugfs:
+ *     $ echo "xmit 100000" > /sys/kernel/debug/ieee80211/wifi_drv/bench
+ *     $ cat /sys/kernel/debug/ieee80211/wifi_drv/bench
+ * Only the callback itself is timed, frames and requests are prepared outside of the measured part. */
+static const char *const wifi_drv_bench_names[WIFI_DRV_BENCH_MAX] = {
+        [WIFI_DRV_BENCH_XMIT] = "xmit",
+        [WIFI_DRV_BENCH_INFORM_BSS] = "inform_bss",
+        [WIFI_DRV_BENCH_SCAN] = "scan",
+};
+
+/* Sends "n" minimal broadcast frames through nvf_ndo_start_xmit() of the STA interface in batches, the way the qdisc
+ * does: BH disabled and the TX queue of the CPU locked once per batch. napi runs between batches, frames the ring or
+ * BQL has no room for are counted as failed. */
+static int wifi_drv_bench_xmit(struct wifi_drv_context *wifi_drv, u64 n, struct wifi_drv_bench_result *res) {
+    struct net_device *dev = wifi_drv->ndev;
+    struct sk_buff_head batch;
+    struct netdev_queue *txq;
+    struct sk_buff *skb;
+    struct ethhdr *eth;
+    unsigned int i, qid;
+    u64 start;
+    int cpu;
+
+    if (!netif_running(dev)) {
+        return -ENETDOWN;
+    }
+
+    __skb_queue_head_init(&batch);
+    while (n) {
+        for (i = 0; i < WIFI_DRV_BENCH_BATCH && i < n; i++) {
+            skb = netdev_alloc_skb(dev, ETH_ZLEN);
+            if (skb == NULL) {
+                __skb_queue_purge(&batch);
+                return -ENOMEM;
+            }
+            eth = skb_put_zero(skb, ETH_ZLEN);
+            eth_broadcast_addr(eth->h_dest);
+            ether_addr_copy(eth->h_source, dev->dev_addr);
+            eth->h_proto = htons(ETH_P_IP);
+            skb->protocol = eth->h_proto;
+            __skb_queue_tail(&batch, skb);
+        }
+        n -= i;
+
+        local_bh_disable();
+        cpu = smp_processor_id();
+        qid = cpu % dev->real_num_tx_queues;
+        txq = netdev_get_tx_queue(dev, qid);
+        start = ktime_get_ns();
+        __netif_tx_lock(txq, cpu);
+        while ((skb = __skb_dequeue(&batch)) != NULL) {
+            skb_set_queue_mapping(skb, qid);
+            if (netif_xmit_frozen_or_stopped(txq) || nvf_ndo_start_xmit(skb, dev) != NETDEV_TX_OK) {
+                kfree_skb(skb);
+                res->failed++;
+                continue;
+            }
+            res->ops++;
+        }
+        __netif_tx_unlock(txq);
+        res->ns += ktime_get_ns() - start;
+        local_bh_enable();
+        cond_resched();
+    }
+    return 0;
+}
+
+/* Informs the kernel about the dummy BSS "n" times, like a scan that finds it on every channel. Runs on the workqueue
+ * one batch at a time, the BSS index is filled there only. */
+static int wifi_drv_bench_inform_bss(struct wifi_drv_context *wifi_drv, u64 n, struct wifi_drv_bench_result *res) {
+    unsigned int i;
+    u64 start;
+
+    while (n) {
+        start = ktime_get_ns();
+        for (i = 0; i < WIFI_DRV_BENCH_BATCH && i < n; i++) {
+            inform_dummy_bss(wifi_drv);
+        }
+        res->ns += ktime_get_ns() - start;
+        res->ops += i;
+        n -= i;
+        cond_resched();
+    }
+    return 0;
+}
+
+/* Starts "n" emulated scans of all channels of all bands with wifi_drv_scan_run() and takes every one back before
+ * it begins. Runs on the ordered workqueue one batch at a time, so band walks queued by the scan can't run until
+ * they are cancelled and the kernel never sees the request. A scan requested by userspace in the meantime fails with -EBUSY, the benchmark
+ * stops when it loses scan_request to it. Abort flag and latency instrumentation of the real scan are not touched. */
+static int wifi_drv_bench_scan(struct wifi_drv_context *wifi_drv, u64 n, struct wifi_drv_bench_result *res) {
+    struct ieee80211_supported_band *band;
+    struct cfg80211_scan_request *request;
+    unsigned int i, b, n_channels = 0;
+    u64 start;
+    int err = 0;
+
+    /* the firmware would run the scans for real */
+    if (rcu_access_pointer(wifi_drv->fw) != NULL || READ_ONCE(wifi_drv->scan_request) != NULL) {
+        return -EBUSY;
+    }
+    for (b = 0; b < NUM_NL80211_BANDS; b++) {
+        n_channels += wifi_drv->wifi->bands[b] != NULL ? wifi_drv->wifi->bands[b]->n_channels : 0;
+    }
+    request = kzalloc(struct_size(request, channels, n_channels), GFP_KERNEL);
+    if (request == NULL) {
+        return -ENOMEM;
+    }
+    for (b = 0; b < NUM_NL80211_BANDS; b++) {
+        band = wifi_drv->wifi->bands[b];
+        for (i = 0; band != NULL && i < band->n_channels; i++) {
+            request->channels[request->n_channels++] = &band->channels[i];
+        }
     }
 
-    memcpy(wifi_drv->connecting_ssid, sme->ssid, ssid_len);
-    wifi_drv->connecting_ssid[ssid_len] = 0;
+    for (; n; n--) {
+        start = ktime_get_ns();
+        if (cmpxchg(&wifi_drv->scan_request, NULL, request) != NULL) {
+            err = -EBUSY;
+            break;
+        }
+        err = wifi_drv_scan_run(wifi_drv, request);
+        res->ns += ktime_get_ns() - start;
+        if (err) {
+            break;
+        }
+        res->ops++;
+        wifi_drv_scan_cancel_work(wifi_drv);
+        xchg(&wifi_drv->scan_request, NULL);
+        cond_resched();
+    }
+    kfree(request);
+    return err;
+}
+
+struct wifi_drv_bench_def {
+    int (*run)(struct wifi_drv_context *wifi_drv, u64 n, struct wifi_drv_bench_result *res);
+    bool on_wq; /* runs on the workqueue of the wifi, like the code it measures */
+};
+
+static const struct wifi_drv_bench_def wifi_drv_benches[WIFI_DRV_BENCH_MAX] = {
+        [WIFI_DRV_BENCH_XMIT] = {wifi_drv_bench_xmit, false},
+        [WIFI_DRV_BENCH_INFORM_BSS] = {wifi_drv_bench_inform_bss, true},
+        [WIFI_DRV_BENCH_SCAN] = {wifi_drv_bench_scan, true},
+};
+
+struct wifi_drv_bench_work {
+    struct work_struct work;
+    struct wifi_drv_context *wifi_drv;
+    const struct wifi_drv_bench_def *def;
+    u64 n; /* ops left */
+    struct wifi_drv_bench_result res;
+    int err;
+    struct completion done;
+};
+
+/* Runs one batch of the benchmark and queues itself again for the next one. The workqueue is ordered, so scans,
+ * connects and firmware events queued meanwhile run between batches instead of waiting for the whole run. */
+static void wifi_drv_bench_routine(struct work_struct *w) {
+    struct wifi_drv_bench_work *bw = container_of(w, struct wifi_drv_bench_work, work);
+    u64 n = min_t(u64, bw->n, WIFI_DRV_BENCH_BATCH);
+
+    bw->err = bw->def->run(bw->wifi_drv, n, &bw->res);
+    bw->n -= n;
+    if (bw->err || bw->n == 0) {
+        complete(&bw->done);
+        return;
+    }
+    queue_work(bw->wifi_drv->wq, &bw->work);
+}
 
-    up(&wifi_drv->sem);
+/* `echo "<benchmark> [ops]" > bench` runs the benchmark and blocks until it is done. */
+static ssize_t wifi_drv_bench_write(struct file *file, const char __user *buf, size_t count, loff_t *ppos) {
+    struct wifi_drv_context *ctx = ((struct seq_file *) file->private_data)->private;
+    struct wifi_drv_bench_work bw = {
+            .wifi_drv = ctx,
+            .n = WIFI_DRV_BENCH_DEFAULT_OPS,
+    };
+    char str[32], name[16];
+    size_t len = min(count, sizeof(str) - 1);
+    int id;
 
-    if (!schedule_work(&wifi_drv->ws_connect)) {
-        return -EBUSY;
+    if (copy_from_user(str, buf, len)) {
+        return -EFAULT;
     }
-    return 0;
-}
-/* callback that called by the kernel when there is need to "diconnect" from currently connected network.
- * It inits disconnect routine through work_struct and exits with 0 if everything ok.
- * disconnect routine should call cfg80211_disconnected() to inform the kernel that disconnection is complete. */
-static int nvf_disconnect(struct wifi *wifi, struct net_device *dev,
-                   u16 reason_code) {
-    struct wifi_drv_context *wifi_drv = wifi_get_wifi_drv_context(wifi)->wifi_drv;
+    str[len] = 0;
+    if (sscanf(str, "%15s %llu", name, &bw.n) < 1 || bw.n == 0 || bw.n > WIFI_DRV_BENCH_MAX_OPS) {
+        return -EINVAL;
+    }
+    id = match_string(wifi_drv_bench_names, WIFI_DRV_BENCH_MAX, name);
+    if (id < 0) {
+        return -EINVAL;
+    }
+    bw.def = &wifi_drv_benches[id];
 
-    if(down_interruptible(&wifi_drv->sem)) {
-        return -ERESTARTSYS;
+    mutex_lock(&ctx->bench_lock);
+    if (bw.def->on_wq) {
+        INIT_WORK_ONSTACK(&bw.work, wifi_drv_bench_routine);
+        init_completion(&bw.done);
+        queue_work(ctx->wq, &bw.work);
+        wait_for_completion(&bw.done);
+        /* the last batch may still be returning from the routine */
+        flush_work(&bw.work);
+        destroy_work_on_stack(&bw.work);
+    } else {
+        bw.err = bw.def->run(ctx, bw.n, &bw.res);
+    }
+    if (bw.err == 0) {
+        ctx->bench[id] = bw.res;
     }
+    mutex_unlock(&ctx->bench_lock);
+    return bw.err ?: count;
+}
 
-    wifi_drv->disconnect_reason_code = reason_code;
+/* Results of the last run of every benchmark: "<benchmark> <ops> <failed> <ns per op>". */
+static int wifi_drv_bench_show(struct seq_file *seq, void *v) {
+    struct wifi_drv_context *ctx = seq->private;
+    unsigned int i;
 
-    up(&wifi_drv->sem);
+    seq_puts(seq, "bench ops failed ns_per_op\n");
+    mutex_lock(&ctx->bench_lock);
+    for (i = 0; i < WIFI_DRV_BENCH_MAX; i++) {
+        const struct wifi_drv_bench_result *res = &ctx->bench[i];
 
-    if (!schedule_work(&wifi_drv->ws_disconnect)) {
-        return -EBUSY;
+        seq_printf(seq, "%s %llu %llu %llu\n", wifi_drv_bench_names[i], res->ops, res->failed,
+                   res->ops ? div64_u64(res->ns, res->ops) : 0);
     }
+    mutex_unlock(&ctx->bench_lock);
     return 0;
 }
 
-/* Structure of functions for FullMAC 80211 drivers.
- * Functions that implemented along with fields/flags in wifi structure would represent drivers features.
- * This DEMO can only perform "scan" and "connect".
- * Some functions cant be implemented alone, for example: with "connect" there is should be function "disconnect". */
-static struct cfg80211_ops nvf_cfg_ops = {
-        .scan = nvf_scan,
-        .connect = nvf_connect,
-        .disconnect = nvf_disconnect,
-        .add_virtual_intf = nvf_add_virtual_intf, // Add callbacks for AP mode
-        .change_virtual_intf = nvf_change_virtual_intf, // Add callbacks for AP mode
-        .del_virtual_intf = nvf_del_virtual_intf, // Add callbacks for AP mode
-};
-
-/* Network packet transmit.
- * Callback that called by the kernel when packet of data should be sent.
- * In this example it does nothing. */
-static netdev_tx_t nvf_ndo_start_xmit(struct sk_buff *skb,
-                               struct net_device *dev) {
-    /* Dont forget to cleanup skb, as its ownership moved to xmit callback. */
-    kfree_skb(skb);
-    return NETDEV_TX_OK;
+static int wifi_drv_bench_open(struct inode *inode, struct file *file) {
+    return single_open(file, wifi_drv_bench_show, inode->i_private);
 }
 
-/* Structure of functions for network devices.
- * It should have at least ndo_start_xmit functions that called for packet to be sent. */
-static struct net_device_ops nvf_ndev_ops = {
-        .ndo_start_xmit = nvf_ndo_start_xmit,
-};
-
-/* Array of "supported" channels in 2ghz band. It's required for wifi.
- * For demo - the only channel 6. */
-static struct ieee80211_channel nvf_supported_channels_2ghz[] = {
-    {
-        .band = NL80211_BAND_2GHZ,
-        .hw_value = 6,
-        .center_freq = 2437,
-        .flags = IEEE80211_CHAN_NO_IBSS, 
-    },
-    {
-        .band = NL80211_BAND_2GHZ,
-        .hw_value = 1,
-        .center_freq = 2412,
-        .flags = IEEE80211_CHAN_NO_IBSS,
-    },
-    {
-        .band = NL80211_BAND_2GHZ,
-        .hw_value = 11,
-        .center_freq = 2462,
-        .flags = IEEE80211_CHAN_NO_IBSS,
-    },
-    // Add additional channels as needed for 40 MHz support
-};
-
-/* Array of supported rates. Its required to support at least those next rates for 2ghz band. */
-static struct ieee80211_rate nvf_supported_rates_2ghz[] = {
-    {
-        .bitrate = 10,
-        .hw_value = 0x1,
-    },
-    {
-        .bitrate = 20,
-        .hw_value = 0x2,
-    },
-    {
-        .bitrate = 55,
-        .hw_value = 0x4,
-    },
-    {
-        .bitrate = 110,
-        .hw_value = 0x8,
-    },
-    {
-        .bitrate = 30, // 40 MHz rate
-        .hw_value = 0x10,
-    },
-    {
-        .bitrate = 60, // 40 MHz rate
-        .hw_value = 0x20,
-    },
-    {
-        .bitrate = 150, // 40 MHz rate
-        .hw_value = 0x40,
-    },
-    {
-        .bitrate = 300, // 40 MHz rate
-        .hw_value = 0x80,
-    },
-};
-
-/* Structure that describes supported band of 2ghz. */
-static struct ieee80211_supported_band nf_band_2ghz = {
-    .ht_cap.cap = IEEE80211_HT_CAP_SGI_20 | IEEE80211_HT_CAP_SGI_40, // Enable short guard interval for both 20 and 40 MHz
-    .ht_cap.ht_supported = true, // Indicate that HT is supported
-    .channels = nvf_supported_channels_2ghz,
-    .n_channels = ARRAY_SIZE(nvf_supported_channels_2ghz),
-    .bitrates = nvf_supported_rates_2ghz,
-    .n_bitrates = ARRAY_SIZE(nvf_supported_rates_2ghz),
+static const struct file_operations wifi_drv_bench_fops = {
+        .owner = THIS_MODULE,
+        .open = wifi_drv_bench_open,
+        .read = seq_read,
+        .write = wifi_drv_bench_write,
+        .llseek = seq_lseek,
+        .release = single_release,
 };
 
 /* Function that creates wifi context and net_device with wireless_dev.
  * wifi/net_device/wireless_dev is basic interfaces for the kernel to interact with driver as wireless one.
- * It returns driver's main "wifi_drv" context. */
-static struct wifi_drv_context *wifi_drv_create_context(void) {
+ * It returns driver's main "wifi_drv" context, its net_device is not registered yet. */
+static struct wifi_drv_context *wifi_drv_create_context(unsigned int idx) {
     struct wifi_drv_context *ret = NULL;
     struct wifi_drv_wifi_priv_context *wifi_data = NULL;
-    struct wifi_drv_ndev_priv_context *ndev_data = NULL;
+    char name[sizeof(WIFI_NAME) + 10];
+    unsigned int i;
 
     /* allocate for wifi_drv context*/
     ret = kmalloc(sizeof(*ret), GFP_KERNEL);
@@ -436,10 +5024,87 @@ static struct wifi_drv_context *wifi_drv_create_context(void) {
         goto l_error;
     }
 
+    /* DEMO state should be ready before wifi registration, the kernel may call cfg80211_ops right after it. */
+    spin_lock_init(&ret->conn_lock);
+    INIT_WORK(&ret->ws_connect, wifi_drv_connect_routine);
+    memset(&ret->connecting_ssid, 0, sizeof(ret->connecting_ssid));
+    eth_zero_addr(ret->connecting_bssid);
+    ret->connecting_bssid_fixed = false;
+    ret->connecting_reassoc = false;
+    ret->auth_type = NL80211_AUTHTYPE_AUTOMATIC;
+    INIT_WORK(&ret->ws_disconnect, wifi_drv_disconnect_routine);
+    ret->disconnect_reason_code = 0;
+    INIT_WORK(&ret->ws_roam, wifi_drv_roam_routine);
+    eth_zero_addr(ret->roam_bssid);
+    INIT_DELAYED_WORK(&ret->ws_assoc, wifi_drv_assoc_routine);
+    ret->assoc_pending = false;
+    ret->connected = false;
+    spin_lock_init(&ret->pmksa_lock);
+    ret->n_pmksa = 0;
+    ret->conn_full = 0;
+    ret->conn_fast = 0;
+    ret->roams = 0;
+    ret->roams_fast = 0;
+    ret->roams_failed = 0;
+    ret->bss_index_miss = 0;
+    if (rhashtable_init(&ret->bss_by_bssid, &wifi_drv_bss_bssid_params)) {
+        goto l_error_bss_by_bssid;
+    }
+    if (rhltable_init(&ret->bss_by_ssid, &wifi_drv_bss_ssid_params)) {
+        goto l_error_bss_by_ssid;
+    }
+    if (rhashtable_init(&ret->ifaces_by_ifindex, &wifi_drv_iface_ifindex_params)) {
+        goto l_error_ifaces_by_ifindex;
+    }
+    if (rhashtable_init(&ret->ifaces_by_wdev, &wifi_drv_iface_wdev_params)) {
+        goto l_error_ifaces_by_wdev;
+    }
+    INIT_LIST_HEAD(&ret->ifaces);
+    ret->n_ifaces = 0;
+    ret->iface_adds = 0;
+    ret->iface_dels = 0;
+    RCU_INIT_POINTER(ret->ap_ndev, NULL);
+    ret->oper_chan = nf_band_2ghz.channels[0].hw_value;
+    INIT_DELAYED_WORK(&ret->ws_scan, wifi_drv_scan_routine);
+    ret->scan_request = NULL;
+    ret->scan_aborted = false;
+    for (i = 0; i < NUM_NL80211_BANDS; i++) {
+        INIT_DELAYED_WORK(&ret->scan_bands[i].work, wifi_drv_scan_band_routine);
+        ret->scan_bands[i].wifi_drv = ret;
+        ret->scan_bands[i].band = i;
+        ret->scan_bands[i].idx = 0;
+    }
+    ret->scan_bands_active = 0;
+    INIT_DELAYED_WORK(&ret->ws_sched_scan, wifi_drv_sched_scan_routine);
+    ret->sched_scan_request = NULL;
+    ret->sched_scan_plan = 0;
+    ret->sched_scan_iter = 0;
+    ret->sched_scan_cycles = 0;
+    ret->sched_scan_notified = 0;
+    ret->sched_scan_matched = 0;
+    ret->sched_scan_filtered = 0;
+    ret->test = NULL;
+    mutex_init(&ret->ap_lock);
+    ret->ap_mode_enabled = false;
+    RCU_INIT_POINTER(ret->fw, NULL);
+    atomic_set(&ret->fw_seq, 0);
+    ret->fw_scan_seq = 0;
+    ret->fw_connect_pending = false;
+    ret->fw_disconnect_pending = false;
+    INIT_WORK(&ret->ws_fw_detached, wifi_drv_fw_detached_routine);
+    mutex_init(&ret->bench_lock);
+    memset(ret->bench, 0, sizeof(ret->bench));
+
     /* allocate wifi context, also it possible just to use wifi_new() function.
      * wifi should represent physical FullMAC wireless device.
      * One wifi can have serveral network interfaces - for that u need to implement add_virtual_intf() and co. from cfg80211_ops. */
-    ret->wifi = wifi_new_nm(&nvf_cfg_ops, sizeof(struct wifi_drv_wifi_priv_context), WIFI_NAME);
+    /* the first one keeps the plain name, others are "wifi_drv1", "wifi_drv2"... */
+    if (idx == 0) {
+        strscpy(name, WIFI_NAME, sizeof(name));
+    } else {
+        snprintf(name, sizeof(name), WIFI_NAME "%u", idx);
+    }
+    ret->wifi = wifi_new_nm(&nvf_cfg_ops, sizeof(struct wifi_drv_wifi_priv_context), name);
     if (ret->wifi == NULL) {
         goto l_error_wifi;
     }
@@ -448,20 +5113,57 @@ static struct wifi_drv_context *wifi_drv_create_context(void) {
     wifi_data = wifi_get_wifi_drv_context(ret->wifi);
     wifi_data->wifi_drv = ret;
 
+    /* ordered per radio, so connect/disconnect of this wifi complete in order they were requested, see wq. */
+    ret->wq = alloc_ordered_workqueue("%s", 0, wifi_name(ret->wifi));
+    if (ret->wq == NULL) {
+        goto l_error_wq;
+    }
+
     /* set device object as wifi "parent", I dont have any device yet. */
     /* set_wifi_dev(ret->wifi, dev); */
 
     /* wifi should determinate it type */
     /* add other required types like  "BIT(NL80211_IFTYPE_STATION) | BIT(NL80211_IFTYPE_AP)" etc. */
     ret->wifi->interface_modes = BIT(NL80211_IFTYPE_STATION) | BIT(NL80211_IFTYPE_AP);
+    ret->wifi->iface_combinations = wifi_drv_iface_combinations;
+    ret->wifi->n_iface_combinations = ARRAY_SIZE(wifi_drv_iface_combinations);
 
     /* wifi should have at least 1 band. */
-    /* fill also NL80211_BAND_5GHZ if required, in this small example I use only 1 band with 1 "channel" */
-    ret->wifi->bands[NL80211_BAND_2GHZ] = &nf_band_2ghz;
+    /* dual-band radio: 2ghz and 5ghz with DFS channels, scan walks them concurrently(see wifi_drv_scan_start_bands()) */
+    for (i = 0; i < NUM_NL80211_BANDS; i++) {
+        ret->wifi->bands[i] = g_bands[i];
+    }
+
+    /* signal of the reported BSSes is in mBm */
+    ret->wifi->signal_type = CFG80211_SIGNAL_TYPE_MBM;
 
     /* scan - if ur device supports "scan" u need to define max_scan_ssids at least. */
     ret->wifi->max_scan_ssids = 69;
 
+    /* scan flags that choose between concurrent and serial walk of the bands */
+    wifi_ext_feature_set(ret->wifi, NL80211_EXT_FEATURE_LOW_SPAN_SCAN);
+    wifi_ext_feature_set(ret->wifi, NL80211_EXT_FEATURE_LOW_POWER_SCAN);
+
+    /* connect resolves BSS in the driver's index and roams by itself, see wifi_drv_roam() */
+    ret->wifi->flags |= WIPHY_FLAG_SUPPORTS_FW_ROAM;
+    ret->wifi->max_num_pmkids = WIFI_DRV_MAX_PMKIDS;
+
+    /* scheduled scan with match sets and scan plans, see nvf_sched_scan_start() */
+    ret->wifi->max_sched_scan_reqs = 1;
+    ret->wifi->max_sched_scan_ssids = WIFI_DRV_SCHED_SCAN_SSIDS;
+    ret->wifi->max_match_sets = WIFI_DRV_SCHED_SCAN_MATCH_SETS;
+    ret->wifi->max_sched_scan_plans = WIFI_DRV_SCHED_SCAN_PLANS;
+    ret->wifi->max_sched_scan_plan_interval = WIFI_DRV_SCHED_SCAN_MAX_INTERVAL;
+    ret->wifi->max_sched_scan_plan_iterations = WIFI_DRV_SCHED_SCAN_MAX_ITERATIONS;
+
+    /* allocate network device context with wireless_dev and datapath. It is allocated before wifi registration,
+     * add_virtual_intf() and connect() may come right after it and look at ndev.
+     * It is registered by wifi_drv_create_radios() together with network devices of other radios. */
+    ret->ndev = wifi_drv_alloc_ndev(ret, NDEV_NAME, NET_NAME_ENUM, NL80211_IFTYPE_STATION);
+    if (ret->ndev == NULL) {
+        goto l_error_alloc_ndev;
+    }
+
     /* register wifi, if everything ok - there should be another wireless device in system.
      * use command:
      *     $ iw list
@@ -472,96 +5174,427 @@ static struct wifi_drv_context *wifi_drv_create_context(void) {
         goto l_error_wifi_register;
     }
 
-    /* allocate network device context. */
-    ret->ndev = alloc_netdev(sizeof(*ndev_data), NDEV_NAME, NET_NAME_ENUM, ether_setup);
-    if (ret->ndev == NULL) {
-        goto l_error_alloc_ndev;
-    }
-    /* fill private data of network context.*/
-    ndev_data = ndev_get_wifi_drv_context(ret->ndev);
-    ndev_data->wifi_drv = ret;
-
-    /* fill wireless_dev context.
-     * wireless_dev with net_device can be represented as inherited class of single net_device. */
-    ndev_data->wdev.wifi = ret->wifi;
-    ndev_data->wdev.netdev = ret->ndev;
-    ndev_data->wdev.iftype = NL80211_IFTYPE_STATION;
-    ret->ndev->ieee80211_ptr = &ndev_data->wdev;
-
     /* set device object for net_device */
     /* SET_NETDEV_DEV(ret->ndev, wifi_dev(ret->wifi)); */
 
-    /* set network device hooks. It should implement ndo_start_xmit() at least. */
-    ret->ndev->netdev_ops = &nvf_ndev_ops;
-
     /* Add here proper net_device initialization. */
 
-    /* register network device. If everything ok, there should be new network device:
-     *     $ ip a
-     *     ...
-     *     4: wifi_drv0: <BROADCAST,MULTICAST> mtu 1500 qdisc noop state DOWN group default qlen 1000
-     *         link/ether 00:00:00:00:00:00 brd ff:ff:ff:ff:ff:ff
-     *     ...
-     * */
-    if (register_netdev(ret->ndev)) {
-        goto l_error_ndev_register;
-    }
+    /* per-radio memory usage, see also "radios" file in the driver's debugfs directory:
+     *     $ cat /sys/kernel/debug/ieee80211/wifi_drv/footprint */
+    debugfs_create_file("footprint", 0444, ret->wifi->debugfsdir, ret, &wifi_drv_footprint_fops);
+    /* $ cat /sys/kernel/debug/ieee80211/wifi_drv/page_pool */
+    debugfs_create_file("page_pool", 0444, ret->wifi->debugfsdir, ret, &wifi_drv_page_pool_fops);
+    debugfs_create_file("xdp", 0444, ret->wifi->debugfsdir, ret, &wifi_drv_xdp_fops);
+    debugfs_create_file("fw", 0444, ret->wifi->debugfsdir, ret, &wifi_drv_fw_fops);
+    debugfs_create_file("airtime", 0444, ret->wifi->debugfsdir, ret, &wifi_drv_airtime_fops);
+    debugfs_create_file("ampdu", 0444, ret->wifi->debugfsdir, ret, &wifi_drv_ampdu_fops);
+    debugfs_create_file("sched_scan", 0444, ret->wifi->debugfsdir, ret, &wifi_drv_sched_scan_fops);
+    debugfs_create_file("conn", 0444, ret->wifi->debugfsdir, ret, &wifi_drv_conn_fops);
+    debugfs_create_file("roam", 0200, ret->wifi->debugfsdir, ret, &wifi_drv_roam_fops);
+    debugfs_create_file("bench", 0600, ret->wifi->debugfsdir, ret, &wifi_drv_bench_fops);
+    debugfs_create_file("ifaces", 0444, ret->wifi->debugfsdir, ret, &wifi_drv_ifaces_fops);
 
     return ret;
-    l_error_ndev_register:
-    free_netdev(ret->ndev);
-    l_error_alloc_ndev:
-    wifi_unregister(ret->wifi);
     l_error_wifi_register:
+    wifi_drv_free_ndev(ret->ndev);
+    l_error_alloc_ndev:
+    destroy_workqueue(ret->wq);
+    l_error_wq:
     wifi_free(ret->wifi);
     l_error_wifi:
+    rhashtable_destroy(&ret->ifaces_by_wdev);
+    l_error_ifaces_by_wdev:
+    rhashtable_destroy(&ret->ifaces_by_ifindex);
+    l_error_ifaces_by_ifindex:
+    rhltable_destroy(&ret->bss_by_ssid);
+    l_error_bss_by_ssid:
+    rhashtable_destroy(&ret->bss_by_bssid);
+    l_error_bss_by_bssid:
     kfree(ret);
     l_error:
     return NULL;
 }
 
+/* Frees the context, its network devices should be already unregistered, see wifi_drv_destroy_radios(). */
 static void wifi_drv_free(struct wifi_drv_context *ctx) {
+    unsigned int i;
+
     if (ctx == NULL) {
         return;
     }
 
-    unregister_netdev(ctx->ndev);
-    free_netdev(ctx->ndev);
     wifi_unregister(ctx->wifi);
+
+    /* the kernel would not call cfg80211_ops anymore, make sure that no work is queued.
+     * Routines use ctx->ndev, so it is freed only after that. */
+    cancel_work_sync(&ctx->ws_connect);
+    cancel_work_sync(&ctx->ws_disconnect);
+    cancel_delayed_work_sync(&ctx->ws_scan);
+    for (i = 0; i < NUM_NL80211_BANDS; i++) {
+        cancel_delayed_work_sync(&ctx->scan_bands[i].work);
+    }
+    cancel_delayed_work_sync(&ctx->ws_sched_scan);
+    cancel_work_sync(&ctx->ws_roam);
+    cancel_delayed_work_sync(&ctx->ws_assoc);
+    cancel_work_sync(&ctx->ws_fw_detached);
+    destroy_workqueue(ctx->wq);
+
+    /* every entry is in both tables, it is freed once */
+    rhltable_destroy(&ctx->bss_by_ssid);
+    rhashtable_free_and_destroy(&ctx->bss_by_bssid, wifi_drv_bss_idx_free, NULL);
+
+    /* wifi_drv_destroy_radios() has emptied the registry, interfaces but the primary one are freed by the core */
+    rhashtable_destroy(&ctx->ifaces_by_wdev);
+    rhashtable_destroy(&ctx->ifaces_by_ifindex);
+    wifi_drv_free_ndev(ctx->ndev);
     wifi_free(ctx->wifi);
+    mutex_destroy(&ctx->ap_lock);
+    mutex_destroy(&ctx->bench_lock);
     kfree(ctx);
 }
 
-static struct wifi_drv_context *g_ctx = NULL;
+/* Tears down "n" radios. Network devices of all of them, hundreds of virtual interfaces included, are unregistered
+ * in one batch, so there is one rtnl_lock and one RCU grace period instead of a few per interface. */
+static void wifi_drv_destroy_radios(struct wifi_drv_context **ctxs, unsigned int n) {
+    LIST_HEAD(unreg_list);
+    unsigned int i;
+
+    rtnl_lock();
+    for (i = 0; i < n; i++) {
+        struct wifi_drv_iface *iface, *tmp;
+
+        /* interfaces created through add_virtual_intf() are not owned by the kernel, they should be removed
+         * before wifi unregister. The core frees them, see wifi_drv_ndev_destructor(). */
+        RCU_INIT_POINTER(ctxs[i]->ap_ndev, NULL);
+        list_for_each_entry_safe(iface, tmp, &ctxs[i]->ifaces, list) {
+            if (iface->ndev != ctxs[i]->ndev) {
+                unregister_netdevice_queue(iface->ndev, &unreg_list);
+            }
+            wifi_drv_iface_del(ctxs[i], iface);
+        }
+        if (ctxs[i]->ndev->reg_state == NETREG_REGISTERED) {
+            unregister_netdevice_queue(ctxs[i]->ndev, &unreg_list);
+        }
+    }
+    /* closes devices, so datapath does not touch them anymore, and waits for RCU readers once for all of them */
+    unregister_netdevice_many(&unreg_list);
+    rtnl_unlock();
+
+    for (i = 0; i < n; i++) {
+        wifi_drv_free(ctxs[i]);
+    }
+}
+
+/* Creates "n" radios. Network devices are registered in one batch under a single rtnl_lock. */
+static int wifi_drv_create_radios(struct wifi_drv_context **ctxs, unsigned int n) {
+    unsigned int created, i;
+    int err = 0;
+
+    for (created = 0; created < n; created++) {
+        ctxs[created] = wifi_drv_create_context(created);
+        if (ctxs[created] == NULL) {
+            err = -ENOMEM;
+            goto l_error;
+        }
+    }
+
+    /* register network devices. If everything ok, there should be new network devices:
+     *     $ ip a
+     *     ...
+     *     4: wifi_drv0: <BROADCAST,MULTICAST> mtu 1500 qdisc noop state DOWN group default qlen 1000
+     *         link/ether 00:00:00:00:00:00 brd ff:ff:ff:ff:ff:ff
+     *     ...
+     * */
+    rtnl_lock();
+    for (i = 0; i < n && err == 0; i++) {
+        err = register_netdevice(ctxs[i]->ndev);
+        if (err == 0) {
+            err = wifi_drv_iface_add(ctxs[i], ctxs[i]->ndev);
+        }
+    }
+    rtnl_unlock();
+    if (err) {
+        goto l_error;
+    }
+
+    return 0;
+    l_error:
+    wifi_drv_destroy_radios(ctxs, created);
+    return err;
+}
+
+static struct wifi_drv_context **g_ctxs = NULL;
+static unsigned int g_num_ctxs = 0;
+static u64 g_bringup_ns = 0;
+static struct dentry *g_debugfs_root = NULL;
+
+/* $ cat /sys/kernel/debug/wifi_drv/radios */
+static int wifi_drv_radios_show(struct seq_file *seq, void *v) {
+    unsigned int i;
+
+    seq_printf(seq, "radios: %u\n", g_num_ctxs);
+    seq_printf(seq, "bringup_us: %llu\n", div_u64(g_bringup_ns, NSEC_PER_USEC));
+    seq_puts(seq, "wifi footprint_bytes\n");
+    for (i = 0; i < g_num_ctxs; i++) {
+        seq_printf(seq, "%s %zu\n", wifi_name(g_ctxs[i]->wifi), wifi_drv_footprint(g_ctxs[i]));
+    }
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(wifi_drv_radios);
+
+/* $ cat /sys/kernel/debug/wifi_drv/medium */
+static int wifi_drv_medium_show(struct seq_file *seq, void *v) {
+    u64 queued = 0, delivered = 0, lost = 0, overflow = 0;
+    int cpu;
+
+    for_each_possible_cpu(cpu) {
+        const struct wifi_drv_wheel *wheel = per_cpu_ptr(g_medium.wheels, cpu);
+
+        queued += READ_ONCE(wheel->queued);
+        delivered += READ_ONCE(wheel->delivered);
+        lost += READ_ONCE(wheel->lost);
+        overflow += READ_ONCE(wheel->overflow);
+    }
+    seq_printf(seq, "queued: %llu\ndelivered: %llu\nlost: %llu\noverflow: %llu\n", queued, delivered, lost, overflow);
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(wifi_drv_medium);
+
+/* $ cat /sys/kernel/debug/wifi_drv/latency
+ * Every line is "<operation> <bucket upper bound, ns> <count>", empty buckets are skipped. */
+static int wifi_drv_latency_show(struct seq_file *seq, void *v) {
+    unsigned int op, bucket;
+    int cpu;
+
+    seq_puts(seq, "op le_ns count\n");
+    for (op = 0; op < WIFI_DRV_OP_MAX; op++) {
+        for (bucket = 0; bucket < WIFI_DRV_HIST_BUCKETS; bucket++) {
+            u64 count = 0;
+
+            for_each_possible_cpu(cpu) {
+                count += READ_ONCE(per_cpu_ptr(&g_op_hist, cpu)->count[op][bucket]);
+            }
+            if (count == 0) {
+                continue;
+            }
+            if (bucket == WIFI_DRV_HIST_BUCKETS - 1) {
+                seq_printf(seq, "%s inf %llu\n", wifi_drv_op_names[op], count);
+            } else {
+                seq_printf(seq, "%s %llu %llu\n", wifi_drv_op_names[op], (1ULL << bucket) - 1, count);
+            }
+        }
+    }
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(wifi_drv_latency);
+
+/* Firmware emulation device, see wifi_drv_fw.h */
+static DEFINE_MUTEX(g_fw_lock); /* attaches and detaches firmware */
+
+static int wifi_drv_fw_dev_open(struct inode *inode, struct file *file) {
+    struct wifi_drv_fw *fw = kzalloc(sizeof(*fw), GFP_KERNEL);
+
+    if (fw == NULL) {
+        return -ENOMEM;
+    }
+    fw->shm = vmalloc_user(sizeof(*fw->shm));
+    if (fw->shm == NULL) {
+        kfree(fw);
+        return -ENOMEM;
+    }
+    /* driver is idle until the first doorbell */
+    fw->shm->evt.need_wakeup = 1;
+    spin_lock_init(&fw->cmd_lock);
+    INIT_WORK(&fw->ws_events, wifi_drv_fw_events_routine);
+
+    file->private_data = fw;
+    return 0;
+}
+
+static int wifi_drv_fw_attach(struct wifi_drv_fw *fw, const struct wifi_drv_fw_attach __user *uarg) {
+    struct wifi_drv_fw_attach arg;
+    struct wifi_drv_context *ctx;
+    struct eventfd_ctx *efd;
+    int err = 0;
+
+    if (copy_from_user(&arg, uarg, sizeof(arg))) {
+        return -EFAULT;
+    }
+    if (arg.radio >= g_num_ctxs) {
+        return -ENODEV;
+    }
+    ctx = g_ctxs[arg.radio];
+    efd = eventfd_ctx_fdget(arg.cmd_eventfd);
+    if (IS_ERR(efd)) {
+        return PTR_ERR(efd);
+    }
+
+    mutex_lock(&g_fw_lock);
+    if (fw->wifi_drv != NULL || rcu_access_pointer(ctx->fw) != NULL) {
+        err = -EBUSY;
+    } else {
+        fw->cmd_efd = efd;
+        WRITE_ONCE(fw->wifi_drv, ctx);
+        rcu_assign_pointer(ctx->fw, fw);
+    }
+    mutex_unlock(&g_fw_lock);
+
+    if (err) {
+        eventfd_ctx_put(efd);
+    }
+    return err;
+}
+
+static long wifi_drv_fw_dev_ioctl(struct file *file, unsigned int cmd, unsigned long arg) {
+    struct wifi_drv_fw *fw = file->private_data;
+    struct wifi_drv_context *ctx;
+
+    switch (cmd) {
+    case WIFI_DRV_FW_IOC_ATTACH:
+        return wifi_drv_fw_attach(fw, (const struct wifi_drv_fw_attach __user *) arg);
+    case WIFI_DRV_FW_IOC_DOORBELL:
+        ctx = READ_ONCE(fw->wifi_drv);
+        if (ctx == NULL) {
+            return -ENOTCONN;
+        }
+        /* events of many doorbells are drained by one run of the routine */
+        queue_work(ctx->wq, &fw->ws_events);
+        return 0;
+    default:
+        return -ENOTTY;
+    }
+}
+
+static int wifi_drv_fw_dev_mmap(struct file *file, struct vm_area_struct *vma) {
+    struct wifi_drv_fw *fw = file->private_data;
+
+    return remap_vmalloc_range(vma, fw->shm, vma->vm_pgoff);
+}
+
+/* Last reference of the file is gone(shm is not mapped anymore), firmware is detached. */
+static int wifi_drv_fw_dev_release(struct inode *inode, struct file *file) {
+    struct wifi_drv_fw *fw = file->private_data;
+    struct wifi_drv_context *ctx = fw->wifi_drv;
+
+    if (ctx != NULL) {
+        mutex_lock(&g_fw_lock);
+        RCU_INIT_POINTER(ctx->fw, NULL);
+        mutex_unlock(&g_fw_lock);
+
+        /* nobody posts commands after that, events that were not consumed yet are dropped */
+        synchronize_rcu();
+        cancel_work_sync(&fw->ws_events);
+
+        /* on the workqueue, after routines that could have passed operations to the firmware */
+        queue_work(ctx->wq, &ctx->ws_fw_detached);
+        flush_work(&ctx->ws_fw_detached);
+        eventfd_ctx_put(fw->cmd_efd);
+    }
+    vfree(fw->shm);
+    kfree(fw);
+    return 0;
+}
+
+static const struct file_operations wifi_drv_fw_dev_fops = {
+        .owner = THIS_MODULE,
+        .open = wifi_drv_fw_dev_open,
+        .release = wifi_drv_fw_dev_release,
+        .unlocked_ioctl = wifi_drv_fw_dev_ioctl,
+        .mmap = wifi_drv_fw_dev_mmap,
+};
+
+static struct miscdevice g_fw_miscdev = {
+        .minor = MISC_DYNAMIC_MINOR,
+        .name = "wifi_drv_fw",
+        .fops = &wifi_drv_fw_dev_fops,
+        .mode = 0600,
+};
 
 static int __init virtual_wifi_init(void) {
-    g_ctx = wifi_drv_create_context();
+    unsigned int n = clamp_t(unsigned int, radios, 1, WIFI_DRV_MAX_RADIOS);
+    u64 start;
+    int err;
+
+    if (wifi_drv_build_bss_population(&g_bss_population, g_bands, bss_count)) {
+        return -ENOMEM;
+    }
 
-    if (g_ctx != NULL) {
-        /*DEMO*/
-        sema_init(&g_ctx->sem, 1);
-        INIT_WORK(&g_ctx->ws_connect, wifi_drv_connect_routine);
-        g_ctx->connecting_ssid[0] = 0;
-        INIT_WORK(&g_ctx->ws_disconnect, wifi_drv_disconnect_routine);
-        g_ctx->disconnect_reason_code = 0;
-        INIT_WORK(&g_ctx->ws_scan, wifi_drv_scan_routine);
-        g_ctx->scan_request = NULL;
+    g_iface_cache = KMEM_CACHE(wifi_drv_iface, 0);
+    if (g_iface_cache == NULL) {
+        err = -ENOMEM;
+        goto l_error_iface_cache;
     }
-    return g_ctx == NULL;
+
+    if (medium) {
+        err = wifi_drv_medium_init(&g_medium);
+        if (err) {
+            goto l_error;
+        }
+    }
+
+    g_ctxs = kcalloc(n, sizeof(*g_ctxs), GFP_KERNEL);
+    if (g_ctxs == NULL) {
+        err = -ENOMEM;
+        goto l_error_ctxs;
+    }
+
+    start = ktime_get_ns();
+    err = wifi_drv_create_radios(g_ctxs, n);
+    if (err) {
+        goto l_error_radios;
+    }
+    g_bringup_ns = ktime_get_ns() - start;
+    g_num_ctxs = n;
+
+    /* firmware emulation, radios should exist already: the firmware attaches right after open() */
+    err = misc_register(&g_fw_miscdev);
+    if (err) {
+        goto l_error_misc;
+    }
+
+    g_debugfs_root = debugfs_create_dir(WIFI_NAME, NULL);
+    debugfs_create_file("radios", 0444, g_debugfs_root, NULL, &wifi_drv_radios_fops);
+    debugfs_create_file("latency", 0444, g_debugfs_root, NULL, &wifi_drv_latency_fops);
+    if (medium) {
+        debugfs_create_file("medium", 0444, g_debugfs_root, NULL, &wifi_drv_medium_fops);
+    }
+
+    return 0;
+    l_error_misc:
+    wifi_drv_destroy_radios(g_ctxs, n);
+    l_error_radios:
+    kfree(g_ctxs);
+    l_error_ctxs:
+    wifi_drv_medium_free(&g_medium);
+    l_error:
+    /* registry entries of destroyed radios are freed after the grace period */
+    rcu_barrier();
+    kmem_cache_destroy(g_iface_cache);
+    l_error_iface_cache:
+    wifi_drv_free_bss_population(&g_bss_population);
+    return err;
 }
 
 static void __exit virtual_wifi_exit(void) {
-    /* make sure that no work is queued */
-    cancel_work_sync(&g_ctx->ws_connect);
-    cancel_work_sync(&g_ctx->ws_disconnect);
-    cancel_work_sync(&g_ctx->ws_scan);
-
-    wifi_drv_free(g_ctx);
+    /* no firmware is attached, open files of the device hold the module */
+    misc_deregister(&g_fw_miscdev);
+    debugfs_remove_recursive(g_debugfs_root);
+    wifi_drv_destroy_radios(g_ctxs, g_num_ctxs);
+    /* wait for stations removed by wifi_drv_sta_unlink() and for interface registry entries */
+    rcu_barrier();
+    kmem_cache_destroy(g_iface_cache);
+    kfree(g_ctxs);
+    wifi_drv_medium_free(&g_medium);
+    wifi_drv_free_bss_population(&g_bss_population);
 }
 
 module_init(virtual_wifi_init);
 module_exit(virtual_wifi_exit);
 
+#if IS_ENABLED(CONFIG_KUNIT)
+#include "wifi_test.c"
+#endif
+
 MODULE_LICENSE("GPL v2");
 
 MODULE_DESCRIPTION("Example for cfg80211(aka FullMAC) driver."
@@ -0,0 +1,104 @@
+#ifndef _WIFI_DRV_FW_H
+#define _WIFI_DRV_FW_H
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+/* Firmware emulation interface of wifi_drv, shared by the driver and userspace "firmware".
+ * Firmware opens /dev/wifi_drv_fw, attaches to the radio with WIFI_DRV_FW_IOC_ATTACH and mmaps struct wifi_drv_fw_shm.
+ * Driver posts commands to the cmd ring, firmware answers with events in the evt ring.
+ *
+ * Every ring has one producer and one consumer: producer writes the entry and then publishes head,
+ * consumer reads entries up to head and then publishes tail. Indexes are free running, entry is [index % ENTRIES].
+ * Doorbells are batched: consumer that is going to sleep sets need_wakeup, issues a full barrier and checks the ring again,
+ * producer rings the doorbell after publishing head only if need_wakeup is set:
+ *  - driver -> firmware: eventfd passed in WIFI_DRV_FW_IOC_ATTACH is signalled,
+ *  - firmware -> driver: ioctl WIFI_DRV_FW_IOC_DOORBELL. */
+
+#define WIFI_DRV_FW_DEV "/dev/wifi_drv_fw"
+#define WIFI_DRV_FW_RING_ENTRIES 256 /* power of 2 */
+#define WIFI_DRV_FW_MAX_SCAN_FREQS 64
+#define WIFI_DRV_FW_SSID_MAX 32
+
+enum wifi_drv_fw_cmd_type {
+    WIFI_DRV_FW_CMD_SCAN = 1,
+    WIFI_DRV_FW_CMD_SCAN_ABORT,
+    WIFI_DRV_FW_CMD_CONNECT,
+    WIFI_DRV_FW_CMD_DISCONNECT,
+    WIFI_DRV_FW_CMD_START_AP,
+    WIFI_DRV_FW_CMD_STOP_AP,
+};
+
+enum wifi_drv_fw_evt_type {
+    WIFI_DRV_FW_EVT_SCAN_RESULT = 1, /* BSS found by the scan "seq" */
+    WIFI_DRV_FW_EVT_SCAN_DONE,       /* status: 0 - completed, 1 - aborted */
+    WIFI_DRV_FW_EVT_CONNECT_RESULT,  /* status: WLAN_STATUS_*, 0 - success */
+    WIFI_DRV_FW_EVT_DEAUTH,          /* answer to WIFI_DRV_FW_CMD_DISCONNECT or unsolicited(seq 0) */
+    WIFI_DRV_FW_EVT_AP_RESULT,       /* answer to WIFI_DRV_FW_CMD_START_AP/WIFI_DRV_FW_CMD_STOP_AP */
+};
+
+struct wifi_drv_fw_cmd {
+    __u32 seq;
+    __u16 type;
+    __u16 reserved;
+    __u64 ts_ns; /* CLOCK_MONOTONIC time the command was posted */
+    union {
+        struct {
+            __u32 n_freqs;
+            __u16 freqs[WIFI_DRV_FW_MAX_SCAN_FREQS]; /* MHz */
+        } scan;
+        struct {
+            __u8 ssid_len;
+            __u8 ssid[WIFI_DRV_FW_SSID_MAX];
+        } connect;
+        struct {
+            __u16 reason_code;
+        } disconnect;
+    };
+};
+
+struct wifi_drv_fw_evt {
+    __u32 seq; /* seq of the command the event answers */
+    __u16 type;
+    __u16 status;
+    __u64 cmd_ts_ns; /* ts_ns of the command the event answers, round trip latency is measured with it */
+    union {
+        struct {
+            __u8 bssid[6];
+            __u16 freq; /* MHz */
+            __s32 signal; /* mBm */
+            __u8 ssid_len;
+            __u8 ssid[WIFI_DRV_FW_SSID_MAX];
+        } scan_result;
+        struct {
+            __u8 bssid[6];
+        } connect_result;
+        struct {
+            __u16 reason_code;
+        } deauth;
+    };
+};
+
+struct wifi_drv_fw_ring {
+    __u32 head __attribute__((aligned(64))); /* written by producer */
+    __u32 tail __attribute__((aligned(64))); /* written by consumer */
+    __u32 need_wakeup;                       /* written by consumer */
+} __attribute__((aligned(64)));
+
+/* Layout of the memory mapped from offset 0 of /dev/wifi_drv_fw */
+struct wifi_drv_fw_shm {
+    struct wifi_drv_fw_ring cmd;
+    struct wifi_drv_fw_ring evt;
+    struct wifi_drv_fw_cmd cmds[WIFI_DRV_FW_RING_ENTRIES];
+    struct wifi_drv_fw_evt evts[WIFI_DRV_FW_RING_ENTRIES];
+};
+
+struct wifi_drv_fw_attach {
+    __u32 radio; /* index of the radio, 0 - "wifi_drv", N - "wifi_drvN" */
+    __s32 cmd_eventfd;
+};
+
+#define WIFI_DRV_FW_IOC_ATTACH _IOW('W', 1, struct wifi_drv_fw_attach)
+#define WIFI_DRV_FW_IOC_DOORBELL _IO('W', 2)
+
+#endif /* _WIFI_DRV_FW_H */
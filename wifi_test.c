@@ -0,0 +1,501 @@
+/* KUnit suite of the driver's state machines, it is a part of wifi.c(included at its end) when the kernel has
+ * CONFIG_KUNIT, so static functions are reachable. Every test creates its own radio and calls its cfg80211_ops
+ * directly like the kernel does. What the radio reports to the kernel is recorded by wifi_drv_test_report() instead,
+ * so every request can be checked to end with exactly one report, eg. the connect is not left hanging.
+ * Suites of a module run when it is loaded:
+ *     $ insmod wifi.ko
+ *     $ cat /sys/kernel/debug/kunit/wifi_drv/results
+ * Under UML or QEMU build the kernel with CONFIG_KUNIT, CONFIG_CFG80211 and CONFIG_KUNIT_DEBUGFS, then load the module. */
+
+#include <kunit/test.h>
+
+/* every operation of the tests ends in a few dwells or association times */
+#define WIFI_DRV_TEST_TIMEOUT (5 * HZ)
+
+/* BSSID that is not in any index */
+static const u8 wifi_drv_test_unknown_bssid[ETH_ALEN] = {0x02, 0x11, 0x22, 0x33, 0x44, 0x55};
+
+/* Recorder of the reports of the test radio */
+struct wifi_drv_test {
+    struct wifi_drv_context *wifi_drv;
+    wait_queue_head_t wait;
+    spinlock_t lock;
+    unsigned int reports[WIFI_DRV_REPORT_MAX];
+    u8 bssid[ETH_ALEN]; /* of the last connect or roam */
+};
+
+/* Records the report if the radio belongs to a test, returns false for radios of the module. Called on the workqueue. */
+static bool wifi_drv_test_report(struct wifi_drv_context *wifi_drv, enum wifi_drv_report report, const u8 *bssid) {
+    struct wifi_drv_test *t = wifi_drv->test;
+
+    if (t == NULL) {
+        return false;
+    }
+    spin_lock_bh(&t->lock);
+    t->reports[report]++;
+    if (bssid != NULL) {
+        ether_addr_copy(t->bssid, bssid);
+    }
+    spin_unlock_bh(&t->lock);
+    wake_up(&t->wait);
+    return true;
+}
+
+static unsigned int wifi_drv_test_count(struct wifi_drv_test *t, enum wifi_drv_report report) {
+    unsigned int n;
+
+    spin_lock_bh(&t->lock);
+    n = t->reports[report];
+    spin_unlock_bh(&t->lock);
+    return n;
+}
+
+/* Reports of all kinds made so far */
+static unsigned int wifi_drv_test_total(struct wifi_drv_test *t) {
+    unsigned int i, n = 0;
+
+    for (i = 0; i < WIFI_DRV_REPORT_MAX; i++) {
+        n += wifi_drv_test_count(t, i);
+    }
+    return n;
+}
+
+/* Waits till "report" has been made "n" times, returns false on timeout. */
+static bool wifi_drv_test_wait(struct wifi_drv_test *t, enum wifi_drv_report report, unsigned int n) {
+    return wait_event_timeout(t->wait, wifi_drv_test_count(t, report) >= n, WIFI_DRV_TEST_TIMEOUT) != 0;
+}
+
+/* Runs work queued on the radio so far, delayed work that is not due yet(dwells, association) stays pending. */
+static void wifi_drv_test_flush(struct wifi_drv_test *t) {
+    flush_workqueue(t->wifi_drv->wq);
+}
+
+/* Scan request of the first "n" channels of every band, freed with the test */
+static struct cfg80211_scan_request *wifi_drv_test_scan_request(struct kunit *test, struct wifi_drv_test *t,
+                                                                unsigned int n) {
+    struct cfg80211_scan_request *request;
+    struct ieee80211_supported_band *band;
+    unsigned int b, i;
+
+    request = kunit_kzalloc(test, struct_size(request, channels, n * NUM_NL80211_BANDS), GFP_KERNEL);
+    KUNIT_ASSERT_NOT_NULL(test, request);
+    for (b = 0; b < NUM_NL80211_BANDS; b++) {
+        band = t->wifi_drv->wifi->bands[b];
+        for (i = 0; band != NULL && i < min(n, band->n_channels); i++) {
+            request->channels[request->n_channels++] = &band->channels[i];
+        }
+    }
+    return request;
+}
+
+/* Connect to the dummy network, "bssid"/"bssid_hint"/"prev_bssid" are set by the test */
+static void wifi_drv_test_sme(struct cfg80211_connect_params *sme, const char *ssid) {
+    memset(sme, 0, sizeof(*sme));
+    sme->ssid = (const u8 *) ssid;
+    sme->ssid_len = strlen(ssid);
+    sme->auth_type = NL80211_AUTHTYPE_OPEN_SYSTEM;
+}
+
+/* Connects to the dummy network and waits for the result */
+static void wifi_drv_test_connect(struct kunit *test, struct wifi_drv_test *t) {
+    struct cfg80211_connect_params sme;
+    unsigned int n = wifi_drv_test_count(t, WIFI_DRV_REPORT_CONNECT);
+
+    wifi_drv_test_sme(&sme, SSID_DUMMY);
+    KUNIT_ASSERT_EQ(test, nvf_connect(t->wifi_drv->wifi, t->wifi_drv->ndev, &sme), 0);
+    KUNIT_ASSERT_TRUE(test, wifi_drv_test_wait(t, WIFI_DRV_REPORT_CONNECT, n + 1));
+    wifi_drv_test_flush(t);
+    KUNIT_ASSERT_TRUE(test, t->wifi_drv->connected);
+}
+
+static int wifi_drv_test_init(struct kunit *test) {
+    struct wifi_drv_test *t;
+
+    /* the BSS population and the registry cache are built by module init, it has run before the suite */
+    if (g_iface_cache == NULL) {
+        kunit_skip(test, "module is not initialized");
+    }
+
+    t = kunit_kzalloc(test, sizeof(*t), GFP_KERNEL);
+    KUNIT_ASSERT_NOT_NULL(test, t);
+    init_waitqueue_head(&t->wait);
+    spin_lock_init(&t->lock);
+
+    KUNIT_ASSERT_EQ(test, wifi_drv_create_radios(&t->wifi_drv, 1), 0);
+    t->wifi_drv->test = t;
+    test->priv = t;
+    return 0;
+}
+
+static void wifi_drv_test_exit(struct kunit *test) {
+    struct wifi_drv_test *t = test->priv;
+
+    if (t != NULL) {
+        wifi_drv_destroy_radios(&t->wifi_drv, 1);
+    }
+}
+
+static void wifi_drv_test_scan(struct kunit *test) {
+    struct wifi_drv_test *t = test->priv;
+    struct cfg80211_scan_request *request = wifi_drv_test_scan_request(test, t, 2);
+
+    KUNIT_ASSERT_EQ(test, nvf_scan(t->wifi_drv->wifi, request), 0);
+    KUNIT_EXPECT_PTR_EQ(test, READ_ONCE(t->wifi_drv->scan_request), request);
+
+    KUNIT_ASSERT_TRUE(test, wifi_drv_test_wait(t, WIFI_DRV_REPORT_SCAN_DONE, 1));
+    wifi_drv_test_flush(t);
+    KUNIT_EXPECT_EQ(test, wifi_drv_test_total(t), 1);
+    KUNIT_EXPECT_NULL(test, READ_ONCE(t->wifi_drv->scan_request));
+    KUNIT_EXPECT_EQ(test, t->wifi_drv->scan_bands_active, 0);
+}
+
+/* Second scan is refused while the first one runs and does not disturb it */
+static void wifi_drv_test_scan_busy(struct kunit *test) {
+    struct wifi_drv_test *t = test->priv;
+    struct cfg80211_scan_request *first = wifi_drv_test_scan_request(test, t, 2);
+    struct cfg80211_scan_request *second = wifi_drv_test_scan_request(test, t, 1);
+
+    KUNIT_ASSERT_EQ(test, nvf_scan(t->wifi_drv->wifi, first), 0);
+    KUNIT_EXPECT_EQ(test, nvf_scan(t->wifi_drv->wifi, second), -EBUSY);
+    KUNIT_EXPECT_PTR_EQ(test, READ_ONCE(t->wifi_drv->scan_request), first);
+
+    KUNIT_ASSERT_TRUE(test, wifi_drv_test_wait(t, WIFI_DRV_REPORT_SCAN_DONE, 1));
+    KUNIT_EXPECT_EQ(test, wifi_drv_test_count(t, WIFI_DRV_REPORT_SCAN_ABORTED), 0);
+
+    /* the radio is free again */
+    KUNIT_ASSERT_EQ(test, nvf_scan(t->wifi_drv->wifi, second), 0);
+    KUNIT_ASSERT_TRUE(test, wifi_drv_test_wait(t, WIFI_DRV_REPORT_SCAN_DONE, 2));
+    wifi_drv_test_flush(t);
+    KUNIT_EXPECT_EQ(test, wifi_drv_test_total(t), 2);
+}
+
+/* Aborted scan is finished right away, the next scan is not affected by the abort */
+static void wifi_drv_test_scan_abort(struct kunit *test) {
+    struct wifi_drv_test *t = test->priv;
+    struct cfg80211_scan_request *request = wifi_drv_test_scan_request(test, t, 8);
+
+    KUNIT_ASSERT_EQ(test, nvf_scan(t->wifi_drv->wifi, request), 0);
+    nvf_abort_scan(t->wifi_drv->wifi, t->wifi_drv->ndev->ieee80211_ptr);
+    KUNIT_ASSERT_TRUE(test, wifi_drv_test_wait(t, WIFI_DRV_REPORT_SCAN_ABORTED, 1));
+    wifi_drv_test_flush(t);
+    KUNIT_EXPECT_EQ(test, wifi_drv_test_count(t, WIFI_DRV_REPORT_SCAN_DONE), 0);
+    KUNIT_EXPECT_NULL(test, READ_ONCE(t->wifi_drv->scan_request));
+
+    KUNIT_ASSERT_EQ(test, nvf_scan(t->wifi_drv->wifi, request), 0);
+    KUNIT_ASSERT_TRUE(test, wifi_drv_test_wait(t, WIFI_DRV_REPORT_SCAN_DONE, 1));
+    wifi_drv_test_flush(t);
+    KUNIT_EXPECT_EQ(test, wifi_drv_test_count(t, WIFI_DRV_REPORT_SCAN_ABORTED), 1);
+}
+
+/* Abort that comes after the scan is done is ignored */
+static void wifi_drv_test_scan_abort_late(struct kunit *test) {
+    struct wifi_drv_test *t = test->priv;
+    struct cfg80211_scan_request *request = wifi_drv_test_scan_request(test, t, 1);
+
+    KUNIT_ASSERT_EQ(test, nvf_scan(t->wifi_drv->wifi, request), 0);
+    KUNIT_ASSERT_TRUE(test, wifi_drv_test_wait(t, WIFI_DRV_REPORT_SCAN_DONE, 1));
+    nvf_abort_scan(t->wifi_drv->wifi, t->wifi_drv->ndev->ieee80211_ptr);
+    wifi_drv_test_flush(t);
+    KUNIT_EXPECT_EQ(test, wifi_drv_test_total(t), 1);
+}
+
+/* Runs the scan benchmark on the workqueue of the radio like the "bench" file does */
+static int wifi_drv_test_bench_scan(struct wifi_drv_test *t, u64 n, struct wifi_drv_bench_result *res) {
+    struct wifi_drv_bench_work bw = {
+            .wifi_drv = t->wifi_drv,
+            .def = &wifi_drv_benches[WIFI_DRV_BENCH_SCAN],
+            .n = n,
+    };
+
+    INIT_WORK_ONSTACK(&bw.work, wifi_drv_bench_routine);
+    queue_work(t->wifi_drv->wq, &bw.work);
+    flush_work(&bw.work);
+    destroy_work_on_stack(&bw.work);
+    *res = bw.res;
+    return bw.err;
+}
+
+/* Scan that races with the benchmark either owns the radio or is refused, the benchmark never finishes it */
+static void wifi_drv_test_scan_bench(struct kunit *test) {
+    struct wifi_drv_test *t = test->priv;
+    struct cfg80211_scan_request *request = wifi_drv_test_scan_request(test, t, 1);
+    struct wifi_drv_bench_result res = {};
+
+    KUNIT_ASSERT_EQ(test, nvf_scan(t->wifi_drv->wifi, request), 0);
+    KUNIT_EXPECT_EQ(test, wifi_drv_test_bench_scan(t, 10, &res), -EBUSY);
+    KUNIT_EXPECT_PTR_EQ(test, READ_ONCE(t->wifi_drv->scan_request), request);
+    KUNIT_ASSERT_TRUE(test, wifi_drv_test_wait(t, WIFI_DRV_REPORT_SCAN_DONE, 1));
+
+    KUNIT_EXPECT_EQ(test, wifi_drv_test_bench_scan(t, 10, &res), 0);
+    KUNIT_EXPECT_EQ(test, res.ops, 10);
+    KUNIT_EXPECT_NULL(test, READ_ONCE(t->wifi_drv->scan_request));
+    wifi_drv_test_flush(t);
+    KUNIT_EXPECT_EQ(test, wifi_drv_test_total(t), 1);
+}
+
+static void wifi_drv_test_connect_disconnect(struct kunit *test) {
+    struct wifi_drv_test *t = test->priv;
+
+    wifi_drv_test_connect(test, t);
+    KUNIT_EXPECT_MEMEQ(test, t->bssid, g_bss_population.bss[0].bssid, ETH_ALEN);
+    KUNIT_EXPECT_MEMEQ(test, t->wifi_drv->conn_bssid, g_bss_population.bss[0].bssid, ETH_ALEN);
+
+    KUNIT_ASSERT_EQ(test, nvf_disconnect(t->wifi_drv->wifi, t->wifi_drv->ndev, WLAN_REASON_DEAUTH_LEAVING), 0);
+    KUNIT_ASSERT_TRUE(test, wifi_drv_test_wait(t, WIFI_DRV_REPORT_DISCONNECTED, 1));
+    wifi_drv_test_flush(t);
+    KUNIT_EXPECT_FALSE(test, t->wifi_drv->connected);
+    KUNIT_EXPECT_EQ(test, wifi_drv_test_total(t), 2);
+
+    /* PMKSA cached by the first connect makes the next one skip 802.1X */
+    wifi_drv_test_connect(test, t);
+    KUNIT_EXPECT_EQ(test, t->wifi_drv->conn_full, 1);
+    KUNIT_EXPECT_EQ(test, t->wifi_drv->conn_fast, 1);
+}
+
+static void wifi_drv_test_connect_unknown_ssid(struct kunit *test) {
+    struct wifi_drv_test *t = test->priv;
+    struct cfg80211_connect_params sme;
+
+    wifi_drv_test_sme(&sme, "not-there");
+    KUNIT_ASSERT_EQ(test, nvf_connect(t->wifi_drv->wifi, t->wifi_drv->ndev, &sme), 0);
+    KUNIT_ASSERT_TRUE(test, wifi_drv_test_wait(t, WIFI_DRV_REPORT_CONNECT_TIMEOUT, 1));
+    wifi_drv_test_flush(t);
+    KUNIT_EXPECT_FALSE(test, t->wifi_drv->connected);
+    KUNIT_EXPECT_EQ(test, wifi_drv_test_total(t), 1);
+    KUNIT_EXPECT_EQ(test, t->wifi_drv->bss_index_miss, 1);
+}
+
+/* Connect locked to a BSSID that is not known fails instead of going to another BSS of the ESS */
+static void wifi_drv_test_connect_fixed_bssid(struct kunit *test) {
+    struct wifi_drv_test *t = test->priv;
+    struct cfg80211_connect_params sme;
+
+    wifi_drv_test_sme(&sme, SSID_DUMMY);
+    sme.bssid = wifi_drv_test_unknown_bssid;
+    KUNIT_ASSERT_EQ(test, nvf_connect(t->wifi_drv->wifi, t->wifi_drv->ndev, &sme), 0);
+    KUNIT_ASSERT_TRUE(test, wifi_drv_test_wait(t, WIFI_DRV_REPORT_CONNECT_TIMEOUT, 1));
+    wifi_drv_test_flush(t);
+    KUNIT_EXPECT_EQ(test, wifi_drv_test_count(t, WIFI_DRV_REPORT_CONNECT), 0);
+    KUNIT_EXPECT_FALSE(test, t->wifi_drv->connected);
+}
+
+/* BSSID hint that is not known falls back to the best BSS of the ESS */
+static void wifi_drv_test_connect_bssid_hint(struct kunit *test) {
+    struct wifi_drv_test *t = test->priv;
+    struct cfg80211_connect_params sme;
+
+    wifi_drv_test_sme(&sme, SSID_DUMMY);
+    sme.bssid_hint = wifi_drv_test_unknown_bssid;
+    KUNIT_ASSERT_EQ(test, nvf_connect(t->wifi_drv->wifi, t->wifi_drv->ndev, &sme), 0);
+    KUNIT_ASSERT_TRUE(test, wifi_drv_test_wait(t, WIFI_DRV_REPORT_CONNECT, 1));
+    KUNIT_EXPECT_MEMEQ(test, t->bssid, g_bss_population.bss[0].bssid, ETH_ALEN);
+}
+
+/* Connect with prev_bssid while not connected is a plain connect, it is not left hanging */
+static void wifi_drv_test_connect_prev_bssid(struct kunit *test) {
+    struct wifi_drv_test *t = test->priv;
+    struct cfg80211_connect_params sme;
+
+    wifi_drv_test_sme(&sme, SSID_DUMMY);
+    sme.prev_bssid = g_bss_population.bss[0].bssid;
+    KUNIT_ASSERT_EQ(test, nvf_connect(t->wifi_drv->wifi, t->wifi_drv->ndev, &sme), 0);
+    KUNIT_ASSERT_TRUE(test, wifi_drv_test_wait(t, WIFI_DRV_REPORT_CONNECT, 1));
+    wifi_drv_test_flush(t);
+    KUNIT_EXPECT_TRUE(test, t->wifi_drv->connected);
+    KUNIT_EXPECT_EQ(test, wifi_drv_test_total(t), 1);
+}
+
+/* Requested roam moves the connection to the other BSS of the ESS, with no other BSS it ends the connection */
+static void wifi_drv_test_roam(struct kunit *test) {
+    struct wifi_drv_test *t = test->priv;
+    struct wifi_drv_bss other = g_bss_population.bss[0];
+    struct cfg80211_connect_params sme;
+
+    /* the second BSS of the dummy network, weaker so connect picks the dummy one. The workqueue is idle. */
+    other.bssid[5] ^= 0x01;
+    other.signal -= 1000;
+    inform_dummy_bss(t->wifi_drv);
+    wifi_drv_bss_index_add(t->wifi_drv, &other);
+
+    wifi_drv_test_connect(test, t);
+    KUNIT_EXPECT_MEMEQ(test, t->bssid, g_bss_population.bss[0].bssid, ETH_ALEN);
+
+    wifi_drv_test_sme(&sme, SSID_DUMMY);
+    sme.prev_bssid = t->wifi_drv->conn_bssid;
+    KUNIT_ASSERT_EQ(test, nvf_connect(t->wifi_drv->wifi, t->wifi_drv->ndev, &sme), 0);
+    KUNIT_ASSERT_TRUE(test, wifi_drv_test_wait(t, WIFI_DRV_REPORT_ROAMED, 1));
+    wifi_drv_test_flush(t);
+    KUNIT_EXPECT_MEMEQ(test, t->bssid, other.bssid, ETH_ALEN);
+    KUNIT_EXPECT_MEMEQ(test, t->wifi_drv->conn_bssid, other.bssid, ETH_ALEN);
+    KUNIT_EXPECT_EQ(test, t->wifi_drv->roams, 1);
+
+    /* locked to a BSS that is not known: the roam fails and the connection is ended */
+    sme.prev_bssid = t->wifi_drv->conn_bssid;
+    sme.bssid = wifi_drv_test_unknown_bssid;
+    KUNIT_ASSERT_EQ(test, nvf_connect(t->wifi_drv->wifi, t->wifi_drv->ndev, &sme), 0);
+    KUNIT_ASSERT_TRUE(test, wifi_drv_test_wait(t, WIFI_DRV_REPORT_DISCONNECTED, 1));
+    wifi_drv_test_flush(t);
+    KUNIT_EXPECT_FALSE(test, t->wifi_drv->connected);
+    KUNIT_EXPECT_EQ(test, t->wifi_drv->roams_failed, 1);
+}
+
+/* Makes association take long enough for the test to act while it is pending, restored by the caller */
+static unsigned int wifi_drv_test_slow_assoc(void) {
+    unsigned int old = READ_ONCE(assoc_frame_us);
+
+    /* 16 frames of the full connect, about a second */
+    WRITE_ONCE(assoc_frame_us, 60 * USEC_PER_MSEC);
+    return old;
+}
+
+/* Disconnect while association is pending ends the connect with a timeout and nothing else */
+static void wifi_drv_test_disconnect_during_assoc(struct kunit *test) {
+    struct wifi_drv_test *t = test->priv;
+    unsigned int old = wifi_drv_test_slow_assoc();
+    struct cfg80211_connect_params sme;
+
+    wifi_drv_test_sme(&sme, SSID_DUMMY);
+    KUNIT_ASSERT_EQ(test, nvf_connect(t->wifi_drv->wifi, t->wifi_drv->ndev, &sme), 0);
+    wifi_drv_test_flush(t);
+    WRITE_ONCE(assoc_frame_us, old);
+    KUNIT_EXPECT_TRUE(test, t->wifi_drv->assoc_pending);
+
+    KUNIT_ASSERT_EQ(test, nvf_disconnect(t->wifi_drv->wifi, t->wifi_drv->ndev, WLAN_REASON_DEAUTH_LEAVING), 0);
+    KUNIT_ASSERT_TRUE(test, wifi_drv_test_wait(t, WIFI_DRV_REPORT_CONNECT_TIMEOUT, 1));
+    wifi_drv_test_flush(t);
+    KUNIT_EXPECT_FALSE(test, t->wifi_drv->assoc_pending);
+    KUNIT_EXPECT_FALSE(test, t->wifi_drv->connected);
+    KUNIT_EXPECT_EQ(test, wifi_drv_test_total(t), 1);
+}
+
+/* Scan requested during association completes while association is still pending: the workqueue is not blocked */
+static void wifi_drv_test_scan_during_assoc(struct kunit *test) {
+    struct wifi_drv_test *t = test->priv;
+    struct cfg80211_scan_request *request = wifi_drv_test_scan_request(test, t, 1);
+    unsigned int old = wifi_drv_test_slow_assoc();
+    struct cfg80211_connect_params sme;
+
+    wifi_drv_test_sme(&sme, SSID_DUMMY);
+    KUNIT_ASSERT_EQ(test, nvf_connect(t->wifi_drv->wifi, t->wifi_drv->ndev, &sme), 0);
+    wifi_drv_test_flush(t);
+    WRITE_ONCE(assoc_frame_us, old);
+
+    KUNIT_ASSERT_EQ(test, nvf_scan(t->wifi_drv->wifi, request), 0);
+    KUNIT_ASSERT_TRUE(test, wifi_drv_test_wait(t, WIFI_DRV_REPORT_SCAN_DONE, 1));
+    KUNIT_EXPECT_EQ(test, wifi_drv_test_count(t, WIFI_DRV_REPORT_CONNECT), 0);
+
+    KUNIT_ASSERT_TRUE(test, wifi_drv_test_wait(t, WIFI_DRV_REPORT_CONNECT, 1));
+    wifi_drv_test_flush(t);
+    KUNIT_EXPECT_TRUE(test, t->wifi_drv->connected);
+    KUNIT_EXPECT_EQ(test, wifi_drv_test_total(t), 2);
+}
+
+/* Connect requested during scan completes, scan is finished normally */
+static void wifi_drv_test_connect_during_scan(struct kunit *test) {
+    struct wifi_drv_test *t = test->priv;
+    struct cfg80211_scan_request *request = wifi_drv_test_scan_request(test, t, 4);
+
+    KUNIT_ASSERT_EQ(test, nvf_scan(t->wifi_drv->wifi, request), 0);
+    wifi_drv_test_connect(test, t);
+    KUNIT_ASSERT_TRUE(test, wifi_drv_test_wait(t, WIFI_DRV_REPORT_SCAN_DONE, 1));
+    wifi_drv_test_flush(t);
+    KUNIT_EXPECT_EQ(test, wifi_drv_test_count(t, WIFI_DRV_REPORT_SCAN_ABORTED), 0);
+    KUNIT_EXPECT_EQ(test, wifi_drv_test_total(t), 2);
+}
+
+/* Returns interface of the radio other than the primary one and "except", called under RTNL */
+static struct net_device *wifi_drv_test_other_iface(struct wifi_drv_context *wifi_drv, struct net_device *except) {
+    struct wifi_drv_iface *iface;
+
+    list_for_each_entry(iface, &wifi_drv->ifaces, list) {
+        if (iface->ndev != wifi_drv->ndev && iface->ndev != except) {
+            return iface->ndev;
+        }
+    }
+    return NULL;
+}
+
+/* One AP per radio, it is the loopback peer of the primary STA interface whichever way it became an AP.
+ * Runs under RTNL like the kernel calls these ops, so failures are only expected: the test can't leave with the lock. */
+static void wifi_drv_test_ap(struct kunit *test) {
+    struct wifi_drv_test *t = test->priv;
+    struct wifi_drv_context *wifi_drv = t->wifi_drv;
+    struct wifi *wifi = wifi_drv->wifi;
+    struct cfg80211_connect_params sme;
+    struct net_device *ap, *sta;
+
+    wifi_drv_test_sme(&sme, SSID_DUMMY);
+    rtnl_lock();
+    KUNIT_EXPECT_EQ(test, nvf_add_virtual_intf(wifi, NULL, NL80211_IFTYPE_AP, "wdt%d", NET_NAME_ENUM), 0);
+    KUNIT_EXPECT_EQ(test, nvf_add_virtual_intf(wifi, NULL, NL80211_IFTYPE_AP, "wdt%d", NET_NAME_ENUM), -EBUSY);
+    KUNIT_EXPECT_EQ(test, nvf_add_virtual_intf(wifi, NULL, NL80211_IFTYPE_STATION, "wdt%d", NET_NAME_ENUM), 0);
+    ap = rtnl_dereference(wifi_drv->ap_ndev);
+    sta = wifi_drv_test_other_iface(wifi_drv, ap);
+    KUNIT_EXPECT_NOT_NULL(test, ap);
+    KUNIT_EXPECT_NOT_NULL(test, sta);
+    if (ap == NULL || sta == NULL) {
+        goto l_out;
+    }
+    KUNIT_EXPECT_TRUE(test, wifi_drv->ap_mode_enabled);
+    KUNIT_EXPECT_EQ(test, wifi_drv->n_ifaces, 3);
+
+    /* the secondary STA has no loopback peer, the pair is the primary STA and the AP */
+    rcu_read_lock_bh();
+    KUNIT_EXPECT_PTR_EQ(test, wifi_drv_get_peer(wifi_drv->ndev), ap);
+    KUNIT_EXPECT_PTR_EQ(test, wifi_drv_get_peer(ap), wifi_drv->ndev);
+    KUNIT_EXPECT_NULL(test, wifi_drv_get_peer(sta));
+    rcu_read_unlock_bh();
+
+    /* only the primary STA connects, nothing is reported for the secondary one */
+    KUNIT_EXPECT_EQ(test, nvf_connect(wifi, sta, &sme), -EOPNOTSUPP);
+    KUNIT_EXPECT_EQ(test, nvf_disconnect(wifi, sta, WLAN_REASON_DEAUTH_LEAVING), -EOPNOTSUPP);
+    KUNIT_EXPECT_EQ(test, wifi_drv_test_total(t), 0);
+
+    KUNIT_EXPECT_EQ(test, nvf_change_virtual_intf(wifi, sta, NL80211_IFTYPE_AP), -EBUSY);
+    KUNIT_EXPECT_EQ(test, nvf_change_virtual_intf(wifi, wifi_drv->ndev, NL80211_IFTYPE_AP), -EOPNOTSUPP);
+    KUNIT_EXPECT_EQ(test, wifi_drv->ndev->ieee80211_ptr->iftype, NL80211_IFTYPE_STATION);
+
+    /* AP -> STA detaches it from the loopback, then the other interface may become the AP */
+    KUNIT_EXPECT_EQ(test, nvf_change_virtual_intf(wifi, ap, NL80211_IFTYPE_STATION), 0);
+    KUNIT_EXPECT_NULL(test, rtnl_dereference(wifi_drv->ap_ndev));
+    KUNIT_EXPECT_FALSE(test, wifi_drv->ap_mode_enabled);
+    KUNIT_EXPECT_EQ(test, nvf_change_virtual_intf(wifi, sta, NL80211_IFTYPE_AP), 0);
+    KUNIT_EXPECT_PTR_EQ(test, rtnl_dereference(wifi_drv->ap_ndev), sta);
+    KUNIT_EXPECT_EQ(test, nvf_change_virtual_intf(wifi, ap, NL80211_IFTYPE_AP), -EBUSY);
+
+    /* deleting the AP detaches it, the primary interface can't be deleted */
+    nvf_del_virtual_intf(wifi, sta);
+    KUNIT_EXPECT_NULL(test, rtnl_dereference(wifi_drv->ap_ndev));
+    nvf_del_virtual_intf(wifi, wifi_drv->ndev);
+    KUNIT_EXPECT_EQ(test, wifi_drv->n_ifaces, 2);
+    l_out:
+    rtnl_unlock();
+}
+
+static struct kunit_case wifi_drv_test_cases[] = {
+        KUNIT_CASE(wifi_drv_test_scan),
+        KUNIT_CASE(wifi_drv_test_scan_busy),
+        KUNIT_CASE(wifi_drv_test_scan_abort),
+        KUNIT_CASE(wifi_drv_test_scan_abort_late),
+        KUNIT_CASE(wifi_drv_test_scan_bench),
+        KUNIT_CASE(wifi_drv_test_connect_disconnect),
+        KUNIT_CASE(wifi_drv_test_connect_unknown_ssid),
+        KUNIT_CASE(wifi_drv_test_connect_fixed_bssid),
+        KUNIT_CASE(wifi_drv_test_connect_bssid_hint),
+        KUNIT_CASE(wifi_drv_test_connect_prev_bssid),
+        KUNIT_CASE(wifi_drv_test_roam),
+        KUNIT_CASE(wifi_drv_test_disconnect_during_assoc),
+        KUNIT_CASE(wifi_drv_test_scan_during_assoc),
+        KUNIT_CASE(wifi_drv_test_connect_during_scan),
+        KUNIT_CASE(wifi_drv_test_ap),
+        {}
+};
+
+static struct kunit_suite wifi_drv_test_suite = {
+        .name = "wifi_drv",
+        .init = wifi_drv_test_init,
+        .exit = wifi_drv_test_exit,
+        .test_cases = wifi_drv_test_cases,
+};
+
+kunit_test_suite(wifi_drv_test_suite);
@@ -0,0 +1,79 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM wifi_drv
+
+#ifndef _WIFI_DRV_TRACE_OPS_H
+#define _WIFI_DRV_TRACE_OPS_H
+/* Control-plane operations of the driver that are traced and measured, see wifi_drv_op_begin()/wifi_drv_op_end(). */
+enum wifi_drv_op {
+    WIFI_DRV_OP_SCAN,
+    WIFI_DRV_OP_CONNECT,
+    WIFI_DRV_OP_DISCONNECT,
+    WIFI_DRV_OP_START_AP,
+    WIFI_DRV_OP_STOP_AP,
+    WIFI_DRV_OP_ROAM,
+    WIFI_DRV_OP_MAX,
+};
+#endif
+
+#if !defined(_WIFI_DRV_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _WIFI_DRV_TRACE_H
+
+#include <linux/tracepoint.h>
+
+TRACE_DEFINE_ENUM(WIFI_DRV_OP_SCAN);
+TRACE_DEFINE_ENUM(WIFI_DRV_OP_CONNECT);
+TRACE_DEFINE_ENUM(WIFI_DRV_OP_DISCONNECT);
+TRACE_DEFINE_ENUM(WIFI_DRV_OP_START_AP);
+TRACE_DEFINE_ENUM(WIFI_DRV_OP_STOP_AP);
+TRACE_DEFINE_ENUM(WIFI_DRV_OP_ROAM);
+
+#define wifi_drv_show_op(op) __print_symbolic(op, \
+        { WIFI_DRV_OP_SCAN, "scan" }, \
+        { WIFI_DRV_OP_CONNECT, "connect" }, \
+        { WIFI_DRV_OP_DISCONNECT, "disconnect" }, \
+        { WIFI_DRV_OP_START_AP, "start_ap" }, \
+        { WIFI_DRV_OP_STOP_AP, "stop_ap" }, \
+        { WIFI_DRV_OP_ROAM, "roam" })
+
+/* cfg80211 callback of the operation is entered */
+TRACE_EVENT(wifi_drv_op_begin,
+        TP_PROTO(const char *wifi, enum wifi_drv_op op),
+        TP_ARGS(wifi, op),
+        TP_STRUCT__entry(
+                __string(wifi, wifi)
+                __field(int, op)
+        ),
+        TP_fast_assign(
+                __assign_str(wifi);
+                __entry->op = op;
+        ),
+        TP_printk("%s %s", __get_str(wifi), wifi_drv_show_op(__entry->op))
+);
+
+/* operation is reported to the kernel as completed, latency is counted from wifi_drv_op_begin */
+TRACE_EVENT(wifi_drv_op_end,
+        TP_PROTO(const char *wifi, enum wifi_drv_op op, u64 latency_ns, int status),
+        TP_ARGS(wifi, op, latency_ns, status),
+        TP_STRUCT__entry(
+                __string(wifi, wifi)
+                __field(int, op)
+                __field(u64, latency_ns)
+                __field(int, status)
+        ),
+        TP_fast_assign(
+                __assign_str(wifi);
+                __entry->op = op;
+                __entry->latency_ns = latency_ns;
+                __entry->status = status;
+        ),
+        TP_printk("%s %s latency=%lluns status=%d", __get_str(wifi), wifi_drv_show_op(__entry->op),
+                  __entry->latency_ns, __entry->status)
+);
+
+#endif /* _WIFI_DRV_TRACE_H */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE wifi_trace
+#include <trace/define_trace.h>